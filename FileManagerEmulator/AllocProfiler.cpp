@@ -0,0 +1,260 @@
+#include "AllocProfiler.h"
+
+#ifdef ALLOC_PROFILE_ENABLED
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace AllocProfiler
+{
+    namespace
+    {
+        const unsigned MaxTags = 64;
+        const size_t MaxTagSize = 16;
+
+        // Keeps allocations aligned as malloc does
+        struct alignas(16) Header
+        {
+            size_t size;
+            unsigned tags[2];   // By category
+        };
+
+        struct Stats
+        {
+            std::atomic<size_t> allocations;
+            std::atomic<size_t> bytes;
+            std::atomic<size_t> live;
+            std::atomic<size_t> liveBytes;
+        };
+
+        // Tag 0 of each category is for allocations made out of any scope.
+        // Static zero initialization only, so it's ready before any constructor runs.
+        struct Registry
+        {
+            std::atomic<unsigned> count[2];
+            char names[2][MaxTags][MaxTagSize];
+            Stats stats[2][MaxTags];
+        };
+
+        Registry registry;
+        std::mutex registryMutex;
+
+        thread_local unsigned currentTags[2] = { 0, 0 };
+
+        size_t index(Category category)
+        {
+            return category == Category::eCommand ? 0 : 1;
+        }
+
+        // Finds or registers tag, full registry falls back to "other"
+        unsigned tagId(Category category, const char* tag, size_t size)
+        {
+            const auto cat = index(category);
+            if(size >= MaxTagSize) size = MaxTagSize - 1;
+
+            const auto matches = [&](unsigned id)
+            {
+                const auto name = registry.names[cat][id];
+                return std::strncmp(name, tag, size) == 0 && name[size] == '\0';
+            };
+
+            auto count = registry.count[cat].load(std::memory_order_acquire);
+            for(unsigned id = 1; id < count; ++id)
+            {
+                if(matches(id)) return id;
+            }
+
+            std::lock_guard<std::mutex> lock(registryMutex);
+
+            count = registry.count[cat].load(std::memory_order_relaxed);
+            if(count == 0) count = 1;
+
+            for(unsigned id = 1; id < count; ++id)
+            {
+                if(matches(id)) return id;
+            }
+
+            if(count == MaxTags) return 0;
+
+            std::memcpy(registry.names[cat][count], tag, size);
+            registry.names[cat][count][size] = '\0';
+            registry.count[cat].store(count + 1, std::memory_order_release);
+
+            return count;
+        }
+
+        void* allocate(size_t size)
+        {
+            const auto header = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+            if(!header) return nullptr;
+
+            header->size = size;
+            for(size_t cat = 0; cat < 2; ++cat)
+            {
+                const auto tag = currentTags[cat];
+                header->tags[cat] = tag;
+
+                auto& stats = registry.stats[cat][tag];
+                stats.allocations.fetch_add(1, std::memory_order_relaxed);
+                stats.bytes.fetch_add(size, std::memory_order_relaxed);
+                stats.live.fetch_add(1, std::memory_order_relaxed);
+                stats.liveBytes.fetch_add(size, std::memory_order_relaxed);
+            }
+
+            return header + 1;
+        }
+
+        // Freed bytes are accounted to the scopes memory was allocated in
+        void deallocate(void* ptr)
+        {
+            if(!ptr) return;
+
+            const auto header = static_cast<Header*>(ptr) - 1;
+            for(size_t cat = 0; cat < 2; ++cat)
+            {
+                auto& stats = registry.stats[cat][header->tags[cat]];
+                stats.live.fetch_sub(1, std::memory_order_relaxed);
+                stats.liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+            }
+
+            std::free(header);
+        }
+
+        void* allocateOrThrow(size_t size)
+        {
+            while(true)
+            {
+                const auto ptr = allocate(size);
+                if(ptr) return ptr;
+
+                const auto handler = std::get_new_handler();
+                if(!handler) throw std::bad_alloc();
+                handler();
+            }
+        }
+
+        void reportCategory(std::FILE* out, size_t cat, const char* title)
+        {
+            std::fprintf(out, "%-16s %12s %14s %10s %12s\n", title, "allocations", "bytes", "live", "live bytes");
+
+            const auto count = registry.count[cat].load(std::memory_order_acquire);
+            for(unsigned id = 0; id < (count ? count : 1); ++id)
+            {
+                const auto& stats = registry.stats[cat][id];
+                if(stats.allocations == 0) continue;
+
+                std::fprintf(out, "%-16s %12zu %14zu %10zu %12zu\n", id ? registry.names[cat][id] : "<other>",
+                    stats.allocations.load(), stats.bytes.load(), stats.live.load(), stats.liveBytes.load());
+            }
+        }
+
+        // Everything allocated within a scope and still alive at exit is a leak
+        void reportAtExit()
+        {
+            report(stderr);
+
+            size_t leaks = 0;
+            for(size_t cat = 0; cat < 2; ++cat)
+            {
+                const auto count = registry.count[cat].load(std::memory_order_acquire);
+                for(unsigned id = 1; id < count; ++id)
+                {
+                    const auto& stats = registry.stats[cat][id];
+                    if(stats.live == 0) continue;
+
+                    std::fprintf(stderr, "Leak: %zu object(s), %zu bytes allocated in %s\n",
+                        stats.live.load(), stats.liveBytes.load(), registry.names[cat][id]);
+                    ++leaks;
+                }
+            }
+
+            if(leaks == 0) std::fprintf(stderr, "No leaks detected\n");
+        }
+    }
+
+    Scope::Scope(Category category, const char* tag):
+        category_(category), previous_(currentTags[index(category)])
+    {
+        currentTags[index(category)] = tagId(category, tag, std::strlen(tag));
+    }
+
+    Scope::Scope(Category category, const std::string& tag):
+        category_(category), previous_(currentTags[index(category)])
+    {
+        currentTags[index(category)] = tagId(category, tag.data(), tag.size());
+    }
+
+    Scope::~Scope()
+    {
+        currentTags[index(category_)] = previous_;
+    }
+
+    void report(std::FILE* out)
+    {
+        reportCategory(out, 0, "Command");
+        reportCategory(out, 1, "Object");
+        std::fflush(out);
+    }
+
+    bool enableLeakReport()
+    {
+        // Registered during static initialization, so runs after function local statics are gone
+        return std::atexit(&reportAtExit) == 0;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void* operator new(size_t size)
+{
+    return AllocProfiler::allocateOrThrow(size);
+}
+
+void* operator new[](size_t size)
+{
+    return AllocProfiler::allocateOrThrow(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return AllocProfiler::allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return AllocProfiler::allocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    AllocProfiler::deallocate(ptr);
+}
+
+#endif // ALLOC_PROFILE_ENABLED
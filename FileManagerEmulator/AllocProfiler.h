@@ -0,0 +1,61 @@
+#pragma once
+
+// Opt-in allocation profiler, build with -DALLOC_PROFILE to enable (not available on Windows,
+// CRT debug heap is used there). Global operator new/delete are replaced, every allocation is
+// attributed to the innermost command scope and the innermost object scope alive in its thread.
+// Statistics and leaks are reported to stderr at exit.
+
+#if defined(ALLOC_PROFILE) && !defined(_WIN32)
+
+#define ALLOC_PROFILE_ENABLED
+
+#include <cstdio>
+#include <string>
+
+namespace AllocProfiler
+{
+    enum class Category
+    {
+        eCommand,   // Command type, e.g. "md"
+        eObject     // Item subclass, e.g. "Directory"
+    };
+
+    class Scope
+    {
+    public:
+        // Tags are registered on first use, number of distinct tags is limited
+        Scope(Category category, const char* tag);
+        Scope(Category category, const std::string& tag);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Category category_;
+        unsigned previous_;
+    };
+
+    // Allocations, bytes and live objects per tag
+    void report(std::FILE* out);
+
+    // Registers report of statistics and leaks at exit
+    bool enableLeakReport();
+}
+
+#define ALLOC_PROFILE_CONCAT_IMPL(a, b) a##b
+#define ALLOC_PROFILE_CONCAT(a, b) ALLOC_PROFILE_CONCAT_IMPL(a, b)
+
+#define ALLOC_PROFILE_COMMAND(tag) \
+    AllocProfiler::Scope ALLOC_PROFILE_CONCAT(allocProfileScope, __LINE__)(AllocProfiler::Category::eCommand, tag)
+
+#define ALLOC_PROFILE_OBJECT(tag) \
+    AllocProfiler::Scope ALLOC_PROFILE_CONCAT(allocProfileScope, __LINE__)(AllocProfiler::Category::eObject, tag)
+
+#else // Profiling disabled
+
+// Tag is not evaluated, but counts as used
+#define ALLOC_PROFILE_COMMAND(tag) static_cast<void>(sizeof(tag))
+#define ALLOC_PROFILE_OBJECT(tag) static_cast<void>(sizeof(tag))
+
+#endif // ALLOC_PROFILE
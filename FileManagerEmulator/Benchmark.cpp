@@ -0,0 +1,614 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utils.h"
+#include "FileSystem.h"
+#include "FileSystemManager.h"
+#include "FrozenTree.h"
+
+#ifdef __linux__
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HEAP_USAGE_AVAILABLE
+#endif
+
+namespace Benchmark
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    // Discards everything, so only rendering itself is measured
+    class NullBuffer: public std::streambuf
+    {
+    protected:
+        virtual int overflow(int c) override
+        {
+            return c;
+        }
+
+        virtual std::streamsize xsputn(const char*, std::streamsize count) override
+        {
+            return count;
+        }
+    };
+
+    template <typename Func>
+    static double measure(size_t loops, const Func& func)
+    {
+        func(); // Warm-up
+
+        const auto start = Clock::now();
+        for(size_t i = 0; i < loops; ++i) func();
+        const auto end = Clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / loops;
+    }
+
+    static void report(const std::string& name, double ms)
+    {
+        std::cout << std::left << std::setw(40) << name
+            << std::right << std::setw(12) << ms << " ms" << std::endl;
+    }
+
+    // Wide tree script: width^depth directories at the bottom level, each with a file
+    static std::string wideTreeScript(const std::string& root, size_t width, size_t depth)
+    {
+        std::ostringstream script;
+        script << "MD " << root << "\n";
+
+        std::vector<std::string> level(1, root);
+        for(size_t d = 0; d < depth; ++d)
+        {
+            std::vector<std::string> next;
+            for(const auto& dir : level)
+            {
+                for(size_t i = 0; i < width; ++i)
+                {
+                    next.push_back(dir + "\\D" + std::to_string(i));
+                    script << "MD " << next.back() << "\n";
+                }
+            }
+            level.swap(next);
+        }
+
+        for(const auto& dir : level) script << "MF " << dir << "\\F.TXT\n";
+
+        return script.str();
+    }
+
+    static size_t countItems(const FileSystem::Composite& dir, bool sorted)
+    {
+        size_t count = 0;
+        std::vector<const FileSystem::Composite*> stack(1, &dir);
+
+        const auto countItem = [&](const FileSystem::ItemPtr& item, size_t, size_t)
+        {
+            ++count;
+            if(item->asComposite()) stack.push_back(item->asComposite());
+            return true;
+        };
+
+        while(!stack.empty())
+        {
+            const auto cur = stack.back();
+            stack.pop_back();
+            cur->forEach(countItem, sorted);
+        }
+
+        return count;
+    }
+
+    static size_t countItemsErased(const FileSystem::Composite& dir, bool sorted)
+    {
+        size_t count = 0;
+        std::vector<const FileSystem::Composite*> stack(1, &dir);
+
+        const FileSystem::ConstIterateFunction countItem =
+            [&](const FileSystem::ItemPtr& item, size_t, size_t)
+        {
+            ++count;
+            if(item->asComposite()) stack.push_back(item->asComposite());
+            return true;
+        };
+
+        while(!stack.empty())
+        {
+            const auto cur = stack.back();
+            stack.pop_back();
+            cur->iterate(countItem, sorted);
+        }
+
+        return count;
+    }
+
+    static void iterationBenchmark(size_t width, size_t depth)
+    {
+        using namespace FileSystem;
+
+        // Build the tree directly, script parsing is not measured here
+        const auto root = Item::create(ItemType::eDrive);
+        root->setName("C:");
+
+        std::vector<ItemPtr> level(1, root);
+        for(size_t d = 0; d < depth; ++d)
+        {
+            std::vector<ItemPtr> next;
+            for(const auto& dir : level)
+            {
+                for(size_t i = 0; i < width; ++i)
+                {
+                    next.push_back(Item::create(ItemType::eDirectory));
+                    next.back()->setName("D" + std::to_string(i));
+                    dir->asComposite()->addChild(next.back());
+                }
+            }
+            level.swap(next);
+        }
+
+        const Composite& dir = *root->asComposite();
+        volatile size_t sink = 0;
+
+        report("iterate, std::function", measure(10, [&]{ sink = countItemsErased(dir, false); }));
+        report("forEach, template", measure(10, [&]{ sink = countItems(dir, false); }));
+        report("iterate sorted, std::function", measure(3, [&]{ sink = countItemsErased(dir, true); }));
+        report("forEach sorted, template", measure(3, [&]{ sink = countItems(dir, true); }));
+    }
+
+    static void managerBenchmark(size_t width, size_t depth)
+    {
+        FileSystem::Manager manager;
+
+        std::istringstream script(wideTreeScript("C:\\T", width, depth));
+        manager.process(script);
+
+        NullBuffer nullBuffer;
+        std::ostream nullStream(&nullBuffer);
+
+        report("printTree", measure(5, [&]{ manager.output(nullStream); }));
+        report("TREE C:\\T, depth 2, 4 entries", measure(5, [&]{ manager.tree(nullStream, "C:\\T", 2, 4); }));
+
+        report("COPY + DELTREE", measure(5, [&]
+        {
+            std::istringstream copy("COPY C:\\T C:\\T\\D0\nDELTREE C:\\T\\D0\\T\n");
+            manager.process(copy);
+        }));
+    }
+
+    static void buildBenchmark(size_t count)
+    {
+        FileSystem::Manager::BuildItems items;
+        items.reserve(count + count / 1000);
+
+        // 1000 files per directory, input is sorted
+        for(size_t i = 0; i < count / 1000; ++i)
+        {
+            const auto dir = "C:\\D" + std::to_string(1000000 + i);
+            items.push_back({ dir, FileSystem::ItemType::eDirectory });
+            for(size_t j = 0; j < 1000; ++j)
+            {
+                items.push_back({ dir + "\\F" + std::to_string(1000 + j), FileSystem::ItemType::eFile });
+            }
+        }
+
+        report("build " + std::to_string(items.size()) + " items", measure(1, [&]
+        {
+            FileSystem::Manager manager;
+            manager.build(items);
+        }));
+
+        report("MF range " + std::to_string(count) + " items", measure(1, [&]
+        {
+            FileSystem::Manager manager;
+            std::istringstream script("MD DATA\nMF C:\\DATA\\F{1.." + std::to_string(count) + "}.DAT\n");
+            manager.process(script);
+        }));
+    }
+
+    // Commands spread evenly over drives, each drive gets the same layout
+    static std::string drivesScript(size_t drives, size_t files)
+    {
+        const size_t filesPerDir = 100;
+        const size_t dirs = files / drives / filesPerDir;
+
+        std::ostringstream script;
+        for(size_t d = 0; d < dirs; ++d)
+        {
+            for(size_t i = 0; i < drives; ++i)
+            {
+                script << "MD " << static_cast<char>('C' + i) << ":\\D" << d << "\n";
+            }
+
+            for(size_t f = 0; f < filesPerDir; ++f)
+            {
+                for(size_t i = 0; i < drives; ++i)
+                {
+                    script << "MF " << static_cast<char>('C' + i) << ":\\D" << d << "\\F" << f << ".TXT\n";
+                }
+            }
+        }
+
+        return script.str();
+    }
+
+    static void drivesBenchmark(size_t files)
+    {
+        std::cout << "Commands per second, " << files << " files" << std::endl;
+
+        for(size_t drives = 1; drives <= 8; drives *= 2)
+        {
+            const auto script = drivesScript(drives, files);
+            const auto commands = static_cast<double>(std::count(script.cbegin(), script.cend(), '\n'));
+
+            const auto sequential = measure(1, [&]
+            {
+                FileSystem::Manager manager;
+                std::istringstream in(script);
+                manager.process(in);
+            });
+
+            const auto parallel = measure(1, [&]
+            {
+                FileSystem::Manager manager;
+                std::istringstream in(script);
+                manager.processParallel({ &in });
+            });
+
+            std::cout << std::setw(2) << drives << " drive(s): sequential "
+                << std::setw(10) << commands * 1000 / sequential << ", parallel "
+                << std::setw(10) << commands * 1000 / parallel << std::endl;
+        }
+    }
+
+    // Writers on the same drive, each within its own directory: drive scheduler serializes
+    // them, concurrent executor locks directories along paths only
+    static void writersBenchmark(size_t files)
+    {
+        std::cout << "Commands per second, " << files << " files on one drive" << std::endl;
+
+        const size_t filesPerDir = 100;
+
+        for(size_t writers = 1; writers <= 8; writers *= 2)
+        {
+            std::vector<std::string> scripts(writers);
+            double commands = 0;
+
+            for(size_t w = 0; w < writers; ++w)
+            {
+                const auto root = "C:\\W" + std::to_string(w);
+
+                std::ostringstream script;
+                for(size_t d = 0; d < files / writers / filesPerDir; ++d)
+                {
+                    const auto dir = root + "\\D" + std::to_string(d);
+                    script << "MD " << dir << "\n";
+                    for(size_t f = 0; f < filesPerDir; ++f) script << "MF " << dir << "\\F" << f << ".TXT\n";
+                    if(d % 2 == 1) script << "COPY " << dir << " " << root << "\\D" << d - 1 << "\n";
+                }
+
+                scripts[w] = script.str();
+                commands += std::count(scripts[w].cbegin(), scripts[w].cend(), '\n');
+            }
+
+            std::string setup;
+            for(size_t w = 0; w < writers; ++w) setup += "MD C:\\W" + std::to_string(w) + "\n";
+
+            const auto measureWith = [&](void (FileSystem::Manager::*process)(const std::vector<std::istream*>&))
+            {
+                return measure(1, [&]
+                {
+                    FileSystem::Manager manager;
+                    std::istringstream setupIn(setup);
+                    manager.process(setupIn);
+
+                    std::vector<std::unique_ptr<std::istringstream>> ins;
+                    std::vector<std::istream*> inputs;
+                    for(const auto& script : scripts)
+                    {
+                        ins.emplace_back(new std::istringstream(script));
+                        inputs.push_back(ins.back().get());
+                    }
+
+                    (manager.*process)(inputs);
+                });
+            };
+
+            const auto parallel = measureWith(&FileSystem::Manager::processParallel);
+            const auto concurrent = measureWith(&FileSystem::Manager::processConcurrent);
+
+            std::cout << std::setw(2) << writers << " writer(s): parallel "
+                << std::setw(10) << commands * 1000 / parallel << ", concurrent "
+                << std::setw(10) << commands * 1000 / concurrent << std::endl;
+        }
+    }
+
+    // Script populating many independent directories, as generated ones usually do
+    static void dependentBenchmark(size_t files)
+    {
+        const size_t dirs = 1000;
+
+        std::ostringstream script;
+        for(size_t d = 0; d < dirs; ++d) script << "MD C:\\U" << d << "\n";
+        for(size_t f = 0; f < files / dirs; ++f)
+        {
+            for(size_t d = 0; d < dirs; ++d) script << "MF C:\\U" << d << "\\F" << f << ".TXT\n";
+        }
+
+        const auto commands = static_cast<double>(dirs + files);
+
+        const auto sequential = measure(1, [&]
+        {
+            FileSystem::Manager manager;
+            std::istringstream in(script.str());
+            manager.process(in);
+        });
+
+        const auto dependent = measure(1, [&]
+        {
+            FileSystem::Manager manager;
+            std::istringstream in(script.str());
+            manager.processDependent(in);
+        });
+
+        std::cout << "Independent commands, " << dirs << " directories: sequential "
+            << std::setw(10) << commands * 1000 / sequential << " cmd/s, dependency analysis "
+            << std::setw(10) << commands * 1000 / dependent << " cmd/s" << std::endl;
+    }
+
+    // DELTREE of a large tree: detached and destroyed in background vs removed item by item,
+    // single dynamic link within the tree makes it removed item by item
+    static void deltreeBenchmark(size_t count)
+    {
+        FileSystem::Manager::BuildItems items;
+        items.reserve(count + count / 100);
+
+        for(size_t i = 0; i < count / 100; ++i)
+        {
+            const auto dir = "C:\\R\\D" + std::to_string(i);
+            items.push_back({ dir, FileSystem::ItemType::eDirectory });
+            for(size_t j = 0; j < 100; ++j) items.push_back({ dir + "\\F" + std::to_string(j), FileSystem::ItemType::eFile });
+        }
+
+        for(const auto linked : { false, true })
+        {
+            FileSystem::Manager manager;
+            std::istringstream setup("MD R\n");
+            manager.process(setup);
+            manager.build(items);
+
+            std::istringstream link(linked ? "MD L\nMDL C:\\R\\D0\\F0 L\n" : "");
+            manager.process(link);
+
+            const auto start = Clock::now();
+            std::istringstream deltree("DELTREE C:\\R\n");
+            manager.process(deltree);
+            const auto removed = Clock::now();
+            FileSystem::waitForReclaim();
+            const auto reclaimed = Clock::now();
+
+            report(std::string("DELTREE ") + std::to_string(items.size()) + (linked ? " items, linked" : " items"),
+                std::chrono::duration<double, std::milli>(removed - start).count());
+            report("  until destroyed", std::chrono::duration<double, std::milli>(reclaimed - start).count());
+        }
+    }
+
+    // Trees differing by a single file: rendering both vs comparing hashes
+    static void compareBenchmark(size_t width, size_t depth)
+    {
+        const auto script = wideTreeScript("C:\\T", width, depth);
+
+        FileSystem::Manager managers[2];
+        for(auto& manager : managers)
+        {
+            std::istringstream in(script);
+            manager.process(in);
+        }
+
+        std::istringstream change("MF C:\\T\\D0\\D0\\EXTRA.TXT\n");
+        managers[1].process(change);
+
+        NullBuffer nullBuffer;
+        std::ostream nullStream(&nullBuffer);
+
+        report("output both trees", measure(5, [&]
+        {
+            std::ostringstream lhs;
+            std::ostringstream rhs;
+            managers[0].output(lhs);
+            managers[1].output(rhs);
+            nullStream << (lhs.str() == rhs.str());
+        }));
+
+        report("compare, one changed", measure(5, [&]{ managers[0].compare(managers[1], nullStream); }));
+
+        // First hash after a change computes changed directories only
+        report("change + compare", measure(5, [&]
+        {
+            std::istringstream touch("MF C:\\T\\D1\\D1\\EXTRA.TXT\nDEL C:\\T\\D1\\D1\\EXTRA.TXT\n");
+            managers[1].process(touch);
+            managers[0].compare(managers[1], nullStream);
+        }));
+    }
+
+#ifdef HEAP_USAGE_AVAILABLE
+    static size_t heapUsage()
+    {
+        return mallinfo2().uordblks;
+    }
+#endif
+
+    // Mutable tree vs its frozen copy: memory, freeze and unfreeze time, lookups
+    static void freezeBenchmark(size_t count)
+    {
+        FileSystem::Manager::BuildItems items;
+        items.reserve(count + count / 100);
+
+        for(size_t i = 0; i < count / 100; ++i)
+        {
+            const auto dir = "C:\\F\\D" + std::to_string(i);
+            items.push_back({ dir, FileSystem::ItemType::eDirectory });
+            for(size_t j = 0; j < 100; ++j) items.push_back({ dir + "\\F" + std::to_string(j), FileSystem::ItemType::eFile });
+        }
+
+#ifdef HEAP_USAGE_AVAILABLE
+        const auto heapBefore = heapUsage();
+#endif
+
+        std::unique_ptr<FileSystem::Manager> manager(new FileSystem::Manager);
+        std::istringstream setup("MD F\n");
+        manager->process(setup);
+        manager->build(items);
+
+#ifdef HEAP_USAGE_AVAILABLE
+        const auto heapTree = heapUsage() - heapBefore;
+#endif
+
+        FileSystem::FrozenTree frozen;
+        report("freeze " + std::to_string(items.size()) + " items", measure(1, [&]{ frozen = manager->freeze(); }));
+
+        report("unfreeze", measure(1, [&]{ manager->unfreeze(frozen); }));
+
+        size_t found = 0;
+        report("find 10000 frozen paths", measure(5, [&]
+        {
+            for(size_t i = 0; i < 10000; ++i) found += frozen.find(items[i * 37 % items.size()].path) != FileSystem::FrozenTree::None;
+        }));
+
+        NullBuffer nullBuffer;
+        std::ostream nullStream(&nullBuffer);
+        report("output frozen", measure(3, [&]{ frozen.output(nullStream); }));
+        report("output mutable", measure(3, [&]{ manager->output(nullStream); }));
+
+#ifdef HEAP_USAGE_AVAILABLE
+        std::cout << "Memory: mutable " << heapTree / 1024 << " KB, frozen " << frozen.memoryUsage() / 1024 << " KB"
+            << std::endl;
+#else
+        std::cout << "Memory: frozen " << frozen.memoryUsage() / 1024 << " KB" << std::endl;
+#endif
+
+        nullStream << found;
+    }
+
+    // Host tree scan, the first (warm-up) run fills the page cache
+    static void importBenchmark(const std::string& hostDir)
+    {
+        std::vector<size_t> threadCounts(1, 1);
+        if(std::thread::hardware_concurrency() > 1) threadCounts.push_back(std::thread::hardware_concurrency());
+
+        for(const auto threads : threadCounts)
+        {
+            FileSystem::Manager::ImportStats stats = {};
+            FileSystem::Manager::ImportOptions options;
+            options.threads = threads;
+
+            const auto ms = measure(1, [&]
+            {
+                FileSystem::Manager manager;
+                stats = manager.import(hostDir, "C:", options);
+            });
+
+            std::cout << "Import " << hostDir << ", " << threads << " thread(s): "
+                << stats.directories + stats.files << " items, " << (stats.directories + stats.files) * 1000 / ms
+                << " items/s" << std::endl;
+        }
+    }
+
+#ifdef __linux__
+    // Creation of host items through io_uring vs thread pool, each run into a fresh directory
+    static void exportBenchmark(size_t count)
+    {
+        FileSystem::Manager::BuildItems items;
+        items.reserve(count + count / 100);
+
+        for(size_t i = 0; i < count / 100; ++i)
+        {
+            const auto dir = "C:\\E\\D" + std::to_string(i);
+            items.push_back({ dir, FileSystem::ItemType::eDirectory });
+            for(size_t j = 0; j < 100; ++j) items.push_back({ dir + "\\F" + std::to_string(j), FileSystem::ItemType::eFile });
+        }
+
+        FileSystem::Manager manager;
+        std::istringstream setup("MD E\n");
+        manager.process(setup);
+        manager.build(items);
+
+        char temp[] = "/tmp/fmeexportXXXXXX";
+        if(!mkdtemp(temp)) return;
+
+        for(const bool ioUring : { true, false })
+        {
+            const auto hostDir = std::string(temp) + (ioUring ? "/ring" : "/pool");
+
+            FileSystem::Manager::ExportStats stats = {};
+            FileSystem::Manager::ExportOptions options;
+            options.ioUring = ioUring;
+
+            // Not repeatable into the same directory, so no warm-up
+            const auto start = Clock::now();
+            stats = manager.exportTree("C:\\E", hostDir, options);
+            const auto ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+            std::cout << "Export " << stats.directories + stats.files << " items, " << (stats.ioUring ? "io_uring" : "thread pool")
+                << ": " << (stats.directories + stats.files) * 1000 / ms << " items/s" << std::endl;
+        }
+
+        nftw(temp, [](const char* path, const struct stat*, int, FTW*) { return ::remove(path); }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+#endif
+
+    // Every other command fails, failed ones are skipped
+    static void errorsBenchmark(size_t commands)
+    {
+        std::ostringstream script;
+        script << "MD E\nCD E\n";
+        for(size_t i = 0; i < commands / 2; ++i) script << "MF F" << i % 100 << ".TXT\nRD X" << i % 100 << "\n";
+
+        const auto ms = measure(1, [&]
+        {
+            FileSystem::Manager manager;
+            FileSystem::Manager::ErrorReport errors;
+            std::istringstream in(script.str());
+            manager.process(in, errors);
+        });
+
+        std::cout << "Continue on error, 50% failed: " << commands * 1000 / ms << " cmd/s" << std::endl;
+    }
+
+    int run()
+    {
+        const size_t width = 8;
+        const size_t depth = 5;
+
+        std::cout << "Tree width " << width << ", depth " << depth << std::endl;
+        std::cout << std::fixed << std::setprecision(3);
+
+        iterationBenchmark(width, depth);
+        managerBenchmark(width, depth);
+        compareBenchmark(width, depth);
+        buildBenchmark(1000000);
+        deltreeBenchmark(1000000);
+        freezeBenchmark(1000000);
+        drivesBenchmark(80000);
+        writersBenchmark(80000);
+        dependentBenchmark(80000);
+        errorsBenchmark(200000);
+
+#ifdef __linux__
+        importBenchmark("/usr");
+        exportBenchmark(100000);
+#endif
+
+        return 0;
+    }
+}
@@ -0,0 +1,493 @@
+#include "Exporter.h"
+
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Utils.h"
+
+#endif // __linux__
+
+namespace FileSystem
+{
+
+#ifdef __linux__
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        const mode_t DirectoryMode = 0777;
+        const mode_t FileMode = 0666;
+
+        struct Operation
+        {
+            enum Kind
+            {
+                eDirectory,
+                eFile,
+                eHardLink,
+                eSymbolicLink
+            };
+
+            Kind kind;
+            std::string path;
+            std::string target;     // Links only
+        };
+
+        typedef std::vector<Operation> Operations;
+
+        std::string errorOf(const Operation& op, int error)
+        {
+            return "Unable to create " + op.path + ": " + std::strerror(error);
+        }
+
+        // Runs batch of operations, they don't depend on each other
+        class Submitter
+        {
+        public:
+            virtual void run(const Operations& ops) = 0;
+            virtual ~Submitter() {}
+        };
+
+        ///////////////////////////////////////////////////////////////////////////////////////////
+        // Blocking calls split between threads
+        class ThreadSubmitter: public Submitter
+        {
+        public:
+            explicit ThreadSubmitter(size_t threads): threads_(threads) {}
+
+            virtual void run(const Operations& ops) override
+            {
+                std::atomic<size_t> next(0);
+                std::atomic<bool> failed(false);
+                std::string error;
+                std::mutex errorMutex;
+
+                const auto work = [&]
+                {
+                    size_t begin = 0;
+                    while(!failed && (begin = next.fetch_add(Chunk)) < ops.size())
+                    {
+                        const auto end = std::min(begin + Chunk, ops.size());
+                        for(auto i = begin; i < end; ++i)
+                        {
+                            const auto result = execute(ops[i]);
+                            if(result == 0) continue;
+
+                            std::lock_guard<std::mutex> lock(errorMutex);
+                            if(!failed.exchange(true)) error = errorOf(ops[i], result);
+                            break;
+                        }
+                    }
+                };
+
+                // Small batches (e.g. deep levels) aren't worth threads
+                const auto threads = std::min(threads_, (ops.size() + Chunk - 1) / Chunk);
+
+                std::vector<std::thread> pool;
+                for(size_t i = 1; i < threads; ++i) pool.emplace_back(work);
+                work();
+                for(auto& t : pool) t.join();
+
+                if(failed) throw std::runtime_error(error);
+            }
+
+        private:
+            static const size_t Chunk = 64;
+
+            // Returns errno or 0
+            static int execute(const Operation& op)
+            {
+                int result = 0;
+                switch(op.kind)
+                {
+                case Operation::eDirectory:
+                    result = mkdirat(AT_FDCWD, op.path.c_str(), DirectoryMode);
+                    break;
+
+                case Operation::eFile:
+                    result = openat(AT_FDCWD, op.path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FileMode);
+                    if(result >= 0) result = close(result);
+                    break;
+
+                case Operation::eHardLink:
+                    result = linkat(AT_FDCWD, op.target.c_str(), AT_FDCWD, op.path.c_str(), 0);
+                    break;
+
+                case Operation::eSymbolicLink:
+                    result = symlinkat(op.target.c_str(), AT_FDCWD, op.path.c_str());
+                    break;
+                }
+
+                return result < 0 ? errno : 0;
+            }
+
+            size_t threads_;
+        };
+
+        ///////////////////////////////////////////////////////////////////////////////////////////
+        // Operations are queued in submission ring and run by kernel asynchronously, one system
+        // call submits a batch and reaps completions. Created files are closed the same way.
+        // There's no liburing, so the rings are mapped here.
+        class RingSubmitter: public Submitter
+        {
+        public:
+            RingSubmitter(): fd_(-1), sqRing_(nullptr), cqRing_(nullptr), sqes_(nullptr) {}
+
+            ~RingSubmitter()
+            {
+                if(sqes_) munmap(sqes_, sqesSize_);
+                if(cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+                if(sqRing_) munmap(sqRing_, sqRingSize_);
+                if(fd_ >= 0) close(fd_);
+            }
+
+            // False if kernel has no io_uring or operations needed
+            bool init()
+            {
+                io_uring_params params;
+                std::memset(&params, 0, sizeof(params));
+
+                fd_ = static_cast<int>(syscall(__NR_io_uring_setup, Entries, &params));
+                if(fd_ < 0) return false;
+
+                if(!supported()) return false;
+
+                sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+                const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if(singleMap) sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+                sqRing_ = map(sqRingSize_, IORING_OFF_SQ_RING);
+                if(!sqRing_) return false;
+
+                cqRing_ = singleMap ? sqRing_ : map(cqRingSize_, IORING_OFF_CQ_RING);
+                if(!cqRing_) return false;
+
+                sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+                sqes_ = static_cast<io_uring_sqe*>(map(sqesSize_, IORING_OFF_SQES));
+                if(!sqes_) return false;
+
+                const auto sq = static_cast<char*>(sqRing_);
+                sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+                const auto cq = static_cast<char*>(cqRing_);
+                cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+                return true;
+            }
+
+            virtual void run(const Operations& ops) override
+            {
+                static const std::uint64_t CloseTag = std::uint64_t(1) << 63;
+
+                std::vector<int> closing;   // Created files
+                std::string error;
+
+                size_t next = 0;
+                size_t inFlight = 0;
+                while(inFlight > 0 || !closing.empty() || (next < ops.size() && error.empty()))
+                {
+                    // In-flight operations are limited by ring size, so are open files
+                    unsigned queued = 0;
+                    while(inFlight < Entries && (!closing.empty() || (next < ops.size() && error.empty())))
+                    {
+                        auto& sqe = push();
+                        if(!closing.empty())
+                        {
+                            sqe.opcode = IORING_OP_CLOSE;
+                            sqe.fd = closing.back();
+                            sqe.user_data = CloseTag;
+                            closing.pop_back();
+                        }
+                        else
+                        {
+                            prepare(sqe, ops[next]);
+                            sqe.user_data = next++;
+                        }
+
+                        ++queued;
+                        ++inFlight;
+                    }
+
+                    if(enter(queued, 1) < 0)
+                    {
+                        if(errno == EINTR) continue;
+                        throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+                    }
+
+                    // Completions
+                    auto head = *cqHead_;
+                    const auto tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+                    for(; head != tail; ++head)
+                    {
+                        const auto& cqe = cqes_[head & cqMask_];
+                        --inFlight;
+
+                        if(cqe.user_data == CloseTag) continue;
+
+                        const auto& op = ops[cqe.user_data];
+                        if(cqe.res < 0)
+                        {
+                            if(error.empty()) error = errorOf(op, -cqe.res);
+                            continue;
+                        }
+
+                        if(op.kind == Operation::eFile) closing.push_back(cqe.res);
+                    }
+
+                    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+                }
+
+                if(!error.empty()) throw std::runtime_error(error);
+            }
+
+        private:
+            static const unsigned Entries = 256;
+
+            void* map(size_t size, off_t offset)
+            {
+                const auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+                return ptr == MAP_FAILED ? nullptr : ptr;
+            }
+
+            bool supported() const
+            {
+                const size_t opCount = 256;
+                std::vector<char> buffer(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op));
+                const auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+
+                if(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, opCount) < 0) return false;
+
+                for(const auto op : { IORING_OP_MKDIRAT, IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_LINKAT,
+                    IORING_OP_SYMLINKAT })
+                {
+                    if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+                }
+
+                return true;
+            }
+
+            // The ring has room, in-flight operations are fewer than its entries
+            io_uring_sqe& push()
+            {
+                const auto tail = *sqTail_;
+                const auto index = tail & sqMask_;
+
+                auto& sqe = sqes_[index];
+                std::memset(&sqe, 0, sizeof(sqe));
+
+                sqArray_[index] = index;
+                __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+                return sqe;
+            }
+
+            static void prepare(io_uring_sqe& sqe, const Operation& op)
+            {
+                switch(op.kind)
+                {
+                case Operation::eDirectory:
+                    sqe.opcode = IORING_OP_MKDIRAT;
+                    sqe.fd = AT_FDCWD;
+                    sqe.addr = reinterpret_cast<std::uint64_t>(op.path.c_str());
+                    sqe.len = DirectoryMode;
+                    break;
+
+                case Operation::eFile:
+                    sqe.opcode = IORING_OP_OPENAT;
+                    sqe.fd = AT_FDCWD;
+                    sqe.addr = reinterpret_cast<std::uint64_t>(op.path.c_str());
+                    sqe.open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+                    sqe.len = FileMode;
+                    break;
+
+                case Operation::eHardLink:
+                    sqe.opcode = IORING_OP_LINKAT;
+                    sqe.fd = AT_FDCWD;
+                    sqe.addr = reinterpret_cast<std::uint64_t>(op.target.c_str());
+                    sqe.len = AT_FDCWD;
+                    sqe.addr2 = reinterpret_cast<std::uint64_t>(op.path.c_str());
+                    break;
+
+                case Operation::eSymbolicLink:
+                    sqe.opcode = IORING_OP_SYMLINKAT;
+                    sqe.fd = AT_FDCWD;
+                    sqe.addr = reinterpret_cast<std::uint64_t>(op.target.c_str());
+                    sqe.addr2 = reinterpret_cast<std::uint64_t>(op.path.c_str());
+                    break;
+                }
+            }
+
+            int enter(unsigned submit, unsigned wait)
+            {
+                return static_cast<int>(syscall(__NR_io_uring_enter, fd_, submit, wait, IORING_ENTER_GETEVENTS,
+                    nullptr, 0));
+            }
+
+            int fd_;
+
+            void* sqRing_;
+            void* cqRing_;
+            io_uring_sqe* sqes_;
+            size_t sqRingSize_;
+            size_t cqRingSize_;
+            size_t sqesSize_;
+
+            unsigned* sqTail_;
+            unsigned sqMask_;
+            unsigned* sqArray_;
+
+            unsigned* cqHead_;
+            unsigned* cqTail_;
+            unsigned cqMask_;
+            io_uring_cqe* cqes_;
+        };
+
+        // Host path of item within exported subtree, empty if it's outside. Item is not a link.
+        std::string hostPath(const Item& item, const Path& rootPath, const std::string& hostDir)
+        {
+            const auto path = item.fullPath();
+            if(path.size() <= rootPath.size() || path[rootPath.size()] != Utils::DirectoryDelimiter ||
+                !Utils::equalNoCase(path.substr(0, rootPath.size()), rootPath)) return std::string();
+
+            auto host = hostDir + path.substr(rootPath.size());
+            std::replace(host.begin() + hostDir.size(), host.end(), Utils::DirectoryDelimiter, '/');
+            return host;
+        }
+
+        // Symbolic link target is resolved from directory of the link, so it's made relative
+        // to that: host dir may be relative to current directory. Both paths are within host dir.
+        std::string linkTarget(const std::string& linkPath, const std::string& target, const std::string& hostDir)
+        {
+            const auto depth = std::count(linkPath.begin() + hostDir.size() + 1, linkPath.end(), '/');
+
+            std::string result;
+            for(auto i = depth; i > 0; --i) result += "../";
+            return result + target.substr(hostDir.size() + 1);
+        }
+    }
+
+    Manager::ExportStats exportTree(const Item& root, const std::string& hostDir, const Manager::ExportOptions& options)
+    {
+        Manager::ExportStats stats = {};
+
+        if(mkdir(hostDir.c_str(), DirectoryMode) != 0 && errno != EEXIST)
+            throw std::runtime_error("Unable to create " + hostDir + ": " + std::strerror(errno));
+
+        std::unique_ptr<Submitter> submitter;
+        if(options.ioUring)
+        {
+            std::unique_ptr<RingSubmitter> ring(new RingSubmitter());
+            if(ring->init()) submitter = std::move(ring);
+        }
+
+        stats.ioUring = submitter != nullptr;
+        if(!submitter)
+        {
+            const auto threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+            submitter.reset(new ThreadSubmitter(std::max<size_t>(threads, 1)));
+        }
+
+        if(!root.asComposite()) return stats;
+
+        // Level by level, parents exist before their children. Links go last, after their items.
+        struct Level
+        {
+            const Composite* dir;
+            std::string path;
+        };
+
+        std::vector<Level> levels(1, Level{ root.asComposite(), hostDir });
+        std::vector<Level> nextLevels;
+        std::vector<std::pair<const Item*, std::string>> links;
+        Operations ops;
+
+        while(!levels.empty())
+        {
+            ops.clear();
+            nextLevels.clear();
+
+            for(const auto& level : levels)
+            {
+                for(const auto& child : level.dir->children())
+                {
+                    const auto type = child->type();
+                    if(type == ItemType::eHardLink || type == ItemType::eDynamicLink)
+                    {
+                        // Link names have delimiters, so their paths are kept
+                        links.push_back(std::make_pair(child.get(), level.path + '/' + child->name()));
+                        continue;
+                    }
+
+                    const bool dir = type == ItemType::eDirectory;
+                    ops.push_back(Operation{ dir ? Operation::eDirectory : Operation::eFile,
+                        level.path + '/' + child->name(), std::string() });
+
+                    if(dir) nextLevels.push_back(Level{ child->asComposite(), ops.back().path });
+                    else ++stats.files;
+                }
+            }
+
+            stats.directories += nextLevels.size();
+            submitter->run(ops);
+            levels.swap(nextLevels);
+        }
+
+        ops.clear();
+
+        const auto rootPath = root.fullPath();
+        for(const auto& link : links)
+        {
+            const auto linked = const_cast<Item*>(link.first)->asLink()->linked();
+            const auto target = linked ? hostPath(*linked, rootPath, hostDir) : std::string();
+
+            if(target.empty())
+            {
+                ++stats.skipped;
+                continue;
+            }
+
+            // Directories can't be hard linked
+            const bool hard = link.first->type() == ItemType::eHardLink && !linked->asComposite();
+            ops.push_back(Operation{ hard ? Operation::eHardLink : Operation::eSymbolicLink, link.second,
+                hard ? target : linkTarget(link.second, target, hostDir) });
+            ++stats.links;
+        }
+
+        submitter->run(ops);
+        return stats;
+    }
+
+#else // Not Linux
+
+    Manager::ExportStats exportTree(const Item&, const std::string&, const Manager::ExportOptions&)
+    {
+        throw std::runtime_error("Export is supported on Linux only");
+    }
+
+#endif // __linux__
+
+}
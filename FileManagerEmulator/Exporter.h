@@ -0,0 +1,16 @@
+#pragma once
+
+#include "LeakDetect.h"
+
+#include <string>
+
+#include "FileSystem.h"
+#include "FileSystemManager.h"
+
+namespace FileSystem
+{
+
+    // Writes subtree of root into host directory, see Manager::exportTree()
+    Manager::ExportStats exportTree(const Item& root, const std::string& hostDir, const Manager::ExportOptions& options);
+
+}
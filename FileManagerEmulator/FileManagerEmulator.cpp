@@ -1,7 +1,11 @@
 #include "LeakDetect.h"
 
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "Utils.h"
 #include "FileSystem.h"
@@ -14,6 +18,21 @@ namespace Tests
     int run();
 }
 
+namespace Benchmark
+{
+    int run();
+}
+
+namespace Server
+{
+    int run(const std::string& socketPath);
+}
+
+namespace LoadGenerator
+{
+    int run(const std::string& socketPath, const std::vector<size_t>& connections, size_t commands);
+}
+
 int main(int argc, char* argv[])
 {
     if(argc == 2 && Utils::equalNoCase(argv[1], "--tests"))
@@ -21,11 +40,145 @@ int main(int argc, char* argv[])
         return Tests::run();
     }
 
+    if(argc == 2 && Utils::equalNoCase(argv[1], "--benchmark"))
+    {
+        return Benchmark::run();
+    }
+
+    // --server <socket>: serve client sessions until SIGINT/SIGTERM, then print the tree
+    if(argc == 3 && Utils::equalNoCase(argv[1], "--server"))
+    {
+        return Server::run(argv[2]);
+    }
+
+    // --load <socket> [connections...]: measure server with given numbers of connections
+    if(argc >= 3 && Utils::equalNoCase(argv[1], "--load"))
+    {
+        std::vector<size_t> connections;
+        for(int i = 3; i < argc; ++i) connections.push_back(std::stoul(argv[i]));
+        if(connections.empty()) connections = { 1, 10, 100, 1000 };
+
+        return LoadGenerator::run(argv[2], connections, 100000);
+    }
+
+    // --compare <script> <script>: run scripts on separate trees and print differences
+    if(argc == 4 && Utils::equalNoCase(argv[1], "--compare"))
+    {
+        try
+        {
+            FileSystem::Manager managers[2];
+            for(int i = 0; i < 2; ++i)
+            {
+                std::ifstream in(argv[i + 2]);
+                if(!in) throw std::runtime_error(std::string("Unable to open ") + argv[i + 2]);
+                managers[i].process(in);
+            }
+
+            if(!managers[0].compare(managers[1], std::cout)) return 1;
+            std::cout << "Trees are equal" << std::endl;
+        }
+        catch(std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // --parallel [script...]: commands on different drives run in parallel, scripts too
+    const bool parallel = argc >= 2 && Utils::equalNoCase(argv[1], "--parallel");
+
+    // --concurrent [script...]: scripts run concurrently, commands lock directories along paths
+    const bool concurrent = argc >= 2 && Utils::equalNoCase(argv[1], "--concurrent");
+
+    // --dependent: independent commands of the script run in parallel
+    const bool dependent = argc == 2 && Utils::equalNoCase(argv[1], "--dependent");
+
+    // --continue: failed commands are skipped, error report is printed after the tree
+    const bool continueOnError = argc == 2 && Utils::equalNoCase(argv[1], "--continue");
+
+    // --import <host dir> <path> [rename|skip|fail]: host tree is added to path, then script runs
+    const bool import = (argc == 4 || argc == 5) && Utils::equalNoCase(argv[1], "--import");
+
+    // --export <path> <host dir>: script runs, then subtree of path is written to host directory
+    const bool exportTree = argc == 4 && Utils::equalNoCase(argv[1], "--export");
+
     try
     {
         FileSystem::Manager manager;
-        manager.process(std::cin);
+        manager.setCommandOutput(&std::cout);
+
+        if(import)
+        {
+            typedef FileSystem::Manager::CollisionPolicy CollisionPolicy;
+
+            FileSystem::Manager::ImportOptions options;
+            const std::string policy = argc == 5 ? argv[4] : "rename";
+            if(Utils::equalNoCase(policy, "skip")) options.collisions = CollisionPolicy::eSkip;
+            else if(Utils::equalNoCase(policy, "fail")) options.collisions = CollisionPolicy::eFail;
+            else if(!Utils::equalNoCase(policy, "rename")) throw std::runtime_error("Unknown collision policy " + policy);
+
+            const auto start = std::chrono::steady_clock::now();
+            const auto stats = manager.import(argv[2], argv[3], options);
+            const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+            const auto items = stats.directories + stats.files;
+            std::cerr << "Imported " << stats.directories << " directories, " << stats.files << " files ("
+                << stats.renamed << " renamed, " << stats.skipped << " skipped) in " << seconds.count() << " s, "
+                << static_cast<size_t>(items / seconds.count()) << " items/s" << std::endl;
+        }
+
+        if(parallel || concurrent)
+        {
+            std::vector<std::unique_ptr<std::ifstream>> files;
+            std::vector<std::istream*> inputs;
+
+            for(int i = 2; i < argc; ++i)
+            {
+                files.emplace_back(new std::ifstream(argv[i]));
+                if(!*files.back()) throw std::runtime_error(std::string("Unable to open ") + argv[i]);
+                inputs.push_back(files.back().get());
+            }
+
+            if(inputs.empty()) inputs.push_back(&std::cin);
+
+            if(parallel) manager.processParallel(inputs);
+            else manager.processConcurrent(inputs);
+        }
+        else if(continueOnError)
+        {
+            FileSystem::Manager::ErrorReport errors;
+            manager.process(std::cin, errors);
+
+            manager.output(std::cout);
+            FileSystem::Manager::outputErrors(std::cout, errors);
+
+            return errors.empty() ? 0 : 1;
+        }
+        else if(dependent)
+        {
+            manager.processDependent(std::cin);
+        }
+        else
+        {
+            manager.process(std::cin);
+        }
+
         manager.output(std::cout);
+
+        if(exportTree)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const auto stats = manager.exportTree(argv[2], argv[3]);
+            const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+            const auto items = stats.directories + stats.files + stats.links;
+            std::cerr << "Exported " << stats.directories << " directories, " << stats.files << " files, "
+                << stats.links << " links (" << stats.skipped << " skipped) in " << seconds.count() << " s, "
+                << static_cast<size_t>(items / seconds.count()) << " items/s"
+                << (stats.ioUring ? ", io_uring" : ", thread pool") << std::endl;
+        }
     }
     catch(std::exception& e)
     {
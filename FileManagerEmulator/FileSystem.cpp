@@ -2,14 +2,175 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 
 #include "Utils.h"
+#include "Traversal.h"
 
 namespace FileSystem
 {
 
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        struct ParkingSlot
+        {
+            std::mutex mutex;
+            std::condition_variable released;
+        };
+
+        thread_local ChangeJournal* changeJournal = nullptr;
+
+        const size_t ParkingSlots = 64;
+        ParkingSlot parkingLot[ParkingSlots];
+
+        ParkingSlot& parkingSlot(const void* lock)
+        {
+            return parkingLot[(reinterpret_cast<size_t>(lock) >> 4) % ParkingSlots];
+        }
+
+        // Finalizer of splitmix64
+        inline Hash mixHash(Hash h)
+        {
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9ULL;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111ebULL;
+            h ^= h >> 31;
+            return h;
+        }
+
+        // FNV-1a
+        inline Hash nameHash(const Name& name)
+        {
+            Hash h = 0xcbf29ce484222325ULL;
+            for(const auto c : name)
+            {
+                h ^= static_cast<unsigned char>(c);
+                h *= 0x100000001b3ULL;
+            }
+
+            return h;
+        }
+
+        // Children hash is a sum of their item hashes, so it doesn't depend on their order
+        inline Hash itemHash(ItemType type, Hash name, Hash children)
+        {
+            return mixHash(name + mixHash(children + static_cast<Hash>(type)));
+        }
+
+        // Links are rare, moved items don't look for linked ones otherwise
+        std::atomic<size_t> linkCount(0);
+
+        // Directories in use as current ones with number of pins, see Directory::pinAsCurrent()
+        struct CurrentDirectories
+        {
+            std::mutex mutex;
+            std::unordered_map<const void*, size_t> pins;
+        };
+
+        CurrentDirectories currentDirs;
+
+        // Destroys detached subtrees in background, so commands don't wait for it
+        class Reclaimer
+        {
+        public:
+            static Reclaimer& instance()
+            {
+                static Reclaimer reclaimer;
+                return reclaimer;
+            }
+
+            void add(std::vector<ItemPtr>&& items)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.push_back(std::move(items));
+                wake_.notify_one();
+            }
+
+            void wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                idle_.wait(lock, [this]{ return pending_.empty() && !busy_; });
+            }
+
+            ~Reclaimer()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                    wake_.notify_one();
+                }
+
+                thread_.join();
+            }
+
+        private:
+            Reclaimer(): busy_(false), stop_(false), thread_(&Reclaimer::run, this) {}
+
+            void run()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while(true)
+                {
+                    wake_.wait(lock, [this]{ return stop_ || !pending_.empty(); });
+                    if(pending_.empty()) break;
+
+                    std::vector<std::vector<ItemPtr>> batches;
+                    batches.swap(pending_);
+                    busy_ = true;
+
+                    lock.unlock();
+                    batches.clear();
+                    lock.lock();
+
+                    busy_ = false;
+                    if(pending_.empty()) idle_.notify_all();
+                }
+            }
+
+            std::mutex mutex_;
+            std::condition_variable wake_;
+            std::condition_variable idle_;
+            std::vector<std::vector<ItemPtr>> pending_;
+            bool busy_;
+            bool stop_;
+            std::thread thread_;
+        };
+    }
+
+    void waitForReclaim()
+    {
+        Reclaimer::instance().wait();
+    }
+
+    void DirectoryLock::lock()
+    {
+        bool expected = false;
+        if(locked_.compare_exchange_strong(expected, true, std::memory_order_acquire)) return;
+
+        auto& slot = parkingSlot(this);
+        std::unique_lock<std::mutex> lock(slot.mutex);
+        while(locked_.exchange(true, std::memory_order_acquire)) slot.released.wait(lock);
+    }
+
+    void DirectoryLock::unlock()
+    {
+        auto& slot = parkingSlot(this);
+        {
+            // Under slot mutex, so waiter can't miss the notification between check and wait
+            std::lock_guard<std::mutex> lock(slot.mutex);
+            locked_.store(false, std::memory_order_release);
+        }
+
+        slot.released.notify_all();
+    }
+
     ///////////////////////////////////////////////////////////////////////////////////////////////
     class ItemBase:
         public Item,
@@ -44,10 +205,17 @@ namespace FileSystem
 
         virtual Path fullPath() const override
         {
-            if(parent_.expired()) return name(); // We are the root
+            Path path = name();
+
+            // Walk up to the root, no recursion for deep trees
+            auto daddy = parent_.lock();
+            while(daddy)
+            {
+                path = daddy->name() + Utils::DirectoryDelimiter + path;
+                daddy = daddy->parent().lock();
+            }
 
-            const auto daddy = parent_.lock();
-            return daddy->fullPath() + Utils::DirectoryDelimiter + name();
+            return path;
         }
 
         virtual void setParent(const ItemWeakPtr& parent) override
@@ -87,6 +255,7 @@ namespace FileSystem
     {
         typedef std::vector<ItemPtr> Children;
         Children children_;
+        DirectoryLock lock_;
 
         CompositeBase& operator=(const CompositeBase&) = delete;
 
@@ -96,52 +265,48 @@ namespace FileSystem
 
         CompositeBase(const CompositeBase&) = default;
 
-        virtual ~CompositeBase() {}
-
-        virtual bool empty() const override
+        virtual ~CompositeBase()
         {
-            return children_.empty();
-        }
+            // Flatten subtree owned by us only, so destroying deep tree doesn't recurse per level
+            Children pending;
+            pending.swap(children_);
 
-        template <class ThisType, typename IterateFunc>
-        static bool iterateChildren(ThisType& self, const IterateFunc& func, bool sorted)
-        {
-            auto& items = self.children_;
-            const size_t size = items.size();
-            std::vector<size_t> sortedIndex(size);
+            while(!pending.empty())
+            {
+                const auto item = std::move(pending.back());
+                pending.pop_back();
 
-            size_t count = 0;
-            for(auto& idx : sortedIndex) idx = count++;
-            assert(sortedIndex.size() == size);
-            assert(sortedIndex.empty() || sortedIndex.back() == size - 1);
+                // Parent is going away, changes of item are not reported to it anymore
+                item->setParent(ItemWeakPtr());
 
-            if(sorted)
-            {
-                const auto compareItems = [&items](size_t lhs, size_t rhs)
-                {
-                    return items[lhs]->name() < items[rhs]->name();
-                };
+                if(item.use_count() != 1 || !item->asComposite()) continue;
 
-                std::sort(sortedIndex.begin(), sortedIndex.end(), compareItems);
+                auto& children = static_cast<CompositeBase*>(item->asComposite())->children_;
+                std::move(children.begin(), children.end(), std::back_inserter(pending));
+                children.clear();
             }
+        }
 
-            size_t index = 0;
-            for(const auto i : sortedIndex)
-            {
-                if(!func(items[i], index++, size)) return false;
-            }
+        virtual bool empty() const override
+        {
+            return children_.empty();
+        }
 
-            return true;
+        virtual DirectoryLock& directoryLock() override
+        {
+            return lock_;
         }
 
-        virtual bool iterate(ConstIterateFunction func, bool sorted) const override
+        virtual ItemRange children() override
         {
-            return iterateChildren(*this, func, sorted);
+            return children_.empty() ?
+                ItemRange() : ItemRange(&children_.front(), &children_.front() + children_.size());
         }
 
-        virtual bool iterate(IterateFunction func, bool sorted) override
+        virtual ConstItemRange children() const override
         {
-            return iterateChildren(*this, func, sorted);
+            return children_.empty() ?
+                ConstItemRange() : ConstItemRange(&children_.front(), &children_.front() + children_.size());
         }
 
         virtual bool addChild(const ItemPtr& item) override
@@ -153,15 +318,21 @@ namespace FileSystem
             return true;
         }
 
+        virtual void appendChild(const ItemPtr& item) override
+        {
+            children_.push_back(item);
+        }
+
+        // Searched from the end, so children just added are removed in O(1), e.g. on rollback
         virtual ItemPtr removeChild(const Item& item) override
         {
-            const auto found = std::find_if(children_.cbegin(), children_.cend(),
+            const auto found = std::find_if(children_.crbegin(), children_.crend(),
                 [&item](const ItemPtr& p) { return p.get() == &item; });
 
-            if(found == children_.cend()) return ItemPtr();
+            if(found == children_.crend()) return ItemPtr();
 
             const auto removed(*found);
-            children_.erase(found);
+            children_.erase(std::next(found).base());
             return removed;
         }
 
@@ -175,30 +346,56 @@ namespace FileSystem
             return nullptr;
         }
 
+        void takeChildren(Children& children)
+        {
+            children.swap(children_);
+        }
+
+        void compact()
+        {
+            children_.erase(
+                std::remove(children_.begin(), children_.end(), ItemPtr()), children_.end());
+        }
+
         virtual void removeChildren() override
         {
-            for(auto& p : children_)
+            // Destruction of linkable item may remove dynamic links from directories
+            // being traversed, so postpone it until traversal is finished.
+            Children removed;
+
+            const auto removeItem = [&removed](ItemPtr& item, const TraverseInfo&)
             {
-                if(p->asComposite())
+                const auto composite = item->asComposite();
+                if(composite)
                 {
-                    p->asComposite()->removeChildren();
-                    if(!p->asComposite()->empty()) continue;
+                    // Children are already processed (post-order), drop removed ones
+                    static_cast<CompositeBase*>(composite)->compact();
+                    if(!composite->empty()) return true;
                 }
-                if(p->deletable()) p.reset();
-            }
 
-            children_.erase(
-                std::remove(children_.begin(), children_.end(), ItemPtr()), children_.end());
+                if(!item->deletable()) return true;
+
+                // Changes of removed items are not reported up anymore
+                item->setParent(ItemWeakPtr());
+
+                if(item->asLinkable()) removed.push_back(std::move(item));
+                else item.reset();
+
+                return true;
+            };
+
+            traverse(*this, removeItem, TraverseOrder::ePostOrder, false);
+            compact();
         }
 
         virtual bool childrenDeletable() const override
         {
-            for(const auto& p : children_)
+            const auto deletable = [](const ItemPtr& item, const TraverseInfo&)
             {
-                if(!p->deletable()) return false;
-                if(p->asComposite() && !p->asComposite()->childrenDeletable()) return false;
-            }
-            return true;
+                return item->deletable();
+            };
+
+            return traverse(*this, deletable, TraverseOrder::ePreOrder, false);
         }
 
     };
@@ -247,18 +444,41 @@ namespace FileSystem
             if(found != links.cend()) return;
 
             links[newLink.get()] = link;
+            linksChanged(1);
         }
 
         virtual void removeLink(const Item& link, bool hard) override
         {
             auto& links = hard ? hardLinks_ : dynamicLinks_;
-            links.erase(&link);
+            if(links.erase(&link)) linksChanged(static_cast<size_t>(-1));
         }
 
+        // Delta is added to pinned items of ancestors, see Directory::pins_
+        virtual void linksChanged(size_t delta) = 0;
+
         virtual bool linkedHard() const override
         {
             return !hardLinks_.empty();
         }
+
+        virtual void moved() override
+        {
+            for(const auto links : { &hardLinks_, &dynamicLinks_ })
+            {
+                for(const auto& w : *links)
+                {
+                    const auto link = w.second.lock();
+                    if(link) link->asLink()->linkedMoved();
+                }
+            }
+        }
+
+    public:
+
+        size_t links() const
+        {
+            return hardLinks_.size() + dynamicLinks_.size();
+        }
     };
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -268,6 +488,7 @@ namespace FileSystem
     {
         const bool hard_;
         ItemWeakPtr linked_;
+        Hash hash_;
 
         virtual ItemType type() const override
         {
@@ -281,8 +502,14 @@ namespace FileSystem
             return prefix + "[" + (item ? item->fullPath() : "<none>") + "]";
         }
 
+        virtual Hash hash() const override
+        {
+            return hash_;
+        }
+
         virtual ItemPtr copy() const override
         {
+            ALLOC_PROFILE_OBJECT(hard_ ? "HardLink" : "DynamicLink");
             const ItemPtr clone(new ItemLink(*this));
             clone->setParent(ItemWeakPtr());
             return clone;
@@ -300,9 +527,17 @@ namespace FileSystem
 
             linked->asLinkable()->addLink(shared_from_this(), hard_);
             linked_ = linked;
+            hash_ = itemHash(type(), nameHash(name()), 0);
             return true;
         }
 
+        virtual ItemPtr linked() const override
+        {
+            return linked_.lock();
+        }
+
+        virtual void linkedMoved() override;
+
         virtual Link* asLink() override
         {
             return this;
@@ -310,12 +545,21 @@ namespace FileSystem
 
     public:
 
-        ItemLink(bool hard): hard_(hard) {}
+        ItemLink(bool hard): hard_(hard), hash_(itemHash(type(), nameHash(name()), 0))
+        {
+            ++linkCount;
+        }
 
-        ItemLink(const ItemLink&) = default;
+        ItemLink(const ItemLink& other): ItemBase(other), Link(other), hard_(other.hard_),
+            linked_(other.linked_), hash_(other.hash_)
+        {
+            ++linkCount;
+        }
 
         virtual ~ItemLink()
         {
+            --linkCount;
+
             const auto item = linked_.lock();
             if(item)
             {
@@ -342,8 +586,14 @@ namespace FileSystem
             return name_;
         }
 
+        virtual Hash hash() const override
+        {
+            return itemHash(ItemType::eFile, nameHash(name_), 0);
+        }
+
         virtual ItemPtr copy() const override
         {
+            ALLOC_PROFILE_OBJECT("File");
             return ItemPtr(new File(*this));
         }
 
@@ -360,6 +610,8 @@ namespace FileSystem
             Utils::toLowerCase(name_);
         }
 
+        virtual void linksChanged(size_t delta) override;
+
         virtual Linkable* asLinkable() override
         {
             return this;
@@ -378,27 +630,215 @@ namespace FileSystem
         public LinkableBase
     {
         Name name_;
+        Hash nameHash_;
+
+        // Children hash is computed again on demand if something within subtree has changed.
+        // Ancestors of changed directory are changed too, so marking stops at the first one.
+        mutable Hash childrenHash_;
+        mutable std::atomic<bool> changed_;
+
+        // Links and linked items within subtree, sum of children weights. They are removed one
+        // by one, links to removed items go away at once. Subtree without them is detached.
+        std::atomic<size_t> pins_;
+
+        // Parent as is, so changes go up without touching reference counters. It's read by
+        // commands on other drives looking for current directories, see childrenDetachable().
+        std::atomic<Directory*> parentDir_;
+
+        // Keeps directory registered as current one while any copy of its pointer is alive
+        struct CurrentPin
+        {
+            explicit CurrentPin(Directory& pinned): dir(std::static_pointer_cast<Directory>(pinned.shared_from_this()))
+            {
+                std::lock_guard<std::mutex> lock(currentDirs.mutex);
+                ++currentDirs.pins[dir.get()];
+            }
+
+            ~CurrentPin()
+            {
+                std::lock_guard<std::mutex> lock(currentDirs.mutex);
+                const auto found = currentDirs.pins.find(dir.get());
+                if(--found->second == 0) currentDirs.pins.erase(found);
+            }
+
+            std::shared_ptr<Directory> dir;
+        };
+
+        Directory* parentDir() const
+        {
+            return parentDir_.load(std::memory_order_relaxed);
+        }
 
         virtual ItemType type() const override
         {
             return ItemType::eDirectory;
         }
 
+        virtual Hash hash() const override
+        {
+            return itemHash(type(), nameHash_, childrenHash());
+        }
+
+        virtual Hash childrenHash() const override
+        {
+            if(changed_.load(std::memory_order_acquire)) rehash();
+            return childrenHash_;
+        }
+
+        // Concurrent commands mark different subtrees, each stops where others have been
+        void markChanged()
+        {
+            for(auto dir = this; dir && !dir->changed_.exchange(true, std::memory_order_acq_rel); dir = dir->parentDir())
+            {
+            }
+        }
+
+        // Changed subtrees only, children first
+        void rehash() const
+        {
+            std::vector<std::pair<const Directory*, bool>> stack(1, std::make_pair(this, false));
+
+            while(!stack.empty())
+            {
+                const auto dir = stack.back().first;
+
+                if(!stack.back().second)
+                {
+                    stack.back().second = true;
+                    dir->forEach([&stack](const ItemPtr& child, size_t, size_t)
+                    {
+                        const auto childDir = static_cast<const Directory*>(child->asComposite());
+                        if(childDir && childDir->changed_.load(std::memory_order_acquire))
+                        {
+                            stack.push_back(std::make_pair(childDir, false));
+                        }
+
+                        return true;
+                    }, false);
+
+                    continue;
+                }
+
+                stack.pop_back();
+
+                Hash h = 0;
+                dir->forEach([&h](const ItemPtr& child, size_t, size_t)
+                {
+                    h += child->hash();
+                    return true;
+                }, false);
+
+                dir->childrenHash_ = h;
+                dir->changed_.store(false, std::memory_order_release);
+            }
+        }
+
+        static size_t pinWeight(const Item& item)
+        {
+            if(item.type() == ItemType::eHardLink || item.type() == ItemType::eDynamicLink) return 1;
+
+            if(item.asComposite())
+            {
+                const auto& dir = static_cast<const Directory&>(item);
+                return dir.pins_.load(std::memory_order_relaxed) + dir.links();
+            }
+
+            return item.asLinkable() ? static_cast<const LinkableBase*>(item.asLinkable())->links() : 0;
+        }
+
+        void changePins(size_t delta)
+        {
+            for(auto dir = this; dir; dir = dir->parentDir()) dir->pins_.fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        // Children weights are up to date
+        void recountPins()
+        {
+            size_t pins = 0;
+            forEach([&pins](const ItemPtr& child, size_t, size_t)
+            {
+                pins += pinWeight(*child);
+                return true;
+            }, false);
+
+            pins_.store(pins, std::memory_order_relaxed);
+        }
+
+        virtual void linksChanged(size_t delta) override
+        {
+            if(parentDir()) parentDir()->changePins(delta);
+        }
+
+        // Items moved here change path, so do links to them
+        void childAdded(Item& item)
+        {
+            markChanged();
+
+            const auto weight = pinWeight(item);
+            if(weight) changePins(weight);
+
+            if(linkCount == 0) return;
+
+            const auto notify = [](Item& linkable)
+            {
+                if(linkable.asLinkable()) linkable.asLinkable()->moved();
+            };
+
+            notify(item);
+            if(!item.asComposite()) return;
+
+            traverse(*item.asComposite(), [&notify](const ItemPtr& child, const TraverseInfo&)
+            {
+                notify(*child);
+                return true;
+            }, TraverseOrder::ePreOrder, false);
+        }
+
+        static ItemPtr copyItem(const Item& item)
+        {
+            // Directory copy shares children with original, they are replaced later
+            if(item.type() == ItemType::eDirectory || item.type() == ItemType::eDrive)
+            {
+                ALLOC_PROFILE_OBJECT("Directory");
+                return ItemPtr(new Directory(static_cast<const Directory&>(item)));
+            }
+
+            return item.copy();
+        }
+
         virtual ItemPtr copy() const override
         {
-            const ItemPtr clone(new Directory(*this));
+            const auto clone = copyItem(*this);
 
-            const auto copyItems = [&clone](ItemPtr& item, size_t, size_t)
+            // Parent clones by level, parents[0] is the clone itself
+            std::vector<Item*> parents(1, clone.get());
+
+            const auto copyItems = [&parents](ItemPtr& item, const TraverseInfo& info)
             {
-                const auto itemCopy = item->copy();
+                const auto itemCopy = copyItem(*item);
                 if(!itemCopy) return false;
-                itemCopy->setParent(clone);
+                itemCopy->setParent(parents[info.level - 1]->self());
+
+                if(itemCopy->asComposite())
+                {
+                    parents.resize(info.level);
+                    parents.push_back(itemCopy.get());
+                }
 
                 item = itemCopy;
                 return true;
             };
 
-            if(!clone->asComposite()->iterate(copyItems, false)) return ItemPtr();
+            if(!traverse(*clone->asComposite(), copyItems, TraverseOrder::ePreOrder, false)) return ItemPtr();
+
+            // Copies aren't linked or current, links within them are counted again
+            traverse(*clone->asComposite(), [](const ItemPtr& item, const TraverseInfo&)
+            {
+                if(item->asComposite()) static_cast<Directory*>(item.get())->recountPins();
+                return true;
+            }, TraverseOrder::ePostOrder, false);
+
+            static_cast<Directory*>(clone.get())->recountPins();
 
             return clone;
         }
@@ -424,6 +864,15 @@ namespace FileSystem
 
             name_ = name;
             Utils::toUpperCase(name_);
+            nameHash_ = nameHash(name_);
+        }
+
+        virtual void setParent(const ItemWeakPtr& parent) override
+        {
+            ItemBase::setParent(parent);
+
+            const auto parentItem = parent.lock();
+            parentDir_.store(parentItem ? static_cast<Directory*>(parentItem.get()) : nullptr, std::memory_order_relaxed);
         }
 
         virtual bool addChild(const ItemPtr& item) override
@@ -431,12 +880,103 @@ namespace FileSystem
             if(CompositeBase::addChild(item))
             {
                 item->setParent(shared_from_this());
+                childAdded(*item);
+                recordChange(item, true);
                 return true;
             }
 
             return false;
         }
 
+        virtual void appendChild(const ItemPtr& item) override
+        {
+            CompositeBase::appendChild(item);
+            item->setParent(shared_from_this());
+            childAdded(*item);
+            recordChange(item, true);
+        }
+
+        virtual ItemPtr removeChild(const Item& item) override
+        {
+            const auto removed = CompositeBase::removeChild(item);
+            if(!removed) return removed;
+
+            // Detached subtree doesn't report its changes here
+            removed->setParent(ItemWeakPtr());
+            markChanged();
+
+            const auto weight = pinWeight(*removed);
+            if(weight) changePins(0 - weight);
+
+            recordChange(removed, false);
+            return removed;
+        }
+
+        void recordChange(const ItemPtr& item, bool added)
+        {
+            if(changeJournal) changeJournal->changes.push_back(ChangeJournal::Change{ shared_from_this(), item, added });
+        }
+
+        virtual void removeChildren() override
+        {
+            const auto before = pins_.load(std::memory_order_relaxed);
+
+            // Removal isn't tracked item by item, what's left is computed again.
+            // Meanwhile subtree is cut off, so changes within it don't go up.
+            const auto parent = parentDir();
+            parentDir_.store(nullptr, std::memory_order_relaxed);
+
+            CompositeBase::removeChildren();
+
+            traverse(*this, [](const ItemPtr& item, const TraverseInfo&)
+            {
+                if(!item->asComposite()) return true;
+
+                const auto dir = static_cast<Directory*>(item.get());
+                dir->changed_.store(true, std::memory_order_release);
+                dir->recountPins();
+                return true;
+            }, TraverseOrder::ePostOrder, false);
+
+            recountPins();
+            parentDir_.store(parent, std::memory_order_relaxed);
+
+            markChanged();
+            if(parent) parent->changePins(pins_.load(std::memory_order_relaxed) - before);
+        }
+
+        // Current directories are few, so ancestors of each one are checked
+        virtual bool childrenDetachable() const override
+        {
+            if(pins_.load(std::memory_order_relaxed) != 0) return false;
+
+            std::lock_guard<std::mutex> lock(currentDirs.mutex);
+            for(const auto& pin : currentDirs.pins)
+            {
+                for(auto dir = static_cast<const Directory*>(pin.first)->parentDir(); dir; dir = dir->parentDir())
+                {
+                    if(dir == this) return false;
+                }
+            }
+
+            return true;
+        }
+
+        virtual void detachChildren() override
+        {
+            std::vector<ItemPtr> detached;
+            takeChildren(detached);
+            markChanged();
+
+            Reclaimer::instance().add(std::move(detached));
+        }
+
+        virtual ItemPtr pinAsCurrent() override
+        {
+            const auto pin = std::make_shared<CurrentPin>(*this);
+            return ItemPtr(pin, this);
+        }
+
         virtual Composite* asComposite() override
         {
             return this;
@@ -456,8 +996,38 @@ namespace FileSystem
         {
             return this;
         }
+
+        friend class ItemLink;
+        friend class File;
+
+    public:
+
+        Directory(): nameHash_(0), childrenHash_(0), changed_(false), pins_(0), parentDir_(nullptr) {}
+
+        // Children of copy have the same hashes, pins are counted by copy()
+        Directory(const Directory& other): ItemBase(other), CompositeBase(other), LinkableBase(other),
+            name_(other.name_), nameHash_(other.nameHash_), childrenHash_(other.childrenHash_),
+            changed_(other.changed_.load(std::memory_order_acquire)), pins_(0), parentDir_(nullptr)
+        {
+        }
     };
 
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    void File::linksChanged(size_t delta)
+    {
+        const auto parentItem = parent().lock();
+        if(parentItem) static_cast<Directory*>(parentItem.get())->changePins(delta);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    void ItemLink::linkedMoved()
+    {
+        hash_ = itemHash(type(), nameHash(name()), 0);
+
+        const auto parentItem = parent().lock();
+        if(parentItem) static_cast<Directory*>(parentItem.get())->markChanged();
+    }
+
     ///////////////////////////////////////////////////////////////////////////////////////////////
     class Drive: public Directory
     {
@@ -473,8 +1043,101 @@ namespace FileSystem
     };
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
+    void recordChanges(ChangeJournal* journal)
+    {
+        changeJournal = journal;
+    }
+
+    void undoChanges(ChangeJournal& journal)
+    {
+        // Undoing isn't a change to record
+        const auto recording = changeJournal;
+        changeJournal = nullptr;
+
+        auto& changes = journal.changes;
+        for(auto change = changes.rbegin(); change != changes.rend(); ++change)
+        {
+            const auto dir = change->dir->asComposite();
+            if(change->added) dir->removeChild(*change->item);
+            else dir->appendChild(change->item);
+        }
+
+        changes.clear();
+        changeJournal = recording;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Names are built on the fly, so get them once
+    static void collectNames(const ConstItemRange& items, ItemOrder& order, std::vector<Name>& names)
+    {
+        const size_t size = items.size();
+        order.resize(size);
+        names.reserve(size);
+
+        for(size_t i = 0; i < size; ++i)
+        {
+            order[i] = i;
+            names.push_back(items[i]->name());
+        }
+    }
+
+    void sortByName(const ConstItemRange& items, ItemOrder& order)
+    {
+        std::vector<Name> names;
+        collectNames(items, order, names);
+
+        const auto compareItems = [&names](size_t lhs, size_t rhs)
+        {
+            return names[lhs] < names[rhs];
+        };
+
+        std::sort(order.begin(), order.end(), compareItems);
+    }
+
+    // Max-heap of the first count items seen so far, names of the rest are dropped right away
+    void sortByName(const ConstItemRange& items, ItemOrder& order, size_t count)
+    {
+        typedef std::pair<Name, size_t> Entry;
+
+        std::vector<Entry> heap;
+        heap.reserve(std::min(count, items.size()));
+
+        for(size_t i = 0; i < items.size() && count != 0; ++i)
+        {
+            auto name = items[i]->name();
+
+            if(heap.size() < count)
+            {
+                heap.emplace_back(std::move(name), i);
+                std::push_heap(heap.begin(), heap.end());
+                continue;
+            }
+
+            if(!(name < heap.front().first)) continue;
+
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = Entry(std::move(name), i);
+            std::push_heap(heap.begin(), heap.end());
+        }
+
+        std::sort_heap(heap.begin(), heap.end());
+
+        order.clear();
+        order.reserve(heap.size());
+        for(const auto& entry : heap) order.push_back(entry.second);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    inline const char* typeName(ItemType type)
+    {
+        static const char* const names[] = { "Drive", "Directory", "File", "HardLink", "DynamicLink" };
+        return names[static_cast<size_t>(type)];
+    }
+
     ItemPtr Item::create(ItemType type)
     {
+        ALLOC_PROFILE_OBJECT(typeName(type));
+
         switch(type)
         {
         case ItemType::eDrive:       return std::make_shared<Drive>();
@@ -2,9 +2,12 @@
 
 #include "LeakDetect.h"
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <functional>
+#include <vector>
 #include <iosfwd>
 
 namespace FileSystem
@@ -19,6 +22,70 @@ namespace FileSystem
     typedef std::string Path;
     typedef std::string Name;
 
+    // Structural hash of item, see Item::hash()
+    typedef std::uint64_t Hash;
+
+    // Span-like view of contiguous items
+    template <class ItemPointer>
+    class ItemSpan
+    {
+        ItemPointer* begin_;
+        ItemPointer* end_;
+
+    public:
+        ItemSpan(): begin_(nullptr), end_(nullptr) {}
+
+        ItemSpan(ItemPointer* begin, ItemPointer* end): begin_(begin), end_(end) {}
+
+        template <class OtherPointer>
+        ItemSpan(const ItemSpan<OtherPointer>& other): begin_(other.begin()), end_(other.end()) {}
+
+        ItemPointer* begin() const { return begin_; }
+        ItemPointer* end() const { return end_; }
+
+        size_t size() const { return end_ - begin_; }
+        bool empty() const { return begin_ == end_; }
+
+        ItemPointer& operator[](size_t index) const { return begin_[index]; }
+    };
+
+    typedef ItemSpan<ItemPtr> ItemRange;
+    typedef ItemSpan<const ItemPtr> ConstItemRange;
+
+    // Indexes of items in some order
+    typedef std::vector<size_t> ItemOrder;
+
+    // Fills order with indexes of items sorted by name
+    void sortByName(const ConstItemRange& items, ItemOrder& order);
+
+    // Fills order with indexes of the first count items by name, O(n log count) time and
+    // O(count) memory
+    void sortByName(const ConstItemRange& items, ItemOrder& order, size_t count);
+
+    // Waits until items detached so far are destroyed
+    void waitForReclaim();
+
+    // Children added to or removed from directories, see recordChanges()
+    struct ChangeJournal
+    {
+        struct Change
+        {
+            ItemPtr dir;
+            ItemPtr item;
+            bool added;
+        };
+
+        std::vector<Change> changes;
+    };
+
+    // Records changes made by the calling thread to journal, null stops recording.
+    // Removal of all children at once (removeChildren(), detachChildren()) isn't recorded.
+    void recordChanges(ChangeJournal* journal);
+
+    // Reverts recorded changes, the latest first, and clears journal. Order of children
+    // may differ from the original one.
+    void undoChanges(ChangeJournal& journal);
+
     // bool (ItemPtr& item, size_t index, size_t size)
     typedef std::function<bool(ItemPtr&, size_t, size_t)> IterateFunction;
 
@@ -52,6 +119,11 @@ namespace FileSystem
 
         virtual Path fullPath() const = 0;
 
+        // Hash of type, name (target path for links) and children, equal subtrees have equal
+        // hashes. Changed subtrees are hashed again on demand, shall not run concurrently
+        // with changes of the tree.
+        virtual Hash hash() const = 0;
+
         virtual void setName(const Name& name) = 0;
 
         virtual void setParent(const ItemWeakPtr& parent) = 0;
@@ -67,31 +139,126 @@ namespace FileSystem
         virtual ~Item() {}
     };
 
+    // Lock of a single directory. Unlike std::mutex it may be destroyed while locked, so locked
+    // subtree can be removed as is. Waiting threads sleep on condition variables shared by
+    // hash of lock address, so the lock itself is just a flag.
+    class DirectoryLock
+    {
+        std::atomic<bool> locked_;
+
+    public:
+        DirectoryLock(): locked_(false) {}
+
+        // Copied directory starts unlocked
+        DirectoryLock(const DirectoryLock&): locked_(false) {}
+        DirectoryLock& operator=(const DirectoryLock&) = delete;
+
+        void lock();
+        void unlock();
+    };
+
     struct Composite
     {
         virtual bool empty() const = 0;
 
-        virtual bool childrenDeletable() const = 0;
+        // Used when commands run concurrently, see Manager::processConcurrent()
+        virtual DirectoryLock& directoryLock() = 0;
 
-        virtual bool iterate(ConstIterateFunction func, bool sorted) const = 0;
+        virtual bool childrenDeletable() const = 0;
 
-        virtual bool iterate(IterateFunction func, bool sorted) = 0;
+        // Hash of children independent of their order
+        virtual Hash childrenHash() const = 0;
+
+        // Children in insertion order, valid until composite is modified
+        virtual ItemRange children() = 0;
+        virtual ConstItemRange children() const = 0;
+
+        // Func: bool (ItemPtr& item, size_t index, size_t size)
+        // Children are passed in insertion or name order, returning false stops iteration.
+        template <class Func>
+        bool forEach(const Func& func, bool sorted)
+        {
+            return forEachItem(children(), func, sorted);
+        }
+
+        // Func: bool (const ItemPtr& item, size_t index, size_t size)
+        template <class Func>
+        bool forEach(const Func& func, bool sorted) const
+        {
+            return forEachItem(children(), func, sorted);
+        }
+
+        bool iterate(ConstIterateFunction func, bool sorted) const
+        {
+            return forEach(func, sorted);
+        }
+
+        bool iterate(IterateFunction func, bool sorted)
+        {
+            return forEach(func, sorted);
+        }
 
         virtual bool addChild(const ItemPtr& item) = 0;
 
+        // Adds item without duplicate check, caller guarantees the name is unique
+        virtual void appendChild(const ItemPtr& item) = 0;
+
         virtual ItemPtr removeChild(const Item& item) = 0;
 
         virtual Item* findChild(const Name& name) const = 0;
 
         virtual void removeChildren() = 0;
 
+        // True if there are no links, linked items or current directories among descendants,
+        // so they can be dropped as a whole
+        virtual bool childrenDetachable() const = 0;
+
+        // Removes all children in O(1), they are destroyed in background (see waitForReclaim())
+        virtual void detachChildren() = 0;
+
+        // Pointer to use as current directory, directory is pinned while any copy of it is alive
+        virtual ItemPtr pinAsCurrent() = 0;
+
         virtual ~Composite() {}
+
+    private:
+        template <class ItemPointer, class Func>
+        static bool forEachItem(const ItemSpan<ItemPointer>& items, const Func& func, bool sorted)
+        {
+            const size_t size = items.size();
+
+            if(!sorted)
+            {
+                for(size_t i = 0; i < size; ++i)
+                {
+                    if(!func(items[i], i, size)) return false;
+                }
+                return true;
+            }
+
+            ItemOrder order;
+            sortByName(items, order);
+
+            size_t index = 0;
+            for(const auto i : order)
+            {
+                if(!func(items[i], index++, size)) return false;
+            }
+
+            return true;
+        }
     };
 
     struct Link
     {
         virtual bool linkTo(const ItemPtr& linked) = 0;
 
+        // Null if linked item is gone
+        virtual ItemPtr linked() const = 0;
+
+        // Name of link shows path of linked item, so hash changes when the item is moved
+        virtual void linkedMoved() = 0;
+
         virtual ~Link() {}
     };
 
@@ -103,6 +270,9 @@ namespace FileSystem
 
         virtual void removeLink(const Item& link, bool hard) = 0;
 
+        // Notifies links that path of this item has changed
+        virtual void moved() = 0;
+
         virtual ~Linkable() {}
     };
 }
@@ -1,11 +1,23 @@
 #include "FileSystemManager.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <unordered_set>
 #include <exception>
 #include <stdexcept>
 
+#include "FrozenTree.h"
+#include "Exporter.h"
+#include "Importer.h"
+#include "Tracer.h"
 #include "Utils.h"
+#include "Traversal.h"
 
 namespace FileSystem
 {
@@ -15,369 +27,2069 @@ namespace FileSystem
         throw std::runtime_error(msg);
     }
 
-    static void printItem(std::ostream& out, const ItemPtr& item, const std::string& ident,
-        size_t level, bool last, bool lineToBottom, bool& dirLast)
+    static const char* const errorMessages[] =
     {
-        const bool root = level == 0;
+        "OK",
+        "Invalid command format",
+        "Unknown command",
+        "Incorrect number of arguments",
+        "Bad path format",
+        "Bad range format",
+        "Bad directory name",
+        "Bad file name",
+        "Invalid path",
+        "Invalid source path",
+        "Invalid target path",
+        "Directory or file already exists",
+        "Target path already contains file or directory with same name",
+        "Unable to remove drive, current or hard-linked directory",
+        "Unable to remove non-empty directory",
+        "Unable to remove hard-linked file",
+        "Unable to move drive, current or hard-linked directory or file",
+        "Invalid target path, cannot move into itself",
+        "MOVE command failed, unable to move file or directory",
+        "Source object not linkable",
+        "Source is not copyable",
+        "Unable to copy source",
+        "Orphaned directory (no parent)",
+        "Orphaned file (no parent)",
+        "Orphaned file or directory (no parent)",
+        "Directory not found",
+        "File not found",
+        "File or directory not found"
+    };
+
+    static_assert(sizeof(errorMessages) / sizeof(errorMessages[0]) == static_cast<size_t>(ErrorCode::eCount),
+        "Error message is missing");
+
+    std::string Status::message() const
+    {
+        std::string msg = errorMessages[static_cast<size_t>(code)];
+        if(!detail.empty()) msg += ": " + detail;
+        return msg;
+    }
+
+    static std::string errorAtLine(size_t line, const Status& status)
+    {
+        std::ostringstream msg;
+        msg << "Error at line " << line << ": " << status.message();
+        return msg.str();
+    }
+
+    // Prints title and subtree of root, at most maxDepth levels below root and the first
+    // maxEntries children of each directory by name, the rest are counted in "|_... (N more)".
+    // Directories below the depth limit are not read, so the cost depends on what is printed.
+    static void printTree(std::ostream& out, const Item& root, const Name& title,
+        size_t maxDepth = Manager::NoLimit, size_t maxEntries = Manager::NoLimit)
+    {
+        out << title << '\n';
+        if(!root.asComposite() || maxDepth == 0) return;
+
+        struct LevelState
+        {
+            ConstItemRange children;
+            ItemOrder order;    // Printed children
+            size_t next;
+            size_t identSize;
+            bool dirLast;
+            bool lineToBottom;
+        };
+
+        // Ident of each level is a prefix of the current one, levels are reused
+        std::string ident;
+        std::vector<LevelState> levels(1);
+
+        const auto collect = [&](const Composite& dir, LevelState& state, bool lineToBottom)
+        {
+            state.children = dir.children();
+            if(maxEntries < state.children.size()) sortByName(state.children, state.order, maxEntries);
+            else sortByName(state.children, state.order);
+
+            state.next = 0;
+            state.identSize = ident.size();
+            state.dirLast = false;
+            state.lineToBottom = lineToBottom;
+        };
+
+        collect(*root.asComposite(), levels.front(), true);
+
+        size_t depth = 1;
+        while(depth > 0)
+        {
+            auto& state = levels[depth - 1];
+            const size_t shown = state.order.size();
+            const size_t hidden = state.children.size() - shown;
+
+            ident.resize(state.identSize);
+
+            if(state.next == shown)
+            {
+                if(hidden > 0)
+                {
+                    if(state.dirLast) out << ident << "|\n";
+                    out << ident << "|_... (" << hidden << " more)\n";
+                }
+
+                --depth;
+                continue;
+            }
+
+            const auto& item = state.children[state.order[state.next++]];
+            const bool last = state.next == shown && hidden == 0;
+
+            if(state.dirLast) out << ident << "|\n";
+            out << ident << "|_" << item->name() << '\n';
+
+            state.dirLast = item->asComposite() != nullptr;
+            if(!state.dirLast || depth == maxDepth) continue;
+
+            const bool lineToBottom = state.lineToBottom && last;
+            ident += (last && !lineToBottom) ? "   " : "|   ";
+
+            if(levels.size() == depth) levels.emplace_back();
+            collect(*item->asComposite(), levels[depth++], lineToBottom);
+        }
+
+        out.flush();
+    }
 
-        if(dirLast) out << ident << "|" << std::endl;
-        out << ident << (root ? "" : "|_") << item->name() << std::endl;
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Directory locks held by a command running concurrently with others. Directories are locked
+    // top-down following tree locking protocol: a directory is locked only while its parent is
+    // held (except the first one) and never locked again once released, so there are no
+    // deadlocks. Path walk releases directories two levels above (lock coupling) while within
+    // the segments shared by both paths of MOVE/COPY. The last shared directory (anchor) and
+    // everything below are held till the end of command, the other path continues from anchor.
+    class PathLocks
+    {
+    public:
+        static const size_t NoShared = static_cast<size_t>(-1);
+
+        PathLocks(): shared_(NoShared), anchor_(nullptr), anchorSegment_(0), anchorOffset_(0) {}
+
+        ~PathLocks()
+        {
+            release();
+        }
+
+        PathLocks(const PathLocks&) = delete;
+        PathLocks& operator=(const PathLocks&) = delete;
+
+        // Number of leading path segments shared by both paths of command
+        void reset(size_t shared)
+        {
+            assert(walk_.empty() && subtree_.empty());
+
+            shared_ = shared;
+            anchor_ = nullptr;
+        }
+
+        // Directory to read children of, segment is its index in path starting at offset
+        void visit(Item* dir, size_t segment, size_t offset)
+        {
+            assert(dir->asComposite());
+
+            const bool coupling = segment <= shared_;
+            if(coupling)
+            {
+                anchor_ = dir;
+                anchorSegment_ = segment;
+                anchorOffset_ = offset;
+            }
+
+            if(holds(dir)) return;
 
-        dirLast = item->asComposite() != nullptr;
-        if(!dirLast) return;
+            dir->asComposite()->directoryLock().lock();
 
-        const std::string nextIdent = root ?
-            "" : (last && !lineToBottom ? ident + "   " : ident + "|   ");
+            if(coupling && walk_.size() > 1)
+            {
+                for(size_t i = 0; i < walk_.size() - 1; ++i) unlock(walk_[i]);
+                walk_.erase(walk_.begin(), walk_.end() - 1);
+            }
+
+            walk_.push_back(dir);
+        }
 
-        bool nextDirLast = false;
-        const auto printItems = [&](const ItemPtr& p, size_t index, size_t size)
+        // Where walk of another path of the same command shall continue from
+        bool resume(Item*& dir, size_t& segment, size_t& offset) const
         {
-            const bool last = index == size - 1;
-            printItem(out, p, nextIdent, level + 1, last, lineToBottom && last, nextDirLast);
+            if(shared_ == NoShared || !anchor_) return false;
+
+            dir = anchor_;
+            segment = anchorSegment_;
+            offset = anchorOffset_;
             return true;
+        }
+
+        // Locks all directories below held one, e.g. source of COPY
+        void lockSubtree(Item& dir)
+        {
+            assert(holds(&dir));
+
+            const auto lockDir = [this](const ItemPtr& item, const TraverseInfo&)
+            {
+                if(item->asComposite() && !holds(item.get()))
+                {
+                    item->asComposite()->directoryLock().lock();
+                    subtree_.push_back(item.get());
+                }
+
+                return true;
+            };
+
+            traverse(*dir.asComposite(), lockDir, TraverseOrder::ePreOrder, false);
+        }
+
+        // Unlocks directories of locked subtree still alive after removal of its items
+        void releaseSubtree(Item& dir)
+        {
+            const auto unlockDir = [this](const ItemPtr& item, const TraverseInfo&)
+            {
+                if(item->asComposite() && !holds(item.get())) unlock(item.get());
+                return true;
+            };
+
+            traverse(*dir.asComposite(), unlockDir, TraverseOrder::ePreOrder, false);
+            subtree_.clear();
+        }
+
+        // Held directory is about to be destroyed, its lock is gone with it. Nobody can wait
+        // for it: others lock it while holding its parent or start from it as current directory.
+        void forget(Item& dir)
+        {
+            walk_.erase(std::remove(walk_.begin(), walk_.end(), &dir), walk_.end());
+        }
+
+        void release()
+        {
+            for(const auto dir : walk_) unlock(dir);
+            for(const auto dir : subtree_) unlock(dir);
+
+            walk_.clear();
+            subtree_.clear();
+            anchor_ = nullptr;
+        }
+
+    private:
+        bool holds(Item* dir) const
+        {
+            return std::find(walk_.cbegin(), walk_.cend(), dir) != walk_.cend();
+        }
+
+        static void unlock(Item* dir)
+        {
+            dir->asComposite()->directoryLock().unlock();
+        }
+
+        size_t shared_;
+        std::vector<Item*> walk_;       // Locked by path walks, in order
+        std::vector<Item*> subtree_;    // Locked by lockSubtree()
+
+        Item* anchor_;
+        size_t anchorSegment_;
+        size_t anchorOffset_;
+    };
+
+    static bool hasLinks(const std::vector<ItemPtr>& drives)
+    {
+        const auto notLink = [](const ItemPtr& item, const TraverseInfo&)
+        {
+            return !item->asLink();
         };
 
-        item->asComposite()->iterate(printItems, true);
+        for(const auto& drive : drives)
+        {
+            const Composite& root = *drive->asComposite();
+            if(!traverse(root, notLink, TraverseOrder::ePreOrder, false)) return true;
+        }
+
+        return false;
     }
 
-    static void printTree(std::ostream& out, const ItemPtr& item)
+    // Checks whether command can run along with others, shared is number of leading
+    // segments of MOVE/COPY paths resolved once (last segments are not counted)
+    static bool lockable(const std::string& name, const std::vector<std::string>& args, size_t& shared)
     {
-        bool dirLast = false;
-        printItem(out, item, "", 0, true, true, dirLast);
+        // TREE reads whole subtree
+        if(name == "mhl" || name == "mdl" || name == "tree") return false;
+
+        std::vector<Utils::Substrings> paths(args.size());
+        for(size_t i = 0; i < args.size(); ++i)
+        {
+            if(Utils::hasRanges(args[i])) return false;
+
+            Utils::splitString(args[i], Utils::DirectoryDelimiter, paths[i]);
+            for(const auto& segment : paths[i])
+            {
+                if(Utils::isParentDirectory(segment.data(), segment.size())) return false;
+            }
+        }
+
+        shared = PathLocks::NoShared;
+        if(args.size() != 2) return true;
+
+        const auto& source = paths.front();
+        const auto& target = paths.back();
+
+        const bool absolute = Utils::validDriveName(source.front());
+        if(absolute != Utils::validDriveName(target.front())) return false;
+
+        shared = 0;
+        const auto size = std::min(source.size(), target.size()) - 1;
+        while(shared < size && Utils::equalNoCase(source[shared], target[shared])) ++shared;
+
+        // Different drives
+        return !absolute || shared > 0;
     }
 
+    ///////////////////////////////////////////////////////////////////////////////////////////////
     struct CommandsImpl
     {
         typedef Manager::FileSystemState FileSystemState;
         typedef Manager::CommandArgs CommandArgs;
+        typedef Manager::BuildItem BuildItem;
+        typedef Manager::BuildItems BuildItems;
         typedef Utils::Substrings Substrings;
 
-        template <typename Iterator>
-        static Item* pathExists(Iterator begin, Iterator end, const ItemPtr& item)
+        // Path component as [first, second) positions
+        typedef std::pair<size_t, size_t> Component;
+        typedef std::vector<Component> Components;
+
+        struct BuildLevel
+        {
+            // Directory created by build has no children yet, so names are ready
+            BuildLevel(Item* d, bool created): dir(d), created(created), namesReady(created), ordered(true) {}
+
+            // Adds lower case names of current children
+            void collectNames()
+            {
+                dir->asComposite()->forEach([this](const ItemPtr& child, size_t, size_t)
+                {
+                    auto childName = child->name();
+                    Utils::toLowerCase(childName);
+                    names.insert(std::move(childName));
+                    return true;
+                }, false);
+
+                namesReady = true;
+            }
+
+            // Checks that new child name is unique
+            bool addName(const Name& name, bool uniqueItems)
+            {
+                if(!namesReady) collectNames();
+                if(names.count(name)) return false;
+
+                // Names of created children are tracked only when they can repeat
+                // and go out of order, otherwise ascending order makes them unique.
+                if(uniqueItems) return true;
+
+                if(ordered && (lastName.empty() || lastName < name))
+                {
+                    lastName = name;
+                    return true;
+                }
+
+                if(ordered)
+                {
+                    ordered = false;
+                    collectNames();
+                }
+
+                names.insert(name);
+                return true;
+            }
+
+            Item* dir;
+            bool created;
+            bool namesReady;
+            bool ordered;                   // Children created in ascending order of names
+            Name lastName;                  // Last created child name while ordered
+            std::unordered_set<Name> names; // Lower case names of children existed before
+        };
+
+        static bool splitPath(const Path& path, Components& comps)
+        {
+            comps.clear();
+
+            size_t begin = 0;
+            while(true)
+            {
+                const auto delim = path.find(Utils::DirectoryDelimiter, begin);
+                const auto end = delim == Path::npos ? path.size() : delim;
+                if(end == begin) return false;
+
+                comps.emplace_back(begin, end);
+                if(delim == Path::npos) return true;
+
+                begin = delim + 1;
+            }
+        }
+
+        static bool sameComponent(const Path& lhs, const Component& l, const Path& rhs, const Component& r)
+        {
+            if(l.second - l.first != r.second - r.first) return false;
+
+            return std::equal(lhs.cbegin() + l.first, lhs.cbegin() + l.second, rhs.cbegin() + r.first,
+                [](char c1, char c2){ return Utils::toLower(c1) == Utils::toLower(c2); });
+        }
+
+        // Items are known to be unique if uniqueItems is set, e.g. generated from ranges.
+        // Nothing is created on error.
+        static Status build(FileSystemState& fs, const BuildItems& items, bool uniqueItems)
         {
-            assert(item);
-            auto cur = item.get();
+            // Items added to directories existed before, the rest goes away along with them
+            std::vector<std::pair<Item*, Item*>> added;
 
-            while(begin != end)
+            const auto status = buildItems(fs, items, uniqueItems, added);
+            if(!status.ok())
             {
-                const auto next = cur->asComposite()->findChild(*begin++);
-                if(!next || (!next->asComposite() && begin != end)) return nullptr;
+                for(auto item = added.rbegin(); item != added.rend(); ++item)
+                {
+                    item->first->asComposite()->removeChild(*item->second);
+                }
+            }
+
+            return status;
+        }
+
+        static Status buildItems(FileSystemState& fs, const BuildItems& items, bool uniqueItems,
+            std::vector<std::pair<Item*, Item*>>& added)
+        {
+            // Directories of previous path are kept on stack, so for grouped input (e.g. sorted)
+            // each directory is looked up or created only once. Otherwise popped directories
+            // are looked up again.
+            std::vector<BuildLevel> levels;
+
+            Components comps;
+            Components prevComps;
+            const Path* prevPath = nullptr;
+            Name name;
 
-                cur = next;
+            for(const auto& item : items)
+            {
+                const auto& path = item.path;
+                const bool dir = item.type == ItemType::eDirectory;
+                assert(dir || item.type == ItemType::eFile);
+
+                if(!splitPath(path, comps) || comps.size() < 2) return Status(ErrorCode::eBadPathFormat, path);
+
+                const auto& drive = comps.front();
+                if(!Utils::validDriveName(path.data() + drive.first, drive.second - drive.first))
+                    return Status(ErrorCode::eBadPathFormat, path);
+
+                // Start from the root when drive changes
+                const auto root = driveRoot(fs, path.substr(drive.first, drive.second - drive.first)).get();
+                if(levels.empty() || levels.front().dir != root)
+                {
+                    levels.clear();
+                    levels.emplace_back(root, false);
+                    prevPath = nullptr;
+                }
+
+                for(size_t i = 1; i < comps.size(); ++i)
+                {
+                    const auto begin = path.data() + comps[i].first;
+                    const auto size = comps[i].second - comps[i].first;
+                    const bool last = i == comps.size() - 1;
+
+                    const bool valid = (last && !dir) ?
+                        Utils::validFileName(begin, size) : Utils::validDirectoryName(begin, size);
+
+                    if(!valid) return Status(ErrorCode::eBadPathFormat, path);
+                }
+
+                // Drive is always shared, it's the root
+                size_t common = 1;
+                while(prevPath && common < comps.size() - 1 && common < prevComps.size() &&
+                    sameComponent(path, comps[common], *prevPath, prevComps[common])) ++common;
+
+                // Directories of previous path not shared with current one are done
+                if(common < levels.size()) levels.erase(levels.begin() + common, levels.end());
+
+                // Lookup rest of parent directories, they must exist before
+                while(levels.size() < comps.size() - 1)
+                {
+                    const auto& parent = levels.back();
+                    const auto& comp = comps[levels.size()];
+
+                    const auto found =
+                        parent.dir->asComposite()->findChild(path.substr(comp.first, comp.second - comp.first));
+
+                    if(!found || !found->asComposite()) return Status(ErrorCode::eInvalidPath, path);
+                    levels.emplace_back(found, false);
+                }
+
+                prevComps.swap(comps);
+                prevPath = &path;
+
+                const auto& comp = prevComps.back();
+                name.assign(path, comp.first, comp.second - comp.first);
+                Utils::toLowerCase(name);
+
+                auto& parent = levels.back();
+                if(!parent.addName(name, uniqueItems))
+                {
+                    // Same as MD and MF do
+                    if(dir) return Status(ErrorCode::eAlreadyExists, path);
+                    continue;
+                }
+
+                const auto newItem = Item::create(item.type);
+                newItem->setName(name);
+                parent.dir->asComposite()->appendChild(newItem);
+                if(!parent.created) added.emplace_back(parent.dir, newItem.get());
+
+                if(dir) levels.emplace_back(newItem.get(), true);
             }
 
-            return cur;
+            return ErrorCode::eOk;
         }
 
-        static Item* pathExists(FileSystemState& fs, const Substrings& path)
+        static Status buildRange(FileSystemState& fs, const std::string& pattern, ItemType type)
         {
-            assert(fs.root && fs.currentDir);
-            if(path.empty()) return fs.currentDir.get();
+            static const size_t maxRangeItems = 10000000;
+
+            // Expanded paths are unique unless there are several ranges within the same name
+            Substrings names;
+            Utils::splitString(pattern, Utils::DirectoryDelimiter, names);
+            const bool unique = std::none_of(names.cbegin(), names.cend(),
+                [](const std::string& name){ return std::count(name.cbegin(), name.cend(), '{') > 1; });
+
+            Substrings paths;
+            if(!Utils::expandRanges(pattern, paths, maxRangeItems)) return ErrorCode::eBadRangeFormat;
+
+            // Relative paths start from current directory
+            const auto prefix = fs.currentDir->fullPath() + Utils::DirectoryDelimiter;
 
-            const bool absPath = Utils::validDriveName(path.front());
-            if(absPath && !Utils::equalNoCase(fs.root->name(), path.front()))
+            BuildItems items(paths.size());
+            for(size_t i = 0; i < paths.size(); ++i)
             {
-                return nullptr;
+                const auto& path = paths[i];
+                const bool absPath = path.size() >= 2 && path[1] == Utils::DriveDelimiter;
+
+                items[i].path = absPath ? path : prefix + path;
+                items[i].type = type;
             }
 
-            const auto& startItem = absPath ? fs.root : fs.currentDir;
+            return build(fs, items, unique);
+        }
 
-            // Ignore drive name for absolute path
-            const auto begin = absPath ? path.cbegin() + 1 : path.cbegin();
-            return pathExists(begin, path.cend(), startItem);
+        static const ItemPtr& driveRoot(const FileSystemState& fs, const std::string& drive)
+        {
+            assert(fs.drives && Utils::validDriveName(drive));
+            return (*fs.drives)[Utils::driveIndex(drive)];
         }
 
-        static void commandMD(FileSystemState& fs, const CommandArgs& args)
+        // Resolves path against the tree in a single pass, "." and ".." are allowed, ".." of
+        // drive root is the root itself. Parent chain of the tree serves as segment stack, so
+        // nothing is split or collected. If name is given, the last segment is not looked up
+        // but returned there and its parent directory is resolved.
+        // Returns false on bad path format (checked up to the end even if lookup has failed),
+        // item is null if path doesn't exist.
+        // When commands run concurrently, directories are locked before their children are read
+        // and the resolved directory is locked too (see PathLocks).
+        static bool resolvePath(const FileSystemState& fs, const std::string& path, Item*& item,
+            std::string* name = nullptr)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            TRACE_SPAN("resolve");
+
+            assert(fs.drives && fs.currentDir);
+            item = nullptr;
+
+            if(path.empty() || path.back() == Utils::DirectoryDelimiter) return false;
+
+            const auto begin = path.data();
+            const auto end = begin + path.size();
+
+            Item* cur = fs.currentDir.get();
+            std::string segment; // Valid names are short, no allocation
+
+            size_t index = 0;
+            size_t offset = 0;
+            const auto locks = fs.locks;
+            if(locks) locks->resume(cur, index, offset);
+
+            const auto visit = [locks, begin](Item* dir, size_t segment, const char* at)
+            {
+                if(locks) locks->visit(dir, segment, at - begin);
+            };
+
+            for(auto segBegin = begin + offset; ; ++index)
+            {
+                const auto segEnd = std::find(segBegin, end, Utils::DirectoryDelimiter);
+                const size_t size = segEnd - segBegin;
+                const bool first = segBegin == begin;
+                const bool last = segEnd == end;
+
+                if(first && Utils::validDriveName(segBegin, size) && !(last && name))
+                {
+                    cur = (*fs.drives)[Utils::driveIndex(*segBegin)].get();
+                }
+                else if(last && name)
+                {
+                    const bool valid = (first && Utils::validDriveName(segBegin, size)) ||
+                        Utils::validFileName(segBegin, size) || Utils::validDirectoryName(segBegin, size);
+                    if(!valid) return false;
+
+                    name->assign(segBegin, size);
+                }
+                else if(Utils::isCurrentDirectory(segBegin, size))
+                {
+                    if(cur && !cur->asComposite()) cur = nullptr;
+                    if(cur) visit(cur, index, segBegin);
+                }
+                else if(Utils::isParentDirectory(segBegin, size))
+                {
+                    // Walking up doesn't fit locking protocol, such commands run alone
+                    assert(!locks);
+                    if(cur && !cur->asComposite()) cur = nullptr;
+
+                    const auto parent = cur ? cur->parent().lock() : ItemPtr();
+                    if(parent) cur = parent.get();
+                }
+                else if(Utils::validDirectoryName(segBegin, size) || (last && Utils::validFileName(segBegin, size)))
+                {
+                    if(cur && cur->asComposite())
+                    {
+                        visit(cur, index, segBegin);
+                        segment.assign(segBegin, size);
+                        cur = cur->asComposite()->findChild(segment);
+                    }
+                    else
+                    {
+                        cur = nullptr;
+                    }
+                }
+                else
+                {
+                    return false;
+                }
+
+                if(last)
+                {
+                    if(cur && cur->asComposite()) visit(cur, index + 1, end);
+                    break;
+                }
+
+                segBegin = segEnd + 1;
+            }
+
+            item = cur;
+            return true;
+        }
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
+        static Status commandMD(FileSystemState& fs, const CommandArgs& args)
+        {
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            assert(!path.empty());
-            const auto dirName = path.back();
-            path.pop_back();
+            if(Utils::hasRanges(args.front()))
+            {
+                return buildRange(fs, args.front(), ItemType::eDirectory);
+            }
 
-            if(!Utils::validDirectoryName(dirName)) raise_error("Bad directory name");
+            Item* parentDir = nullptr;
+            std::string dirName;
+            if(!resolvePath(fs, args.front(), parentDir, &dirName)) return ErrorCode::eBadPathFormat;
 
-            const auto parentDir = pathExists(fs, path);
-            if(!parentDir || !parentDir->asComposite()) raise_error("Invalid path");
+            if(!Utils::validDirectoryName(dirName)) return ErrorCode::eBadDirectoryName;
+            if(!parentDir || !parentDir->asComposite()) return ErrorCode::eInvalidPath;
 
             const auto newDir = Item::create(ItemType::eDirectory);
             newDir->setName(dirName);
 
-            if(!parentDir->asComposite()->addChild(newDir)) raise_error("Directory or file already exists");
+            if(!parentDir->asComposite()->addChild(newDir)) return ErrorCode::eAlreadyExists;
+
+            return ErrorCode::eOk;
         }
 
-        static void commandCD(FileSystemState& fs, const CommandArgs& args)
+        static Status commandCD(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
+            Item* newCurDir = nullptr;
+            if(!resolvePath(fs, args.front(), newCurDir)) return ErrorCode::eBadPathFormat;
 
-            const auto newCurDir = pathExists(fs, path);
-            if(!newCurDir || !newCurDir->asComposite()) raise_error("Invalid path");
+            if(!newCurDir || !newCurDir->asComposite()) return ErrorCode::eInvalidPath;
 
-            fs.currentDir = newCurDir->self();
+            fs.currentDir = newCurDir->asComposite()->pinAsCurrent();
+            return ErrorCode::eOk;
         }
 
-        static void commandRD(FileSystemState& fs, const CommandArgs& args)
+        static Status commandRD(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
+            Item* dirToRemove = nullptr;
+            if(!resolvePath(fs, args.front(), dirToRemove)) return ErrorCode::eBadPathFormat;
 
-            const auto dirToRemove = pathExists(fs, path);
-            if(!dirToRemove || !dirToRemove->asComposite()) raise_error("Invalid path");
+            if(!dirToRemove || !dirToRemove->asComposite()) return ErrorCode::eInvalidPath;
 
             if(!dirToRemove->deletable())
-                raise_error("Unable to remove drive, current or hard-linked directory");
+                return ErrorCode::eDirectoryNotRemovable;
 
             if(!dirToRemove->asComposite()->empty())
-                raise_error("Unable to remove non-empty directory");
+                return ErrorCode::eDirectoryNotEmpty;
 
             const auto parent = dirToRemove->parent().lock();
-            if(!parent) raise_error("Orphaned directory (no parent)");
+            if(!parent) return ErrorCode::eOrphanedDirectory;
 
+            if(fs.locks) fs.locks->forget(*dirToRemove);
             const auto removed = parent->asComposite()->removeChild(*dirToRemove);
-            if(!removed) raise_error("Directory not found");
+            if(!removed) return ErrorCode::eDirectoryNotFound;
+
+            return ErrorCode::eOk;
         }
 
-        static void commandDELTREE(FileSystemState& fs, const CommandArgs& args)
+        static Status commandDELTREE(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
+            Item* dirToRemove = nullptr;
+            if(!resolvePath(fs, args.front(), dirToRemove)) return ErrorCode::eBadPathFormat;
 
-            const auto dirToRemove = pathExists(fs, path);
-            if(!dirToRemove || !dirToRemove->asComposite()) raise_error("Invalid path");
+            if(!dirToRemove || !dirToRemove->asComposite()) return ErrorCode::eInvalidPath;
 
-            dirToRemove->asComposite()->removeChildren();
+            // Nothing within subtree has to stay, it's dropped at once and destroyed in background.
+            // Concurrent commands may still be walking within it, so it's removed item by item then.
+            if(!fs.locks && dirToRemove->asComposite()->childrenDetachable())
+            {
+                dirToRemove->asComposite()->detachChildren();
+            }
+            else
+            {
+                if(fs.locks) fs.locks->lockSubtree(*dirToRemove);
+                dirToRemove->asComposite()->removeChildren();
+                if(fs.locks) fs.locks->releaseSubtree(*dirToRemove);
+            }
 
             // If current dir cannot be removed just silently return
-            if(!dirToRemove->deletable() || !dirToRemove->asComposite()->empty()) return;
+            if(!dirToRemove->deletable() || !dirToRemove->asComposite()->empty()) return ErrorCode::eOk;
 
             const auto parent = dirToRemove->parent().lock();
-            if(!parent) raise_error("Orphaned directory (no parent)");
+            if(!parent) return ErrorCode::eOrphanedDirectory;
 
+            if(fs.locks) fs.locks->forget(*dirToRemove);
             const auto removed = parent->asComposite()->removeChild(*dirToRemove);
-            if(!removed) raise_error("Directory not found");
+            if(!removed) return ErrorCode::eDirectoryNotFound;
+
+            return ErrorCode::eOk;
         }
 
-        static void commandMF(FileSystemState& fs, const CommandArgs& args)
+        static Status commandMF(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
-
-            assert(!path.empty());
-            const auto fileName = path.back();
-            path.pop_back();
+            if(Utils::hasRanges(args.front()))
+            {
+                return buildRange(fs, args.front(), ItemType::eFile);
+            }
 
-            if(!Utils::validFileName(fileName)) raise_error("Bad file name");
+            Item* parentDir = nullptr;
+            std::string fileName;
+            if(!resolvePath(fs, args.front(), parentDir, &fileName)) return ErrorCode::eBadPathFormat;
 
-            const auto parentDir = pathExists(fs, path);
-            if(!parentDir) raise_error("Invalid path");
+            if(!Utils::validFileName(fileName)) return ErrorCode::eBadFileName;
+            if(!parentDir || !parentDir->asComposite()) return ErrorCode::eInvalidPath;
 
             const auto newFile = Item::create(ItemType::eFile);
             newFile->setName(fileName);
 
             parentDir->asComposite()->addChild(newFile);
+            return ErrorCode::eOk;
         }
 
-        static void commandDEL(FileSystemState& fs, const CommandArgs& args)
+        static Status commandDEL(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 1) raise_error("Incorrect number of arguments");
+            if(args.size() != 1) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings path;
-            if(!Utils::parsePath(args.front(), path)) raise_error("Bad path format");
+            Item* fileToRemove = nullptr;
+            if(!resolvePath(fs, args.front(), fileToRemove)) return ErrorCode::eBadPathFormat;
 
-            assert(!path.empty());
-            const auto fileToRemove = pathExists(fs, path);
-            if(!fileToRemove || fileToRemove->asComposite()) raise_error("Invalid path");
+            if(!fileToRemove || fileToRemove->asComposite()) return ErrorCode::eInvalidPath;
 
             if(!fileToRemove->deletable())
-                raise_error("Unable to remove hard-linked file");
+                return ErrorCode::eFileNotRemovable;
 
             const auto parent = fileToRemove->parent().lock();
-            if(!parent) raise_error("Orphaned file (no parent)");
+            if(!parent) return ErrorCode::eOrphanedFile;
 
             const auto removed = parent->asComposite()->removeChild(*fileToRemove);
-            if(!removed) raise_error("File not found");
+            if(!removed) return ErrorCode::eFileNotFound;
+
+            return ErrorCode::eOk;
         }
 
-        static void createLink(FileSystemState& fs, const CommandArgs& args, bool hard)
+        static Status createLink(FileSystemState& fs, const CommandArgs& args, bool hard)
         {
-            if(args.size() != 2) raise_error("Incorrect number of arguments");
-
-            Substrings pathSrc;
-            Substrings pathDst;
-            if(!Utils::parsePath(args.front(), pathSrc)
-                || !Utils::parsePath(args.back(), pathDst)) raise_error("Bad path format");
-
-            assert(!pathSrc.empty() && !pathDst.empty());
+            if(args.size() != 2) return ErrorCode::eIncorrectArgumentsNumber;
 
-            const auto source = pathExists(fs, pathSrc);
-            if(!source) raise_error("Invalid source path");
+            Item* source = nullptr;
+            Item* targetDir = nullptr;
+            if(!resolvePath(fs, args.front(), source)
+                || !resolvePath(fs, args.back(), targetDir)) return ErrorCode::eBadPathFormat;
 
-            const auto targetDir = pathExists(fs, pathDst);
-            if(!targetDir || !targetDir->asComposite()) raise_error("Invalid target path");
+            if(!source) return ErrorCode::eInvalidSourcePath;
+            if(!targetDir || !targetDir->asComposite()) return ErrorCode::eInvalidTargetPath;
 
             const auto newLink = Item::create(hard ? ItemType::eHardLink : ItemType::eDynamicLink);
-            if(!newLink->asLink()->linkTo(source->self())) raise_error("Source object not linkable");
+            if(!newLink->asLink()->linkTo(source->self())) return ErrorCode::eNotLinkable;
 
             targetDir->asComposite()->addChild(newLink);
+            return ErrorCode::eOk;
         }
 
-        static void commandMHL(FileSystemState& fs, const CommandArgs& args)
+        static Status commandMHL(FileSystemState& fs, const CommandArgs& args)
         {
-            createLink(fs, args, true);
+            return createLink(fs, args, true);
         }
 
-        static void commandMDL(FileSystemState& fs, const CommandArgs& args)
+        static Status commandMDL(FileSystemState& fs, const CommandArgs& args)
         {
-            createLink(fs, args, false);
+            return createLink(fs, args, false);
         }
 
-        static void commandMOVE(FileSystemState& fs, const CommandArgs& args)
+        static Status commandMOVE(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 2) raise_error("Incorrect number of arguments");
+            if(args.size() != 2) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings pathSrc;
-            Substrings pathDst;
-            if(!Utils::parsePath(args.front(), pathSrc)
-                || !Utils::parsePath(args.back(), pathDst)) raise_error("Bad path format");
+            Item* source = nullptr;
+            Item* targetDir = nullptr;
+            if(!resolvePath(fs, args.front(), source)
+                || !resolvePath(fs, args.back(), targetDir)) return ErrorCode::eBadPathFormat;
 
-            assert(!pathSrc.empty() && !pathDst.empty());
+            if(!source) return ErrorCode::eInvalidSourcePath;
+            if(!targetDir || !targetDir->asComposite()) return ErrorCode::eInvalidTargetPath;
 
-            const auto source = pathExists(fs, pathSrc);
-            if(!source) raise_error("Invalid source path");
-
-            const auto targetDir = pathExists(fs, pathDst);
-            if(!targetDir || !targetDir->asComposite()) raise_error("Invalid target path");
+            if(fs.locks && source->asComposite()) fs.locks->lockSubtree(*source);
 
             if(!source->deletable() ||
                 (source->asComposite() && !source->asComposite()->childrenDeletable()))
-                raise_error("Unable to move drive, current or hard-linked directory or file");
+                return ErrorCode::eNotMovable;
 
             if(targetDir->asComposite()->findChild(source->name()))
-                raise_error("Target path already contains file or directory with same name");
+                return ErrorCode::eTargetExists;
 
             const auto parent = source->parent().lock();
-            if(!parent) raise_error("Orphaned file or directory (no parent)");
+            if(!parent) return ErrorCode::eOrphanedItem;
 
             const auto moved = parent->asComposite()->removeChild(*source);
-            if(!moved) raise_error("File or directory not found");
+            if(!moved) return ErrorCode::eItemNotFound;
 
             // Target dir may be invalidated in case of moving into itself.
-            const auto ensureTargetDir = pathExists(fs, pathDst);
+            Item* ensureTargetDir = nullptr;
+            resolvePath(fs, args.back(), ensureTargetDir);
             if(!ensureTargetDir || !ensureTargetDir->asComposite())
-                raise_error("Invalid target path, cannot move into itself");
+            {
+                // Moved item is destroyed on return, nobody else can reach it already
+                if(fs.locks) fs.locks->release();
+                return ErrorCode::eMoveIntoItself;
+            }
 
             if(!ensureTargetDir->asComposite()->addChild(moved))
-                raise_error("MOVE command failed, unable to move file or directory");
+                return ErrorCode::eMoveFailed;
+
+            return ErrorCode::eOk;
         }
 
-        static void commandCOPY(FileSystemState& fs, const CommandArgs& args)
+        static Status commandCOPY(FileSystemState& fs, const CommandArgs& args)
         {
-            if(args.size() != 2) raise_error("Incorrect number of arguments");
+            if(args.size() != 2) return ErrorCode::eIncorrectArgumentsNumber;
 
-            Substrings pathSrc;
-            Substrings pathDst;
-            if(!Utils::parsePath(args.front(), pathSrc)
-                || !Utils::parsePath(args.back(), pathDst)) raise_error("Bad path format");
+            Item* source = nullptr;
+            Item* targetDir = nullptr;
+            if(!resolvePath(fs, args.front(), source)
+                || !resolvePath(fs, args.back(), targetDir)) return ErrorCode::eBadPathFormat;
 
-            assert(!pathSrc.empty() && !pathDst.empty());
-
-            const auto source = pathExists(fs, pathSrc);
-            if(!source) raise_error("Invalid source path");
-
-            const auto targetDir = pathExists(fs, pathDst);
-            if(!targetDir || !targetDir->asComposite()) raise_error("Invalid target path");
+            if(!source) return ErrorCode::eInvalidSourcePath;
+            if(!targetDir || !targetDir->asComposite()) return ErrorCode::eInvalidTargetPath;
 
             if(targetDir->asComposite()->findChild(source->name()))
-                raise_error("Target path already contains file or directory with same name");
+                return ErrorCode::eTargetExists;
+
+            if(fs.locks && source->asComposite()) fs.locks->lockSubtree(*source);
 
             const auto sourceCopy = source->copy();
-            if(!sourceCopy) raise_error("Source is not copyable");
+            if(!sourceCopy) return ErrorCode::eNotCopyable;
+
+            if(!targetDir->asComposite()->addChild(sourceCopy)) return ErrorCode::eCopyFailed;
 
-            if(!targetDir->asComposite()->addChild(sourceCopy)) raise_error("Unable to copy source");
+            return ErrorCode::eOk;
         }
-    };
 
-    Manager::Manager()
-    {
-        state_.root = Item::create(ItemType::eDrive);
-        state_.root->setName("C:");
-        state_.currentDir = state_.root;
+        static bool parseLimit(const std::string& arg, size_t& limit)
+        {
+            if(arg.empty() || arg.size() > 9) return false;
+            if(!std::all_of(arg.cbegin(), arg.cend(), [](char c){ return c >= '0' && c <= '9'; })) return false;
 
-        addCommand("md", &CommandsImpl::commandMD);
-        addCommand("cd", &CommandsImpl::commandCD);
-        addCommand("rd", &CommandsImpl::commandRD);
-        addCommand("mf", &CommandsImpl::commandMF);
-        addCommand("del", &CommandsImpl::commandDEL);
-        addCommand("mhl", &CommandsImpl::commandMHL);
-        addCommand("mdl", &CommandsImpl::commandMDL);
-        addCommand("move", &CommandsImpl::commandMOVE);
-        addCommand("copy", &CommandsImpl::commandCOPY);
-        addCommand("deltree", &CommandsImpl::commandDELTREE);
-    }
+            limit = std::stoul(arg);
+            return true;
+        }
 
-    void Manager::process(std::istream& in)
-    {
-        size_t line = 1;
-        std::string cmd;
-        while(std::getline(in, cmd))
+        static Status tree(FileSystemState& fs, const std::string& path, size_t depth, size_t entries)
         {
-            if(!cmd.empty()) processCommand(cmd, line++);
+            Item* root = nullptr;
+            if(!resolvePath(fs, path, root)) return ErrorCode::eBadPathFormat;
+            if(!root) return ErrorCode::eInvalidPath;
+
+            if(!fs.out) return ErrorCode::eOk;
+
+            // Commands of different inputs may print at the same time
+            static std::mutex outputMutex;
+            std::lock_guard<std::mutex> lock(outputMutex);
+
+            printTree(*fs.out, *root, root->fullPath(), depth, entries);
+            return ErrorCode::eOk;
         }
-    }
 
-    void Manager::output(std::ostream& out)
-    {
-        printTree(out, state_.root);
-    }
+        static Status commandTREE(FileSystemState& fs, const CommandArgs& args)
+        {
+            if(args.size() > 3) return ErrorCode::eIncorrectArgumentsNumber;
 
-    void Manager::addCommand(const std::string& cmd, const CommandFunction& cmdFunc)
+            size_t limits[] = { Manager::NoLimit, Manager::NoLimit };
+            for(size_t i = 1; i < args.size(); ++i)
+            {
+                if(!parseLimit(args[i], limits[i - 1])) return Status(ErrorCode::eInvalidCommandFormat, args[i]);
+            }
+
+            return tree(fs, args.empty() ? "." : args.front(), limits[0], limits[1]);
+        }
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Runs commands of each drive in its own worker thread. Commands involving several drives
+    // (or drives in the same group) and CD are barriers: queues of these drives are drained and
+    // command is executed by dispatcher holding drive locks taken in letter order. Dispatching
+    // is serialized, so all queues get commands in the same order and no deadlock is possible.
+    //
+    // Drives become grouped forever once linked or moved/copied between: destroying an item
+    // may remove dynamic links on other drives and links refer to items across drives.
+    class DriveScheduler
     {
-        auto cmdName = cmd;
-        Utils::toLowerCase(cmdName);
+        typedef Manager::FileSystemState FileSystemState;
+        typedef Manager::CommandFunction CommandFunction;
+        typedef Manager::CommandArgs CommandArgs;
+        typedef unsigned long DriveMask;
 
-        const auto found = commands_.find(cmdName);
-        if(found != commands_.cend()) raise_error("Duplicate command: " + cmdName);
+        static const size_t NoError = static_cast<size_t>(-1);
 
-        commands_[cmdName] = cmdFunc;
-    }
+        struct Task
+        {
+            const CommandFunction* func;
+            std::string name;
+            CommandArgs args;
+            FileSystemState state;
+            size_t input;
+            size_t line;
+        };
 
-    void Manager::processCommand(const std::string& cmd, size_t line)
-    {
-        try
+        struct Worker
+        {
+            Worker(): pending(0), stop(false) {}
+
+            std::mutex mutex;
+            std::condition_variable wakeUp;
+            std::condition_variable idle;
+            std::deque<Task> queue;
+            size_t pending;  // Queued and executing tasks
+            bool stop;
+            std::thread thread;
+        };
+
+        struct Error
+        {
+            size_t line;
+            Status status;
+        };
+
+        Manager& manager_;
+
+        std::mutex dispatchMutex_;
+        DriveMask groups_[Utils::DriveCount];
+
+        std::mutex driveLocks_[Utils::DriveCount];
+        std::unique_ptr<Worker> workers_[Utils::DriveCount];
+
+        std::mutex errorMutex_;
+        std::atomic<bool> failed_;
+        std::vector<Error> errors_;
+
+    public:
+        DriveScheduler(Manager& manager, size_t inputs):
+            manager_(manager), failed_(false), errors_(inputs, Error{ NoError, Status() })
+        {
+            for(size_t i = 0; i < Utils::DriveCount; ++i) groups_[i] = DriveMask(1) << i;
+        }
+
+        ~DriveScheduler()
+        {
+            for(auto& worker : workers_)
+            {
+                if(!worker) continue;
+
+                {
+                    std::lock_guard<std::mutex> lock(worker->mutex);
+                    worker->stop = true;
+                }
+
+                worker->wakeUp.notify_one();
+                worker->thread.join();
+            }
+        }
+
+        void run(const std::vector<std::istream*>& inputs)
         {
-            Utils::Substrings splittedCmd;
-            if(!Utils::parseCommand(cmd, splittedCmd)) raise_error("Invalid command format");
+            std::vector<FileSystemState> sessions(inputs.size(), manager_.state_);
 
-            assert(!splittedCmd.empty());
-            auto cmdName = splittedCmd.front();
-            Utils::toLowerCase(cmdName);
+            std::vector<std::thread> dispatchers;
+            for(size_t i = 1; i < inputs.size(); ++i)
+            {
+                dispatchers.emplace_back(&DriveScheduler::dispatch, this, std::ref(*inputs[i]), i, std::ref(sessions[i]));
+            }
+
+            if(!inputs.empty()) dispatch(*inputs.front(), 0, sessions.front());
+
+            for(auto& d : dispatchers) d.join();
+            for(size_t i = 0; i < Utils::DriveCount; ++i) drain(i);
+
+            if(!sessions.empty()) manager_.state_.currentDir = sessions.front().currentDir;
+
+            for(size_t i = 0; i < errors_.size(); ++i)
+            {
+                const auto& error = errors_[i];
+                if(error.line == NoError) continue;
+
+                const auto msg = errorAtLine(error.line, error.status);
+                raise_error(inputs.size() > 1 ? "Input " + std::to_string(i + 1) + ": " + msg : msg);
+            }
+        }
 
-            const auto found = commands_.find(cmdName);
-            if(found == commands_.cend()) raise_error("Unknown command: " + cmdName);
+    private:
+        static size_t driveOf(const Item& item)
+        {
+            const Item* cur = &item;
 
-            const auto cmdFunc = found->second;
-            const CommandArgs args(splittedCmd.cbegin() + 1, splittedCmd.cend());
+            ItemPtr parent;
+            while((parent = cur->parent().lock())) cur = parent.get();
 
-            cmdFunc(state_, args);
+            return Utils::driveIndex(cur->name());
         }
-        catch(std::exception& e)
+
+        bool failed(size_t input, size_t line)
         {
-            std::ostringstream msg;
-            msg << "Error at line " << line << ": " << e.what();
-            raise_error(msg.str());
+            if(!failed_) return false;
+
+            std::lock_guard<std::mutex> lock(errorMutex_);
+            const auto& error = errors_[input];
+            return error.line != NoError && error.line < line;
         }
+
+        void fail(size_t input, size_t line, const Status& status)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex_);
+
+            // Commands on other drives may fail earlier in the input, but later in time
+            auto& error = errors_[input];
+            if(line < error.line)
+            {
+                error.line = line;
+                error.status = status;
+            }
+
+            failed_ = true;
+        }
+
+        void execute(const CommandFunction& func, const std::string& name, FileSystemState& state,
+            const CommandArgs& args, size_t input, size_t line)
+        {
+            if(failed(input, line)) return;
+
+            ALLOC_PROFILE_COMMAND(name);
+            TRACE_SPAN_DETAIL("execute", name);
+
+            const auto status = func(state, args);
+            if(!status.ok()) fail(input, line, status);
+        }
+
+        void work(size_t drive)
+        {
+            auto& worker = *workers_[drive];
+
+            while(true)
+            {
+                std::unique_ptr<Task> task;
+                {
+                    std::unique_lock<std::mutex> lock(worker.mutex);
+                    worker.wakeUp.wait(lock, [&worker]{ return worker.stop || !worker.queue.empty(); });
+                    if(worker.queue.empty()) return;
+
+                    task.reset(new Task(std::move(worker.queue.front())));
+                    worker.queue.pop_front();
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(driveLocks_[drive]);
+                    execute(*task->func, task->name, task->state, task->args, task->input, task->line);
+
+                    // Release current directory before the next command may check it
+                    task.reset();
+                }
+
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if(--worker.pending == 0) worker.idle.notify_all();
+            }
+        }
+
+        void enqueue(size_t drive, Task&& task)
+        {
+            if(!workers_[drive])
+            {
+                workers_[drive].reset(new Worker());
+                workers_[drive]->thread = std::thread(&DriveScheduler::work, this, drive);
+            }
+
+            auto& worker = *workers_[drive];
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.queue.push_back(std::move(task));
+                ++worker.pending;
+            }
+
+            worker.wakeUp.notify_one();
+        }
+
+        void drain(size_t drive)
+        {
+            if(!workers_[drive]) return;
+
+            auto& worker = *workers_[drive];
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.idle.wait(lock, [&worker]{ return worker.pending == 0; });
+        }
+
+        void dispatch(std::istream& in, size_t input, FileSystemState& session)
+        {
+            size_t currentDrive = driveOf(*session.currentDir);
+
+            size_t line = 1;
+            std::string cmd;
+            while(std::getline(in, cmd))
+            {
+                if(cmd.empty()) continue;
+
+                const size_t cmdLine = line++;
+                if(failed(input, cmdLine)) break;
+
+                std::string name;
+                CommandArgs args;
+                Status status;
+
+                const CommandFunction* func = nullptr;
+                {
+                    ALLOC_PROFILE_COMMAND("<parse>");
+                    TRACE_SPAN("parse");
+                    func = manager_.parseCommand(cmd, name, args, status);
+                }
+
+                if(!func)
+                {
+                    fail(input, cmdLine, status);
+                    break;
+                }
+
+                DriveMask drives = 0;
+                for(const auto& arg : args)
+                {
+                    const bool absPath = arg.size() >= 2 && Utils::validDriveName(arg.substr(0, 2));
+                    drives |= DriveMask(1) << (absPath ? Utils::driveIndex(arg) : currentDrive);
+                }
+
+                if(args.empty()) drives |= DriveMask(1) << currentDrive;
+
+                std::lock_guard<std::mutex> lock(dispatchMutex_);
+
+                const DriveMask ownDrives = drives;
+                for(size_t i = 0; i < Utils::DriveCount; ++i)
+                {
+                    if(ownDrives & (DriveMask(1) << i)) drives |= groups_[i];
+                }
+
+                const bool single = (drives & (drives - 1)) == 0;
+                if(single && name != "cd")
+                {
+                    size_t drive = 0;
+                    while(!(drives & (DriveMask(1) << drive))) ++drive;
+
+                    // Paths of other drives are absolute, their tasks get drive root: holding current
+                    // directory in a backlog would keep later commands from removing it
+                    FileSystemState state = session;
+                    if(drive != currentDrive) state.currentDir = manager_.drives_[drive];
+
+                    enqueue(drive, Task{ func, std::move(name), std::move(args), std::move(state), input, cmdLine });
+                    continue;
+                }
+
+                // Barrier: wait for drives, lock them in letter order and execute here
+                std::vector<std::unique_lock<std::mutex>> locks;
+                for(size_t i = 0; i < Utils::DriveCount; ++i)
+                {
+                    if(!(drives & (DriveMask(1) << i))) continue;
+
+                    drain(i);
+                    locks.emplace_back(driveLocks_[i]);
+                }
+
+                execute(*func, name, session, args, input, cmdLine);
+                currentDrive = driveOf(*session.currentDir);
+
+                if(single) continue;
+
+                // Group drives involved for good
+                for(size_t i = 0; i < Utils::DriveCount; ++i)
+                {
+                    if(drives & (DriveMask(1) << i)) groups_[i] = drives;
+                }
+            }
+        }
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Runs each input in its own thread, commands of different inputs on the same drive run
+    // concurrently locking only directories along their paths (see PathLocks). Commands not
+    // fitting tree locking protocol run alone: links (destroying an item may remove dynamic
+    // links anywhere), ".." (walks up), ranges (full path of current directory is used) and
+    // MOVE/COPY with paths not starting from the same directory. Once links exist, all
+    // commands run alone.
+    class ConcurrentExecutor
+    {
+        typedef Manager::FileSystemState FileSystemState;
+        typedef Manager::CommandFunction CommandFunction;
+        typedef Manager::CommandArgs CommandArgs;
+
+        static const size_t NoError = static_cast<size_t>(-1);
+
+        // Shared/exclusive lock preferring exclusive owners, C++11 has no std::shared_mutex
+        class Gate
+        {
+            std::mutex mutex_;
+            std::condition_variable released_;
+            size_t readers_;
+            size_t writersWaiting_;
+            bool writer_;
+
+        public:
+            Gate(): readers_(0), writersWaiting_(0), writer_(false) {}
+
+            void lockShared()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                released_.wait(lock, [this]{ return !writer_ && writersWaiting_ == 0; });
+                ++readers_;
+            }
+
+            void unlockShared()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(--readers_ == 0) released_.notify_all();
+            }
+
+            void lock()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ++writersWaiting_;
+                released_.wait(lock, [this]{ return !writer_ && readers_ == 0; });
+                --writersWaiting_;
+                writer_ = true;
+            }
+
+            void unlock()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    writer_ = false;
+                }
+
+                released_.notify_all();
+            }
+        };
+
+        Manager& manager_;
+        Gate gate_;
+        std::atomic<bool> links_;
+
+        // First error of each input, written by its own thread only
+        std::vector<Manager::CommandError> errors_;
+
+    public:
+        ConcurrentExecutor(Manager& manager, size_t inputs):
+            manager_(manager), links_(false), errors_(inputs, Manager::CommandError{ NoError, Status() })
+        {
+        }
+
+        void run(const std::vector<std::istream*>& inputs)
+        {
+            links_ = hasLinks(manager_.drives_);
+
+            std::vector<FileSystemState> sessions(inputs.size(), manager_.state_);
+
+            std::vector<std::thread> threads;
+            for(size_t i = 1; i < inputs.size(); ++i)
+            {
+                threads.emplace_back(&ConcurrentExecutor::execute, this, std::ref(*inputs[i]), i, std::ref(sessions[i]));
+            }
+
+            if(!inputs.empty()) execute(*inputs.front(), 0, sessions.front());
+
+            for(auto& t : threads) t.join();
+
+            if(!sessions.empty()) manager_.state_.currentDir = sessions.front().currentDir;
+
+            for(size_t i = 0; i < errors_.size(); ++i)
+            {
+                const auto& error = errors_[i];
+                if(error.line == NoError) continue;
+
+                const auto msg = errorAtLine(error.line, error.status);
+                raise_error(inputs.size() > 1 ? "Input " + std::to_string(i + 1) + ": " + msg : msg);
+            }
+        }
+
+    private:
+        void execute(std::istream& in, size_t input, FileSystemState& session)
+        {
+            PathLocks locks;
+
+            size_t line = 1;
+            std::string cmd;
+            while(std::getline(in, cmd))
+            {
+                if(cmd.empty()) continue;
+
+                const size_t cmdLine = line++;
+
+                std::string name;
+                CommandArgs args;
+                Status status;
+
+                const CommandFunction* func = nullptr;
+                {
+                    ALLOC_PROFILE_COMMAND("<parse>");
+                    TRACE_SPAN("parse");
+                    func = manager_.parseCommand(cmd, name, args, status);
+                }
+
+                if(func)
+                {
+                    size_t shared = 0;
+                    bool exclusive = !lockable(name, args, shared);
+                    if(name == "mhl" || name == "mdl") links_ = true;
+
+                    // Links may appear while waiting
+                    if(!exclusive)
+                    {
+                        gate_.lockShared();
+                        if(links_)
+                        {
+                            gate_.unlockShared();
+                            exclusive = true;
+                        }
+                    }
+
+                    if(exclusive) gate_.lock();
+
+                    locks.reset(shared);
+                    session.locks = exclusive ? nullptr : &locks;
+
+                    {
+                        ALLOC_PROFILE_COMMAND(name);
+                        TRACE_SPAN_DETAIL("execute", name);
+                        status = (*func)(session, args);
+                    }
+
+                    locks.release();
+                    session.locks = nullptr;
+
+                    if(exclusive) gate_.unlock();
+                    else gate_.unlockShared();
+                }
+
+                if(!status.ok())
+                {
+                    errors_[input] = Manager::CommandError{ cmdLine, status };
+                    return;
+                }
+            }
+        }
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Runs commands of a single script out of order: a window of upcoming commands is analyzed
+    // and a command runs on the pool as soon as no earlier command in the window touches paths
+    // related to its ones (same path, ancestor or descendant) with at least one of them writing.
+    // Directory locks (see PathLocks) protect the tree itself, path analysis keeps results the
+    // same as of sequential run. Conservatively, CD, DELTREE, links, ".." and ranges are barriers:
+    // earlier commands are finished and the command runs alone. Relative paths are made absolute
+    // with current directory, which is stable between barriers. Changes of each command are
+    // journaled until all earlier ones have finished, so on error the commands following the
+    // failed one are undone even if they have run before it.
+    class DependencyScheduler
+    {
+        typedef Manager::FileSystemState FileSystemState;
+        typedef Manager::CommandFunction CommandFunction;
+        typedef Manager::CommandArgs CommandArgs;
+
+        static const size_t NoError = static_cast<size_t>(-1);
+
+        struct Access
+        {
+            std::string path;   // Absolute, lower case, without "." segments
+            bool write;
+        };
+
+        typedef std::vector<Access> Accesses;
+
+        struct Command
+        {
+            const CommandFunction* func;
+            std::string name;
+            CommandArgs args;
+            size_t line;
+            size_t shared;
+            Accesses accesses;
+            size_t blockers;                    // Earlier conflicting commands not finished yet
+            std::vector<Command*> dependents;
+        };
+
+        // Changes of a finished command which may still have to be undone
+        struct Finished
+        {
+            size_t line;
+            ChangeJournal journal;
+        };
+
+        Manager& manager_;
+        const size_t window_;
+
+        std::mutex mutex_;
+        std::condition_variable ready_;         // Worker may take a command
+        std::condition_variable finished_;      // Command has finished
+        std::deque<Command*> queue_;
+        std::vector<std::unique_ptr<Command>> active_;  // Queued, blocked or running, in input order
+        std::vector<Finished> journals_;        // In order of finishing
+        bool stop_;
+
+        Status error_;
+        size_t errorLine_;
+
+        std::vector<std::thread> workers_;
+
+    public:
+        DependencyScheduler(Manager& manager, size_t window, size_t threads):
+            manager_(manager), window_(std::max<size_t>(window, 1)), stop_(false), errorLine_(NoError)
+        {
+            if(threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+            for(size_t i = 0; i < threads; ++i) workers_.emplace_back(&DependencyScheduler::work, this);
+        }
+
+        ~DependencyScheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+
+            ready_.notify_all();
+            for(auto& worker : workers_) worker.join();
+        }
+
+        void run(std::istream& in)
+        {
+            bool links = hasLinks(manager_.drives_);
+            std::string currentPath = currentDirectoryPath();
+
+            size_t line = 1;
+            std::string cmd;
+            while(std::getline(in, cmd))
+            {
+                if(cmd.empty()) continue;
+
+                std::unique_ptr<Command> command(new Command());
+                command->line = line++;
+
+                Status status;
+                {
+                    ALLOC_PROFILE_COMMAND("<parse>");
+                    TRACE_SPAN("parse");
+                    command->func = manager_.parseCommand(cmd, command->name, command->args, status);
+                }
+
+                if(!command->func)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    fail(command->line, status);
+                    break;
+                }
+
+                if(command->name == "mhl" || command->name == "mdl") links = true;
+
+                // Removal of whole subtree isn't journaled
+                const bool barrier = links || command->name == "cd" || command->name == "deltree" ||
+                    !lockable(command->name, command->args, command->shared) ||
+                    !collectAccesses(*command, currentPath);
+
+                if(barrier)
+                {
+                    if(!drain()) break;
+
+                    ALLOC_PROFILE_COMMAND(command->name);
+                    TRACE_SPAN_DETAIL("execute", command->name);
+                    status = (*command->func)(manager_.state_, command->args);
+                    currentPath = currentDirectoryPath();
+
+                    if(!status.ok())
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        fail(command->line, status);
+                        break;
+                    }
+
+                    continue;
+                }
+
+                if(!submit(std::move(command))) break;
+            }
+
+            drain();
+            if(errorLine_ == NoError) return;
+
+            for(auto finished = journals_.rbegin(); finished != journals_.rend(); ++finished)
+            {
+                if(finished->line > errorLine_) undoChanges(finished->journal);
+            }
+            journals_.clear();
+
+            raise_error(errorAtLine(errorLine_, error_));
+        }
+
+    private:
+        std::string currentDirectoryPath() const
+        {
+            auto path = manager_.state_.currentDir->fullPath();
+            Utils::toLowerCase(path);
+            return path;
+        }
+
+        // Paths the command reads or changes, false if they can't be told in advance
+        static bool collectAccesses(Command& command, const std::string& currentPath)
+        {
+            const auto& args = command.args;
+            const auto& name = command.name;
+
+            // Wrong number of arguments fails without touching anything
+            const bool twoPaths = name == "move" || name == "copy";
+            if(args.size() != (twoPaths ? 2u : 1u)) return true;
+
+            for(size_t i = 0; i < args.size(); ++i)
+            {
+                Access access = { absolutePath(args[i], currentPath), !(name == "copy" && i == 0) };
+                command.accesses.push_back(std::move(access));
+            }
+
+            return true;
+        }
+
+        static std::string absolutePath(const std::string& path, const std::string& currentPath)
+        {
+            Utils::Substrings segments;
+            Utils::splitString(path, Utils::DirectoryDelimiter, segments);
+
+            const bool absolute = Utils::validDriveName(segments.front());
+            std::string result = absolute ? segments.front() : currentPath;
+
+            for(size_t i = absolute ? 1 : 0; i < segments.size(); ++i)
+            {
+                const auto& segment = segments[i];
+                if(Utils::isCurrentDirectory(segment.data(), segment.size())) continue;
+
+                result += Utils::DirectoryDelimiter;
+                result += segment;
+            }
+
+            Utils::toLowerCase(result);
+            return result;
+        }
+
+        // Same path or one is an ancestor of another
+        static bool related(const std::string& lhs, const std::string& rhs)
+        {
+            const auto& shorter = lhs.size() < rhs.size() ? lhs : rhs;
+            const auto& longer = lhs.size() < rhs.size() ? rhs : lhs;
+
+            return longer.compare(0, shorter.size(), shorter) == 0 &&
+                (longer.size() == shorter.size() || longer[shorter.size()] == Utils::DirectoryDelimiter);
+        }
+
+        static bool conflict(const Command& first, const Command& second)
+        {
+            for(const auto& a : first.accesses)
+            {
+                for(const auto& b : second.accesses)
+                {
+                    if((a.write || b.write) && related(a.path, b.path)) return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Called with mutex locked
+        void fail(size_t line, const Status& status)
+        {
+            if(line >= errorLine_) return;
+
+            errorLine_ = line;
+            error_ = status;
+        }
+
+        // Waits for all submitted commands, returns false if any failed
+        bool drain()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            finished_.wait(lock, [this]{ return active_.empty(); });
+            return errorLine_ == NoError;
+        }
+
+        bool submit(std::unique_ptr<Command> command)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            finished_.wait(lock, [this]{ return active_.size() < window_ || errorLine_ != NoError; });
+
+            if(errorLine_ != NoError) return false;
+
+            for(const auto& earlier : active_)
+            {
+                if(!conflict(*earlier, *command)) continue;
+
+                earlier->dependents.push_back(command.get());
+                ++command->blockers;
+            }
+
+            if(command->blockers == 0)
+            {
+                queue_.push_back(command.get());
+                ready_.notify_one();
+            }
+
+            active_.push_back(std::move(command));
+            return true;
+        }
+
+        // Drops journals of commands which can't be undone anymore: all earlier commands have
+        // finished and none of them failed. Called with mutex locked.
+        void retire()
+        {
+            const size_t oldest = active_.empty() ? NoError : active_.front()->line;
+
+            journals_.erase(std::remove_if(journals_.begin(), journals_.end(),
+                [this, oldest](const Finished& f){ return f.line < oldest && f.line <= errorLine_; }), journals_.end());
+        }
+
+        void work()
+        {
+            FileSystemState state = { manager_.state_.drives, ItemPtr(), nullptr, manager_.state_.out };
+            PathLocks locks;
+            ChangeJournal journal;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(true)
+            {
+                ready_.wait(lock, [this]{ return stop_ || !queue_.empty(); });
+                if(queue_.empty()) return;
+
+                const auto command = queue_.front();
+                queue_.pop_front();
+
+                // Commands after the failed one are not run, earlier ones are
+                Status status;
+                if(command->line < errorLine_)
+                {
+                    lock.unlock();
+
+                    // Current directory is the same until the next barrier, no command is active then
+                    state.currentDir = manager_.state_.currentDir;
+                    locks.reset(command->shared);
+                    state.locks = &locks;
+
+                    {
+                        ALLOC_PROFILE_COMMAND(command->name);
+                        TRACE_SPAN_DETAIL("execute", command->name);
+                        recordChanges(&journal);
+                        status = (*command->func)(state, command->args);
+                        recordChanges(nullptr);
+                    }
+
+                    locks.release();
+                    state.currentDir.reset();
+
+                    lock.lock();
+                }
+
+                if(!status.ok()) fail(command->line, status);
+
+                // Failed command keeps its changes as in sequential run, unless an earlier one fails too
+                if(!journal.changes.empty())
+                {
+                    journals_.push_back(Finished{ command->line, std::move(journal) });
+                    journal.changes.clear();
+                }
+
+                for(const auto dependent : command->dependents)
+                {
+                    if(--dependent->blockers == 0) queue_.push_back(dependent);
+                }
+
+                const auto found = std::find_if(active_.begin(), active_.end(),
+                    [command](const std::unique_ptr<Command>& c){ return c.get() == command; });
+                active_.erase(found);
+
+                retire();
+
+                ready_.notify_all();
+                finished_.notify_all();
+            }
+        }
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    Manager::Manager()
+    {
+        drives_.resize(Utils::DriveCount);
+        for(size_t i = 0; i < Utils::DriveCount; ++i)
+        {
+            drives_[i] = Item::create(ItemType::eDrive);
+            drives_[i]->setName(std::string(1, static_cast<char>('A' + i)) + Utils::DriveDelimiter);
+        }
+
+        state_.drives = &drives_;
+        state_.currentDir = drives_[Utils::driveIndex("C:")];
+        state_.locks = nullptr;
+        state_.out = nullptr;
+
+        addCommand("md", &CommandsImpl::commandMD);
+        addCommand("cd", &CommandsImpl::commandCD);
+        addCommand("rd", &CommandsImpl::commandRD);
+        addCommand("mf", &CommandsImpl::commandMF);
+        addCommand("del", &CommandsImpl::commandDEL);
+        addCommand("mhl", &CommandsImpl::commandMHL);
+        addCommand("mdl", &CommandsImpl::commandMDL);
+        addCommand("move", &CommandsImpl::commandMOVE);
+        addCommand("copy", &CommandsImpl::commandCOPY);
+        addCommand("deltree", &CommandsImpl::commandDELTREE);
+        addCommand("tree", &CommandsImpl::commandTREE);
+    }
+
+    void Manager::setCommandOutput(std::ostream* out)
+    {
+        state_.out = out;
+    }
+
+    void Manager::process(std::istream& in)
+    {
+        size_t line = 1;
+        std::string cmd;
+        while(std::getline(in, cmd))
+        {
+            if(cmd.empty()) continue;
+
+            const auto status = processCommand(state_, cmd);
+            if(!status.ok()) raise_error(errorAtLine(line, status));
+
+            ++line;
+        }
+    }
+
+    void Manager::process(std::istream& in, ErrorReport& errors)
+    {
+        size_t line = 1;
+        std::string cmd;
+        while(std::getline(in, cmd))
+        {
+            if(cmd.empty()) continue;
+
+            auto status = processCommand(state_, cmd);
+            if(!status.ok()) errors.push_back(CommandError{ line, std::move(status) });
+
+            ++line;
+        }
+    }
+
+    void Manager::outputErrors(std::ostream& out, const ErrorReport& errors)
+    {
+        if(errors.empty()) return;
+
+        static const size_t maxLines = 10;
+
+        // Lines of each kind of error, in order of input
+        std::vector<std::vector<size_t>> lines(static_cast<size_t>(ErrorCode::eCount));
+        for(const auto& error : errors) lines[static_cast<size_t>(error.status.code)].push_back(error.line);
+
+        out << "Errors: " << errors.size() << '\n';
+        for(size_t code = 0; code < lines.size(); ++code)
+        {
+            const auto& codeLines = lines[code];
+            if(codeLines.empty()) continue;
+
+            out << errorMessages[code] << ": " << codeLines.size()
+                << (codeLines.size() == 1 ? " (line " : " (lines ");
+
+            for(size_t i = 0; i < codeLines.size() && i < maxLines; ++i) out << (i ? ", " : "") << codeLines[i];
+            if(codeLines.size() > maxLines) out << ", ...";
+
+            out << ")\n";
+        }
+
+        out.flush();
+    }
+
+    void Manager::processParallel(const std::vector<std::istream*>& inputs)
+    {
+        DriveScheduler scheduler(*this, inputs.size());
+        scheduler.run(inputs);
+    }
+
+    void Manager::processDependent(std::istream& in, size_t window, size_t threads)
+    {
+        DependencyScheduler scheduler(*this, window, threads);
+        scheduler.run(in);
+    }
+
+    void Manager::processConcurrent(const std::vector<std::istream*>& inputs)
+    {
+        ConcurrentExecutor executor(*this, inputs.size());
+        executor.run(inputs);
+    }
+
+    Manager::Session Manager::createSession() const
+    {
+        const Session session = { state_.currentDir, state_.out };
+        return session;
+    }
+
+    Status Manager::execute(Session& session, const std::string& cmd)
+    {
+        FileSystemState state = { &drives_, session.currentDir, nullptr, session.out };
+        auto status = processCommand(state, cmd);
+        session.currentDir = state.currentDir;
+
+        return status;
+    }
+
+    void Manager::build(const BuildItems& items)
+    {
+        const auto status = CommandsImpl::build(state_, items, false);
+        if(!status.ok()) raise_error(status.message());
+    }
+
+    void Manager::output(std::ostream& out)
+    {
+        TRACE_SPAN("render");
+
+        // Default drive is always printed, others only if not empty
+        for(const auto& drive : drives_)
+        {
+            const bool defaultDrive = Utils::driveIndex(drive->name()) == Utils::driveIndex("C:");
+            if(defaultDrive || !drive->asComposite()->empty()) printTree(out, *drive, drive->name());
+        }
+    }
+
+    Hash Manager::hash() const
+    {
+        Hash h = 0;
+        for(const auto& drive : drives_) h += drive->hash();
+        return h;
+    }
+
+    Manager::ImportStats Manager::import(const std::string& hostDir, const Path& path, const ImportOptions& options)
+    {
+        Item* target = nullptr;
+        if(!CommandsImpl::resolvePath(state_, path, target)) raise_error(Status(ErrorCode::eBadPathFormat, path).message());
+        if(!target || !target->asComposite()) raise_error(Status(ErrorCode::eInvalidPath, path).message());
+
+        return importTree(hostDir, *target, options);
+    }
+
+    Manager::ExportStats Manager::exportTree(const Path& path, const std::string& hostDir,
+        const ExportOptions& options) const
+    {
+        Item* root = nullptr;
+        if(!CommandsImpl::resolvePath(state_, path, root)) raise_error(Status(ErrorCode::eBadPathFormat, path).message());
+        if(!root) raise_error(Status(ErrorCode::eInvalidPath, path).message());
+
+        return FileSystem::exportTree(*root, hostDir, options);
+    }
+
+    Status Manager::tree(std::ostream& out, const Path& path, size_t depth, size_t entries)
+    {
+        auto state = state_;
+        state.out = &out;
+
+        return CommandsImpl::tree(state, path, depth, entries);
+    }
+
+    FrozenTree Manager::freeze() const
+    {
+        return FrozenTree(drives_);
+    }
+
+    void Manager::unfreeze(const FrozenTree& tree)
+    {
+        auto drives = tree.unfreeze();
+        if(drives.size() != Utils::DriveCount) raise_error("Frozen tree shall have all drives");
+
+        drives_.swap(drives);
+        state_.currentDir = drives_[Utils::driveIndex("C:")];
+    }
+
+    bool Manager::compare(const Manager& other, std::ostream& diff) const
+    {
+        if(hash() == other.hash()) return true;
+
+        typedef std::pair<const Item*, const Item*> ItemPair;
+
+        // Children of both directories matched by name, equal ones are skipped
+        struct Level
+        {
+            std::vector<ItemPair> items;
+            size_t next;
+        };
+
+        const auto collect = [](const ConstItemRange& lhs, const ConstItemRange& rhs, Level& level)
+        {
+            ItemOrder lhsOrder;
+            ItemOrder rhsOrder;
+            sortByName(lhs, lhsOrder);
+            sortByName(rhs, rhsOrder);
+
+            level.items.clear();
+            level.next = 0;
+
+            size_t l = 0;
+            size_t r = 0;
+            while(l < lhsOrder.size() || r < rhsOrder.size())
+            {
+                const Item* lhsItem = l < lhsOrder.size() ? lhs[lhsOrder[l]].get() : nullptr;
+                const Item* rhsItem = r < rhsOrder.size() ? rhs[rhsOrder[r]].get() : nullptr;
+
+                if(lhsItem && rhsItem)
+                {
+                    const auto lhsName = lhsItem->name();
+                    const auto rhsName = rhsItem->name();
+
+                    if(lhsName < rhsName) rhsItem = nullptr;
+                    else if(rhsName < lhsName) lhsItem = nullptr;
+                }
+
+                if(lhsItem) ++l;
+                if(rhsItem) ++r;
+
+                if(lhsItem && rhsItem && lhsItem->hash() == rhsItem->hash()) continue;
+                level.items.emplace_back(lhsItem, rhsItem);
+            }
+        };
+
+        std::vector<Level> levels(1);
+        levels.front().next = 0;
+        for(size_t i = 0; i < drives_.size(); ++i)
+        {
+            const auto lhs = drives_[i].get();
+            const auto rhs = other.drives_[i].get();
+            if(lhs->hash() != rhs->hash()) levels.front().items.emplace_back(lhs, rhs);
+        }
+
+        // Depth-first without recursion, levels are reused
+        size_t depth = 1;
+        while(depth > 0)
+        {
+            auto& level = levels[depth - 1];
+            if(level.next == level.items.size())
+            {
+                --depth;
+                continue;
+            }
+
+            const auto lhs = level.items[level.next].first;
+            const auto rhs = level.items[level.next].second;
+            ++level.next;
+
+            if(lhs && rhs && lhs->asComposite() && rhs->asComposite())
+            {
+                if(levels.size() == depth) levels.emplace_back();
+                collect(lhs->asComposite()->children(), rhs->asComposite()->children(), levels[depth++]);
+                continue;
+            }
+
+            if(lhs) diff << "- " << lhs->fullPath() << '\n';
+            if(rhs) diff << "+ " << rhs->fullPath() << '\n';
+        }
+
+        diff.flush();
+        return false;
+    }
+
+    void Manager::addCommand(const std::string& cmd, const CommandFunction& cmdFunc)
+    {
+        auto cmdName = cmd;
+        Utils::toLowerCase(cmdName);
+
+        const auto found = commands_.find(cmdName);
+        if(found != commands_.cend()) raise_error("Duplicate command: " + cmdName);
+
+        commands_[cmdName] = cmdFunc;
+    }
+
+    const Manager::CommandFunction* Manager::parseCommand(const std::string& cmd,
+        std::string& name, CommandArgs& args, Status& status) const
+    {
+        Utils::Substrings splittedCmd;
+        if(!Utils::parseCommand(cmd, splittedCmd))
+        {
+            status = ErrorCode::eInvalidCommandFormat;
+            return nullptr;
+        }
+
+        assert(!splittedCmd.empty());
+        name = splittedCmd.front();
+        Utils::toLowerCase(name);
+
+        const auto found = commands_.find(name);
+        if(found == commands_.cend())
+        {
+            status = Status(ErrorCode::eUnknownCommand, name);
+            return nullptr;
+        }
+
+        args.assign(splittedCmd.cbegin() + 1, splittedCmd.cend());
+        return &found->second;
+    }
+
+    Status Manager::processCommand(FileSystemState& state, const std::string& cmd)
+    {
+        std::string cmdName;
+        CommandArgs args;
+        Status status;
+
+        const CommandFunction* cmdFunc = nullptr;
+        {
+            ALLOC_PROFILE_COMMAND("<parse>");
+            TRACE_SPAN("parse");
+            cmdFunc = parseCommand(cmd, cmdName, args, status);
+        }
+
+        if(!cmdFunc) return status;
+
+        ALLOC_PROFILE_COMMAND(cmdName);
+        TRACE_SPAN_DETAIL("execute", cmdName);
+        return (*cmdFunc)(state, args);
     }
 
 }
@@ -12,34 +12,240 @@
 namespace FileSystem
 {
 
+    class PathLocks;
+    class FrozenTree;
+
+    enum class ErrorCode
+    {
+        eOk,
+        eInvalidCommandFormat,
+        eUnknownCommand,
+        eIncorrectArgumentsNumber,
+        eBadPathFormat,
+        eBadRangeFormat,
+        eBadDirectoryName,
+        eBadFileName,
+        eInvalidPath,
+        eInvalidSourcePath,
+        eInvalidTargetPath,
+        eAlreadyExists,
+        eTargetExists,
+        eDirectoryNotRemovable,
+        eDirectoryNotEmpty,
+        eFileNotRemovable,
+        eNotMovable,
+        eMoveIntoItself,
+        eMoveFailed,
+        eNotLinkable,
+        eNotCopyable,
+        eCopyFailed,
+        eOrphanedDirectory,
+        eOrphanedFile,
+        eOrphanedItem,
+        eDirectoryNotFound,
+        eFileNotFound,
+        eItemNotFound,
+        eCount
+    };
+
+    // Result of command, detail (e.g. path) is set for some errors only
+    struct Status
+    {
+        Status(ErrorCode code = ErrorCode::eOk): code(code) {}
+        Status(ErrorCode code, const std::string& detail): code(code), detail(detail) {}
+
+        bool ok() const
+        {
+            return code == ErrorCode::eOk;
+        }
+
+        std::string message() const;
+
+        ErrorCode code;
+        std::string detail;
+    };
+
     class Manager
     {
     public:
+        static const size_t NoLimit = static_cast<size_t>(-1);
+
         Manager();
 
+        // Commands printing something (TREE) write to out, their output is dropped if it's null
+        // (default). Output of concurrent commands is not interleaved.
+        void setCommandOutput(std::ostream* out);
+
+        // Stops at the first failed command, throws std::runtime_error "Error at line ..."
         void process(std::istream& in);
 
+        struct CommandError
+        {
+            size_t line;
+            Status status;
+        };
+
+        typedef std::vector<CommandError> ErrorReport;
+
+        // Continue-on-error mode: failed commands are collected into report and skipped
+        void process(std::istream& in, ErrorReport& errors);
+
+        // Error count by kind with line numbers, nothing is printed if there are no errors
+        static void outputErrors(std::ostream& out, const ErrorReport& errors);
+
+        // Commands on different drives run in parallel, commands on the same drive keep order.
+        // Drives linked together or involved in MOVE/COPY between them are handled as one.
+        // Each input has its own current directory starting from manager's one, first input
+        // updates it. Error is reported for the first failed line of the first failed input.
+        void processParallel(const std::vector<std::istream*>& inputs);
+
+        // Same as processParallel(), but commands of different inputs run concurrently on the
+        // same drive too, each command locks only directories along its paths. Commands using
+        // links, "..", ranges, TREE or MOVE/COPY between different drives run alone.
+        void processConcurrent(const std::vector<std::istream*>& inputs);
+
+        // Same as process(), but commands of a window of upcoming ones run in parallel unless
+        // their paths depend on each other. Output and the reported error are the same as of
+        // process(), on error the tree is left as by process() too.
+        // Number of threads defaults to the number of hardware threads.
+        void processDependent(std::istream& in, size_t window = 256, size_t threads = 0);
+
         void output(std::ostream& in);
 
+        // Prints subtree of path (relative to current directory) in output() format, the first
+        // line is its full path. At most depth levels below it are printed and the first entries
+        // children of each directory by name, the rest are counted in "|_... (N more)" line.
+        // Only printed directories are read, so it's cheap on huge trees. Same as TREE command:
+        // TREE [path [depth [entries]]].
+        Status tree(std::ostream& out, const Path& path, size_t depth = NoLimit, size_t entries = NoLimit);
+
+        // Structural hash of all drives, equal trees have equal hashes
+        Hash hash() const;
+
+        // O(1) if trees are equal, otherwise only subtrees with different hashes are visited.
+        // Differences are printed in order of paths as "- path" for items only this tree has
+        // and "+ path" for items only other one has. Returns true if trees are equal.
+        bool compare(const Manager& other, std::ostream& diff) const;
+
+        // Read-only compact copy of all drives, e.g. to keep a snapshot or to share it between
+        // threads without locks. O(n), links are kept.
+        FrozenTree freeze() const;
+
+        // Replaces all drives with a copy of frozen ones, current directory is reset to C:
+        void unfreeze(const FrozenTree& tree);
+
+        // Client with its own current directory, commands are executed with execute()
+        struct Session
+        {
+            ItemPtr currentDir;
+            std::ostream* out;  // Output of commands, see setCommandOutput()
+        };
+
+        // New session starts in manager's current directory
+        Session createSession() const;
+
+        // Executes single command, nothing throws on failure
+        Status execute(Session& session, const std::string& cmd);
+
+        struct BuildItem
+        {
+            Path path;      // Absolute path
+            ItemType type;  // eDirectory or eFile
+        };
+
+        typedef std::vector<BuildItem> BuildItems;
+
+        // Creates directories and files in bulk, parent directory shall exist or go before.
+        // O(n) when items of the same directory go together (e.g. sorted), no lookups are
+        // repeated then. Same as MD and MF, existing directory is an error while existing
+        // file is skipped. Throws std::runtime_error on failure.
+        void build(const BuildItems& items);
+
+        // Host names mapped to the same 8.3 name in a directory
+        enum class CollisionPolicy
+        {
+            eSkip,      // The first one is kept
+            eRename,    // Numeric tail, e.g. "longna12.txt"
+            eFail       // Import fails, nothing is added
+        };
+
+        struct ImportOptions
+        {
+            ImportOptions(): collisions(CollisionPolicy::eRename), threads(0) {}
+
+            CollisionPolicy collisions;
+            size_t threads;     // Number of hardware threads by default
+        };
+
+        struct ImportStats
+        {
+            size_t directories;
+            size_t files;
+            size_t renamed;
+            size_t skipped;     // Symbolic links, special and unreadable items, collisions
+        };
+
+        // Copies host directory tree into existing directory path (Linux only). Host directories
+        // are crawled in parallel and items are created directly, names are mapped to 8.3 rules
+        // (see mapHostName()). Throws std::runtime_error on failure, nothing is added then.
+        ImportStats import(const std::string& hostDir, const Path& path, const ImportOptions& options = ImportOptions());
+
+        struct ExportOptions
+        {
+            ExportOptions(): threads(0), ioUring(true) {}
+
+            size_t threads;     // Thread pool size, number of hardware threads by default
+            bool ioUring;       // Used if kernel supports it, otherwise thread pool
+        };
+
+        struct ExportStats
+        {
+            size_t directories;
+            size_t files;
+            size_t links;
+            size_t skipped;     // Links to items outside of exported subtree or gone
+            bool ioUring;       // Submitted through io_uring rather than thread pool
+        };
+
+        // Writes subtree of path into host directory (Linux only), which is created if missing:
+        // directories, empty files, hard links to files as hard links, other links as symbolic
+        // ones. Directories are created level by level, items of a level are submitted in
+        // batches. Throws std::runtime_error on failure (e.g. item exists), the rest is not written.
+        ExportStats exportTree(const Path& path, const std::string& hostDir,
+            const ExportOptions& options = ExportOptions()) const;
+
     private:
+        // Roots of drives A: to Z:
+        typedef std::vector<ItemPtr> Drives;
+
         struct FileSystemState
         {
-            ItemPtr root;
+            const Drives* drives;
             ItemPtr currentDir;
+            PathLocks* locks;   // Set when command runs concurrently with others
+            std::ostream* out;  // Output of commands, may be null
         };
 
         typedef std::vector<std::string> CommandArgs;
-        typedef std::function<void(FileSystemState&, const CommandArgs&)> CommandFunction;
+        typedef std::function<Status(FileSystemState&, const CommandArgs&)> CommandFunction;
 
         void addCommand(const std::string& cmd, const CommandFunction& cmdFunc);
-        void processCommand(const std::string& cmd, size_t line);
+        Status processCommand(FileSystemState& state, const std::string& cmd);
+
+        // Returns command function or null on failure, command name is converted to lower case
+        const CommandFunction* parseCommand(const std::string& cmd, std::string& name, CommandArgs& args,
+            Status& status) const;
 
+        Drives drives_;
         FileSystemState state_;
 
         typedef std::unordered_map<std::string, CommandFunction> KnownCommands;
         KnownCommands commands_;
 
         friend struct CommandsImpl;
+        friend class DriveScheduler;
+        friend class ConcurrentExecutor;
+        friend class DependencyScheduler;
     };
 
 }
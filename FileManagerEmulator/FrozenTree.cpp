@@ -0,0 +1,460 @@
+#include "FrozenTree.h"
+
+#include <algorithm>
+#include <cassert>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "Utils.h"
+
+namespace FileSystem
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        const size_t WordBits = 64;
+        const size_t BlockWords = 8;
+        const size_t BlockBits = WordBits * BlockWords;
+        const size_t SampleRate = 512;
+
+        inline size_t popCount(std::uint64_t word)
+        {
+#ifdef _MSC_VER
+            return static_cast<size_t>(__popcnt64(word));
+#else
+            return static_cast<size_t>(__builtin_popcountll(word));
+#endif
+        }
+
+        // Position of the k-th set bit of word, k starts from 0
+        inline size_t selectInWord(std::uint64_t word, size_t k)
+        {
+            for(size_t i = 0; i < k; ++i) word &= word - 1;
+
+#ifdef _MSC_VER
+            unsigned long index = 0;
+            _BitScanForward64(&index, word);
+            return index;
+#else
+            return static_cast<size_t>(__builtin_ctzll(word));
+#endif
+        }
+
+        class BitWriter
+        {
+        public:
+            BitWriter(std::vector<std::uint64_t>& bits, size_t& count): bits_(bits), count_(count) {}
+
+            void push(bool bit)
+            {
+                if(count_ % WordBits == 0) bits_.push_back(0);
+                if(bit) bits_.back() |= std::uint64_t(1) << (count_ % WordBits);
+                ++count_;
+            }
+
+        private:
+            std::vector<std::uint64_t>& bits_;
+            size_t& count_;
+        };
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    FrozenTree::FrozenTree(): bitCount_(0)
+    {
+        // Empty tree has the root only
+        BitWriter writer(bits_, bitCount_);
+        writer.push(true);
+        writer.push(false);
+        writer.push(false);
+
+        blockRanks_.push_back(0);
+        blockRanks_.push_back(1);
+        zeroSamples_.push_back(0);
+        oneSamples_.push_back(0);
+
+        types_.push_back(static_cast<std::uint8_t>(ItemType::eDirectory));
+        nameOffsets_.assign(2, 0);
+    }
+
+    FrozenTree::FrozenTree(const std::vector<ItemPtr>& drives): bitCount_(0)
+    {
+        BitWriter writer(bits_, bitCount_);
+
+        // Super root, then unary degrees of nodes in level order
+        writer.push(true);
+        writer.push(false);
+
+        for(size_t i = 0; i < drives.size(); ++i) writer.push(true);
+        writer.push(false);
+
+        types_.push_back(static_cast<std::uint8_t>(ItemType::eDirectory));
+        nameOffsets_.push_back(0);
+
+        // Items in level order, the queue is the order itself
+        std::vector<const Item*> order;
+        order.reserve(drives.size());
+        for(const auto& drive : drives) order.push_back(drive.get());
+
+        std::vector<std::pair<Node, const Item*>> links;
+        ItemOrder sorted;
+
+        for(size_t i = 0; i < order.size(); ++i)
+        {
+            const auto item = order[i];
+            const auto node = static_cast<Node>(i + 2);
+
+            types_.push_back(static_cast<std::uint8_t>(item->type()));
+            nameOffsets_.push_back(static_cast<std::uint32_t>(names_.size()));
+            names_ += item->name();
+
+            if(item->type() == ItemType::eHardLink || item->type() == ItemType::eDynamicLink)
+            {
+                const auto linkedItem = const_cast<Item*>(item)->asLink()->linked();
+                links.push_back(std::make_pair(node, linkedItem.get()));
+            }
+
+            const auto composite = item->asComposite();
+            if(composite)
+            {
+                const auto children = composite->children();
+                sortByName(children, sorted);
+
+                for(const auto index : sorted)
+                {
+                    order.push_back(children[index].get());
+                    writer.push(true);
+                }
+            }
+
+            writer.push(false);
+        }
+
+        nameOffsets_.push_back(static_cast<std::uint32_t>(names_.size()));
+        if(order.size() + 1 > UINT32_MAX || names_.size() > UINT32_MAX) throw std::length_error("Tree is too large to freeze");
+
+        // Targets are looked up once all nodes are known, links are few
+        if(!links.empty())
+        {
+            std::unordered_map<const Item*, Node> targets;
+            for(const auto& link : links) targets.insert(std::make_pair(link.second, None));
+
+            for(size_t i = 0; i < order.size(); ++i)
+            {
+                const auto found = targets.find(order[i]);
+                if(found != targets.end()) found->second = static_cast<Node>(i + 2);
+            }
+
+            links_.reserve(links.size());
+            for(const auto& link : links) links_.push_back(std::make_pair(link.first, targets[link.second]));
+        }
+
+        // Rank and select samples
+        size_t ones = 0;
+        size_t zeros = 0;
+        for(size_t word = 0; word < bits_.size(); ++word)
+        {
+            if(word % BlockWords == 0) blockRanks_.push_back(static_cast<std::uint32_t>(ones));
+
+            const auto bits = std::min(WordBits, bitCount_ - word * WordBits);
+            for(size_t bit = 0; bit < bits; ++bit)
+            {
+                const bool one = (bits_[word] >> bit) & 1;
+                auto& count = one ? ones : zeros;
+                auto& samples = one ? oneSamples_ : zeroSamples_;
+
+                if(count % SampleRate == 0) samples.push_back(static_cast<std::uint32_t>(word / BlockWords));
+                ++count;
+            }
+        }
+
+        blockRanks_.push_back(static_cast<std::uint32_t>(ones));
+    }
+
+    size_t FrozenTree::rank1(size_t pos) const
+    {
+        const auto block = pos / BlockBits;
+        auto rank = static_cast<size_t>(blockRanks_[block]);
+
+        const auto word = pos / WordBits;
+        for(auto w = block * BlockWords; w < word; ++w) rank += popCount(bits_[w]);
+
+        const auto bit = pos % WordBits;
+        if(bit) rank += popCount(bits_[word] & ((std::uint64_t(1) << bit) - 1));
+
+        return rank;
+    }
+
+    size_t FrozenTree::select0(size_t k) const
+    {
+        assert(k > 0);
+
+        // The last block with fewer than k zeros before it, between samples around k
+        const auto sample = (k - 1) / SampleRate;
+        size_t lo = zeroSamples_[sample];
+        size_t hi = sample + 1 < zeroSamples_.size() ? zeroSamples_[sample + 1] : blockRanks_.size() - 2;
+
+        const auto zerosBefore = [this](size_t block)
+        {
+            return block * BlockBits - blockRanks_[block];
+        };
+
+        while(lo < hi)
+        {
+            const auto mid = (lo + hi + 1) / 2;
+            if(zerosBefore(mid) < k) lo = mid;
+            else hi = mid - 1;
+        }
+
+        auto rest = k - zerosBefore(lo);
+        for(auto word = lo * BlockWords; ; ++word)
+        {
+            const auto zeros = ~bits_[word];
+            const auto count = popCount(zeros);
+            if(rest <= count) return word * WordBits + selectInWord(zeros, rest - 1);
+            rest -= count;
+        }
+    }
+
+    size_t FrozenTree::select1(size_t k) const
+    {
+        assert(k > 0);
+
+        const auto sample = (k - 1) / SampleRate;
+        size_t lo = oneSamples_[sample];
+        size_t hi = sample + 1 < oneSamples_.size() ? oneSamples_[sample + 1] : blockRanks_.size() - 2;
+
+        while(lo < hi)
+        {
+            const auto mid = (lo + hi + 1) / 2;
+            if(blockRanks_[mid] < k) lo = mid;
+            else hi = mid - 1;
+        }
+
+        auto rest = k - blockRanks_[lo];
+        for(auto word = lo * BlockWords; ; ++word)
+        {
+            const auto count = popCount(bits_[word]);
+            if(rest <= count) return word * WordBits + selectInWord(bits_[word], rest - 1);
+            rest -= count;
+        }
+    }
+
+    size_t FrozenTree::childCount(Node node) const
+    {
+        return select0(node + 1) - select0(node) - 1;
+    }
+
+    FrozenTree::Node FrozenTree::firstChild(Node node) const
+    {
+        return static_cast<Node>(rank1(select0(node) + 1) + 1);
+    }
+
+    FrozenTree::Node FrozenTree::parent(Node node) const
+    {
+        // Number of lists before the one node is in
+        const auto pos = select1(node);
+        return static_cast<Node>(pos - rank1(pos));
+    }
+
+    ItemType FrozenTree::type(Node node) const
+    {
+        return static_cast<ItemType>(types_[node - 1]);
+    }
+
+    Name FrozenTree::name(Node node) const
+    {
+        const auto begin = nameOffsets_[node - 1];
+        return names_.substr(begin, nameOffsets_[node] - begin);
+    }
+
+    Path FrozenTree::fullPath(Node node) const
+    {
+        Path path = name(node);
+        for(auto daddy = parent(node); daddy != Root; daddy = parent(daddy))
+        {
+            path = name(daddy) + Utils::DirectoryDelimiter + path;
+        }
+
+        return path;
+    }
+
+    FrozenTree::Node FrozenTree::linked(Node link) const
+    {
+        const auto found = std::lower_bound(links_.cbegin(), links_.cend(), std::make_pair(link, Node(0)));
+        return found != links_.cend() && found->first == link ? found->second : None;
+    }
+
+    size_t FrozenTree::size() const
+    {
+        return types_.size() - 1;
+    }
+
+    size_t FrozenTree::memoryUsage() const
+    {
+        return sizeof(*this) + bits_.capacity() * sizeof(bits_[0]) +
+            (blockRanks_.capacity() + zeroSamples_.capacity() + oneSamples_.capacity()) * sizeof(std::uint32_t) +
+            types_.capacity() + names_.capacity() + nameOffsets_.capacity() * sizeof(nameOffsets_[0]) +
+            links_.capacity() * sizeof(links_[0]);
+    }
+
+    FrozenTree::Node FrozenTree::findChild(Node node, const Name& name) const
+    {
+        const auto first = firstChild(node);
+        const auto count = childCount(node);
+
+        const auto compare = [this](Node lhs, const Name& rhs)
+        {
+            const auto begin = nameOffsets_[lhs - 1];
+            return names_.compare(begin, nameOffsets_[lhs] - begin, rhs) < 0;
+        };
+
+        // Directory names are upper case, file names are lower case, so binary search is done
+        // for both. Link names keep case of linked path, they are compared one by one.
+        Name upper = name;
+        Name lower = name;
+        Utils::toUpperCase(upper);
+        Utils::toLowerCase(lower);
+
+        for(const auto& candidate : { upper, lower })
+        {
+            Node lo = first;
+            Node hi = static_cast<Node>(first + count);
+            while(lo < hi)
+            {
+                const auto mid = lo + (hi - lo) / 2;
+                if(compare(mid, candidate)) lo = mid + 1;
+                else hi = mid;
+            }
+
+            if(lo < first + count && this->name(lo) == candidate) return lo;
+        }
+
+        if(links_.empty()) return None;
+
+        for(auto child = first; child < first + count; ++child)
+        {
+            if(Utils::equalNoCase(this->name(child), name)) return child;
+        }
+
+        return None;
+    }
+
+    FrozenTree::Node FrozenTree::find(const Path& path) const
+    {
+        Utils::Substrings segments;
+        Utils::splitString(path, Utils::DirectoryDelimiter, segments);
+
+        auto node = Root;
+        for(const auto& segment : segments)
+        {
+            if(segment.empty() || type(node) == ItemType::eFile) return None;
+
+            node = findChild(node, segment);
+            if(node == None) return None;
+        }
+
+        return segments.empty() ? None : node;
+    }
+
+    void FrozenTree::output(std::ostream& out) const
+    {
+        // The same layout as printTree() of manager
+        struct LevelState
+        {
+            Node next;
+            Node end;
+            size_t identSize;
+            bool dirLast;
+            bool lineToBottom;
+        };
+
+        std::string ident;
+        std::vector<LevelState> levels;
+
+        const auto drives = firstChild(Root);
+        for(auto drive = drives; drive < drives + childCount(Root); ++drive)
+        {
+            const auto count = childCount(drive);
+            const bool defaultDrive = Utils::driveIndex(name(drive)) == Utils::driveIndex("C:");
+            if(!defaultDrive && count == 0) continue;
+
+            out << name(drive) << '\n';
+
+            ident.clear();
+            levels.clear();
+
+            const auto first = firstChild(drive);
+            levels.push_back({ first, static_cast<Node>(first + count), 0, false, true });
+
+            while(!levels.empty())
+            {
+                auto& state = levels.back();
+                if(state.next == state.end)
+                {
+                    levels.pop_back();
+                    continue;
+                }
+
+                const auto node = state.next++;
+                const bool last = state.next == state.end;
+
+                ident.resize(state.identSize);
+
+                if(state.dirLast) out << ident << "|\n";
+                out << ident << "|_";
+                out.write(names_.data() + nameOffsets_[node - 1], nameOffsets_[node] - nameOffsets_[node - 1]);
+                out << '\n';
+
+                const auto nodeType = type(node);
+                state.dirLast = nodeType == ItemType::eDirectory || nodeType == ItemType::eDrive;
+                if(!state.dirLast) continue;
+
+                const bool lineToBottom = state.lineToBottom && last;
+                ident += (last && !lineToBottom) ? "   " : "|   ";
+
+                const auto childFirst = firstChild(node);
+                levels.push_back({ childFirst, static_cast<Node>(childFirst + childCount(node)), ident.size(), false,
+                    lineToBottom });
+            }
+        }
+
+        out.flush();
+    }
+
+    std::vector<ItemPtr> FrozenTree::unfreeze() const
+    {
+        const auto count = types_.size();
+
+        // Parents come before children in level order, so items are created top-down
+        std::vector<ItemPtr> items(count + 1);
+        for(Node node = Root; node <= count; ++node)
+        {
+            const auto first = firstChild(node);
+            const auto end = first + childCount(node);
+
+            for(auto child = first; child < end; ++child)
+            {
+                auto& item = items[child];
+                item = Item::create(type(child));
+                if(!item->asLink()) item->setName(name(child));
+
+                if(node != Root) items[node]->asComposite()->appendChild(item);
+            }
+        }
+
+        for(const auto& link : links_)
+        {
+            if(link.second != None) items[link.first]->asLink()->linkTo(items[link.second]);
+        }
+
+        const auto drives = firstChild(Root);
+        return std::vector<ItemPtr>(items.begin() + drives, items.begin() + drives + childCount(Root));
+    }
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "LeakDetect.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "FileSystem.h"
+
+namespace FileSystem
+{
+
+    // Immutable succinct copy of drives, see Manager::freeze(). Topology is LOUDS: nodes are
+    // numbered in level order, children of each node are consecutive and sorted by name, degrees
+    // are kept as unary codes in a bit vector with rank/select support (about 2 bits per item).
+    // Names are packed into one string, links keep their target nodes in a separate table.
+    class FrozenTree
+    {
+    public:
+        typedef std::uint32_t Node;
+
+        static const Node None = 0;
+        static const Node Root = 1;  // Parent of drives A: to Z:
+
+        FrozenTree();
+
+        // Drives A: to Z:, the same as manager has
+        explicit FrozenTree(const std::vector<ItemPtr>& drives);
+
+        // Absolute path without "." and "..", names are matched case insensitive as in commands.
+        // Returns None if there's no such item. Links are reached from their directories only,
+        // their names have delimiters.
+        Node find(const Path& path) const;
+
+        ItemType type(Node node) const;
+        Name name(Node node) const;
+        Path fullPath(Node node) const;
+
+        // Linked item of hard or dynamic link, None if it's gone
+        Node linked(Node link) const;
+
+        // Children are nodes [firstChild, firstChild + childCount) in name order
+        size_t childCount(Node node) const;
+        Node firstChild(Node node) const;
+        Node parent(Node node) const;
+
+        // Same as Manager::output()
+        void output(std::ostream& out) const;
+
+        // New items of the same tree, links included
+        std::vector<ItemPtr> unfreeze() const;
+
+        // Number of items, drives included
+        size_t size() const;
+
+        // Bytes taken by the encoding
+        size_t memoryUsage() const;
+
+    private:
+        // Number of ones in bits [0, pos)
+        size_t rank1(size_t pos) const;
+
+        // Position of the k-th zero, k starts from 1
+        size_t select0(size_t k) const;
+
+        // Position of the k-th one, k starts from 1
+        size_t select1(size_t k) const;
+
+        Node findChild(Node node, const Name& name) const;
+
+        std::vector<std::uint64_t> bits_;
+        size_t bitCount_;
+
+        // Ones before each block of BlockBits, so rank is a lookup and a few popcounts
+        std::vector<std::uint32_t> blockRanks_;
+
+        // Blocks of every SampleRate-th zero and one, select searches between two samples
+        std::vector<std::uint32_t> zeroSamples_;
+        std::vector<std::uint32_t> oneSamples_;
+
+        std::vector<std::uint8_t> types_;           // By node - 1
+        std::string names_;
+        std::vector<std::uint32_t> nameOffsets_;    // By node - 1, one more at the end
+
+        // Sorted by link node, target is None for dangling links
+        std::vector<std::pair<Node, Node>> links_;
+    };
+
+}
@@ -0,0 +1,406 @@
+#include "Importer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#endif // __linux__
+
+#include "Utils.h"
+
+namespace FileSystem
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        const char* const NoName = "noname";
+        const size_t BaseSize = 8;
+        const size_t ExtensionSize = 3;
+
+        void appendNameChars(const std::string& from, size_t begin, size_t end, size_t limit, Name& to)
+        {
+            for(auto i = begin; i < end && to.size() < limit; ++i)
+            {
+                if(Utils::isNameChar(from[i])) to += Utils::toLower(from[i]);
+            }
+        }
+
+        // Mapped names taken in a directory, numbers of renamed ones go on from the last used
+        class DirectoryNames
+        {
+        public:
+            explicit DirectoryNames(Manager::CollisionPolicy policy): policy_(policy) {}
+
+            void add(const Name& name)
+            {
+                used_.insert(name);
+            }
+
+            // False if name is taken and policy doesn't allow to rename it, or there are no
+            // numbers left. Name is changed if it's renamed.
+            bool claim(Name& name, bool directory, bool& renamed)
+            {
+                renamed = false;
+                if(used_.insert(name).second) return true;
+                if(policy_ != Manager::CollisionPolicy::eRename) return false;
+
+                auto& last = lastNumbers_[name];
+                while(true)
+                {
+                    const auto numbered = numberedName(name, ++last, directory);
+                    if(numbered.empty()) return false;
+
+                    if(used_.insert(numbered).second)
+                    {
+                        name = numbered;
+                        renamed = true;
+                        return true;
+                    }
+                }
+            }
+
+        private:
+            Manager::CollisionPolicy policy_;
+            std::unordered_set<Name> used_;
+            std::unordered_map<Name, size_t> lastNumbers_;
+        };
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    Name mapHostName(const std::string& hostName, bool directory)
+    {
+        const auto dot = directory ? std::string::npos : hostName.rfind(Utils::ExtensionDelimiter);
+        const bool extension = dot != std::string::npos && dot > 0;
+
+        Name name;
+        appendNameChars(hostName, 0, extension ? dot : hostName.size(), BaseSize, name);
+        if(name.empty()) name = NoName;
+
+        if(extension)
+        {
+            Name ext;
+            appendNameChars(hostName, dot + 1, hostName.size(), ExtensionSize, ext);
+            if(!ext.empty()) name += Utils::ExtensionDelimiter + ext;
+        }
+
+        return name;
+    }
+
+    Name numberedName(const Name& name, size_t number, bool directory)
+    {
+        const auto dot = directory ? std::string::npos : name.find(Utils::ExtensionDelimiter);
+        const auto baseSize = std::min(dot, name.size());
+
+        const auto digits = std::to_string(number);
+        if(digits.size() >= BaseSize) return Name();
+
+        auto numbered = name.substr(0, std::min(baseSize, BaseSize - digits.size())) + digits;
+        if(dot != std::string::npos) numbered.append(name, dot, std::string::npos);
+
+        return numbered;
+    }
+
+#ifdef __linux__
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        // Record of getdents64(), glibc has no wrapper
+        struct HostEntry
+        {
+            ino64_t inode;
+            off64_t offset;
+            unsigned short size;
+            unsigned char type;
+            char name[1];
+        };
+
+        // Each worker reads directories of its own deque depth first, idle ones steal the oldest
+        // (the biggest) tasks of others. Items of a directory are created and added by the worker
+        // reading it, so directories are never changed concurrently.
+        class Crawler
+        {
+        public:
+            Crawler(const Manager::ImportOptions& options, DirectoryNames& rootNames):
+                policy_(options.collisions), rootNames_(rootNames), pending_(0), failed_(false)
+            {
+                auto threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+                threads = std::max<size_t>(threads, 1);
+
+                for(size_t i = 0; i < threads; ++i) workers_.emplace_back(new Worker());
+            }
+
+            Manager::ImportStats run(const std::string& hostDir, Item& root)
+            {
+                root_ = &root;
+                pending_ = 1;
+                workers_.front()->tasks.push_back(Task{ hostDir, &root });
+
+                std::vector<std::thread> threads;
+                for(size_t i = 1; i < workers_.size(); ++i) threads.emplace_back(&Crawler::work, this, i);
+
+                work(0);
+                for(auto& t : threads) t.join();
+
+                if(failed_) throw std::runtime_error(error_);
+
+                Manager::ImportStats total = {};
+                for(const auto& worker : workers_)
+                {
+                    total.directories += worker->stats.directories;
+                    total.files += worker->stats.files;
+                    total.renamed += worker->stats.renamed;
+                    total.skipped += worker->stats.skipped;
+                }
+
+                return total;
+            }
+
+        private:
+            static const size_t BufferSize = 64 * 1024;
+
+            struct Task
+            {
+                std::string path;
+                Item* dir;
+            };
+
+            struct Worker
+            {
+                Worker(): stats(), buffer(BufferSize) {}
+
+                std::mutex mutex;
+                std::deque<Task> tasks;
+                Manager::ImportStats stats;
+                std::vector<char> buffer;
+                std::vector<Task> subdirs;
+            };
+
+            void work(size_t index)
+            {
+                auto& worker = *workers_[index];
+
+                Task task;
+                size_t idle = 0;
+                while(!failed_)
+                {
+                    if(pop(worker, task) || steal(index, task))
+                    {
+                        idle = 0;
+
+                        try { crawl(worker, task); }
+                        catch(std::exception& e) { fail(e.what()); }
+
+                        --pending_;
+                        continue;
+                    }
+
+                    // Tasks in progress may bring new ones
+                    if(pending_ == 0) break;
+
+                    if(++idle < 64) std::this_thread::yield();
+                    else std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+
+            static bool pop(Worker& worker, Task& task)
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if(worker.tasks.empty()) return false;
+
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+                return true;
+            }
+
+            bool steal(size_t thief, Task& task)
+            {
+                for(size_t i = 1; i < workers_.size(); ++i)
+                {
+                    auto& victim = *workers_[(thief + i) % workers_.size()];
+
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if(victim.tasks.empty()) continue;
+
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    return true;
+                }
+
+                return false;
+            }
+
+            void fail(const std::string& error)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex_);
+                if(failed_) return;
+
+                error_ = error;
+                failed_ = true;
+            }
+
+            // Creates items of one host directory and queues its subdirectories
+            void crawl(Worker& worker, const Task& task)
+            {
+                const bool root = task.dir == root_;
+                auto& stats = worker.stats;
+
+                const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (root ? 0 : O_NOFOLLOW);
+                const int fd = openat(AT_FDCWD, task.path.c_str(), flags);
+                if(fd < 0)
+                {
+                    if(root) fail("Unable to open " + task.path + ": " + std::strerror(errno));
+                    else ++stats.skipped;
+                    return;
+                }
+
+                DirectoryNames subdirNames(policy_);
+                auto& names = root ? rootNames_ : subdirNames;
+                auto& dir = *task.dir->asComposite();
+                auto& buffer = worker.buffer;
+
+                worker.subdirs.clear();
+
+                while(!failed_)
+                {
+                    const auto size = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                    if(size < 0) ++stats.skipped;
+                    if(size <= 0) break;
+
+                    for(long offset = 0; offset < size; )
+                    {
+                        const auto entry = reinterpret_cast<const HostEntry*>(buffer.data() + offset);
+                        offset += entry->size;
+
+                        const auto hostName = entry->name;
+                        if(!std::strcmp(hostName, ".") || !std::strcmp(hostName, "..")) continue;
+
+                        auto type = entry->type;
+                        if(type == DT_UNKNOWN)
+                        {
+                            struct stat info;
+                            if(fstatat(fd, hostName, &info, AT_SYMLINK_NOFOLLOW) != 0) type = DT_LNK;
+                            else if(S_ISDIR(info.st_mode)) type = DT_DIR;
+                            else if(S_ISREG(info.st_mode)) type = DT_REG;
+                            else type = DT_LNK;
+                        }
+
+                        // Symbolic links are not followed
+                        if(type != DT_DIR && type != DT_REG)
+                        {
+                            ++stats.skipped;
+                            continue;
+                        }
+
+                        const bool directory = type == DT_DIR;
+                        auto name = mapHostName(hostName, directory);
+
+                        bool renamed = false;
+                        if(!names.claim(name, directory, renamed))
+                        {
+                            if(policy_ == Manager::CollisionPolicy::eFail)
+                            {
+                                fail("Name collision: " + task.path + "/" + hostName + " -> " + name);
+                                break;
+                            }
+
+                            ++stats.skipped;
+                            continue;
+                        }
+
+                        if(renamed) ++stats.renamed;
+
+                        const auto item = Item::create(directory ? ItemType::eDirectory : ItemType::eFile);
+                        item->setName(name);
+                        dir.appendChild(item);
+
+                        if(!directory)
+                        {
+                            ++stats.files;
+                            continue;
+                        }
+
+                        ++stats.directories;
+                        worker.subdirs.push_back(Task{ task.path + '/' + hostName, item.get() });
+                    }
+                }
+
+                close(fd);
+
+                pending_ += worker.subdirs.size();
+
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                for(auto& subdir : worker.subdirs) worker.tasks.push_back(std::move(subdir));
+            }
+
+            Manager::CollisionPolicy policy_;
+            DirectoryNames& rootNames_;
+            Item* root_;
+
+            std::vector<std::unique_ptr<Worker>> workers_;
+            std::atomic<size_t> pending_;   // Queued and running tasks
+
+            std::atomic<bool> failed_;
+            std::mutex errorMutex_;
+            std::string error_;
+        };
+    }
+
+    Manager::ImportStats importTree(const std::string& hostDir, Item& target, const Manager::ImportOptions& options)
+    {
+        auto& composite = *target.asComposite();
+
+        DirectoryNames rootNames(options.collisions);
+        for(const auto& child : composite.children())
+        {
+            auto name = child->name();
+            Utils::toLowerCase(name);
+            rootNames.add(name);
+        }
+
+        // Items go to a detached directory first, so nothing is added on failure
+        auto staging = Item::create(ItemType::eDirectory);
+
+        Crawler crawler(options, rootNames);
+        const auto stats = crawler.run(hostDir, *staging);
+
+        // Items outlive the staging directory, they get the new parent afterwards
+        const auto children = staging->asComposite()->children();
+        const std::vector<ItemPtr> items(children.begin(), children.end());
+        staging.reset();
+
+        for(const auto& item : items) composite.appendChild(item);
+
+        return stats;
+    }
+
+#else // Not Linux
+
+    Manager::ImportStats importTree(const std::string&, Item&, const Manager::ImportOptions&)
+    {
+        throw std::runtime_error("Import is supported on Linux only");
+    }
+
+#endif // __linux__
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "LeakDetect.h"
+
+#include <string>
+
+#include "FileSystem.h"
+#include "FileSystemManager.h"
+
+namespace FileSystem
+{
+
+    // Host name mapped to 8.3 rules, lower case. Characters other than letters and digits are
+    // dropped, directory name is cut to 8 characters, file name to 8 and its extension (after the
+    // last dot, not the leading one) to 3. Name left empty becomes "noname".
+    Name mapHostName(const std::string& hostName, bool directory);
+
+    // Mapped name with number at the end of its base, e.g. "longna12.txt" for "longname.txt".
+    // Empty if number doesn't fit.
+    Name numberedName(const Name& name, size_t number, bool directory);
+
+    // Crawls host directory and adds its tree to target directory, see Manager::import()
+    Manager::ImportStats importTree(const std::string& hostDir, Item& target, const Manager::ImportOptions& options);
+
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "AllocProfiler.h"
+
 #ifdef _WIN32
 
 #ifdef _DEBUG
@@ -23,7 +25,11 @@ inline bool crtLeakDetectionInit()
 
 #define ENABLE_LEAK_DETECTION static const bool crtLeakDetectionEnabled = crtLeakDetectionInit();
 
-#else // Not Visual Studio
+#elif defined(ALLOC_PROFILE_ENABLED)
+
+#define ENABLE_LEAK_DETECTION static const bool crtLeakDetectionEnabled = AllocProfiler::enableLeakReport();
+
+#else // Not Visual Studio, no profiling
 
 #define ENABLE_LEAK_DETECTION static const bool crtLeakDetectionEnabled = false;
 
@@ -0,0 +1,274 @@
+#include "LeakDetect.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#endif // __linux__
+
+// Load generator for server mode: every connection sends one command,
+// waits for the reply and sends the next one. Reports commands per second
+// and latency percentiles for each number of connections. Each run works
+// in its own directory, so it can be repeated against the same server.
+namespace LoadGenerator
+{
+
+#ifdef __linux__
+
+    typedef std::chrono::steady_clock Clock;
+
+    class Client
+    {
+        int fd_;
+        std::string dir_;
+        size_t sent_;
+        std::string reply_;
+        Clock::time_point start_;
+
+    public:
+        Client(const std::string& dir): fd_(-1), dir_(dir), sent_(0) {}
+
+        ~Client()
+        {
+            if(fd_ >= 0) close(fd_);
+        }
+
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        int fd() const
+        {
+            return fd_;
+        }
+
+        size_t sent() const
+        {
+            return sent_;
+        }
+
+        bool connect(const sockaddr_un& addr)
+        {
+            fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if(fd_ < 0) return false;
+
+            return ::connect(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+        }
+
+        // Own directory per client, then files are created and deleted in turn
+        std::string command() const
+        {
+            if(sent_ == 0) return "MD " + dir_;
+            if(sent_ == 1) return "CD " + dir_;
+            if(sent_ % 2 == 0) return "MF F" + std::to_string(sent_ % 64) + ".TXT";
+            return "DEL F" + std::to_string((sent_ - 1) % 64) + ".TXT";
+        }
+
+        bool send()
+        {
+            const auto request = command() + "\n";
+
+            start_ = Clock::now();
+            ++sent_;
+
+            return write(fd_, request.data(), request.size()) == static_cast<ssize_t>(request.size());
+        }
+
+        // Returns true when full reply has been received
+        bool receive(double& latency, std::string& error)
+        {
+            char buffer[4096];
+            const auto size = read(fd_, buffer, sizeof(buffer));
+            if(size <= 0)
+            {
+                error = "Connection closed";
+                return true;
+            }
+
+            reply_.append(buffer, size);
+
+            const auto end = reply_.find('\n');
+            if(end == std::string::npos) return false;
+
+            latency = std::chrono::duration<double, std::micro>(Clock::now() - start_).count();
+            if(reply_.compare(0, end, "OK") != 0) error = reply_.substr(0, end);
+
+            reply_.erase(0, end + 1);
+            return true;
+        }
+    };
+
+    static double percentile(const std::vector<double>& sorted, double p)
+    {
+        if(sorted.empty()) return 0;
+
+        const auto index = static_cast<size_t>(p / 100 * (sorted.size() - 1));
+        return sorted[index];
+    }
+
+    // Directory of the run named by current time in microseconds, base 36 fits it into 7 chars
+    static std::string runDirectory()
+    {
+        static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+        auto stamp = static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+
+        std::string name;
+        for(size_t i = 0; i < 7; ++i, stamp /= 36) name.insert(name.begin(), digits[stamp % 36]);
+
+        return "C:\\R" + name;
+    }
+
+    static bool measure(const sockaddr_un& addr, const std::string& runDir, size_t connections, size_t commands)
+    {
+        std::vector<std::unique_ptr<Client>> clients;
+        std::vector<pollfd> fds;
+
+        for(size_t i = 0; i < connections; ++i)
+        {
+            clients.emplace_back(new Client(runDir + "\\L" + std::to_string(clients.size() + connections * 1000)));
+            if(!clients.back()->connect(addr))
+            {
+                std::cout << "Unable to connect: " << std::strerror(errno) << std::endl;
+                return false;
+            }
+
+            fds.push_back({ clients.back()->fd(), POLLIN, 0 });
+        }
+
+        const size_t perClient = std::max<size_t>(commands / connections, 2);
+
+        std::vector<double> latencies;
+        latencies.reserve(perClient * connections);
+
+        const auto start = Clock::now();
+
+        for(auto& client : clients) client->send();
+
+        size_t active = connections;
+        while(active > 0)
+        {
+            if(poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if(errno == EINTR) continue;
+                return false;
+            }
+
+            for(size_t i = 0; i < fds.size(); ++i)
+            {
+                if(fds[i].fd < 0 || !fds[i].revents) continue;
+
+                double latency = 0;
+                std::string error;
+                if(!clients[i]->receive(latency, error)) continue;
+
+                if(!error.empty())
+                {
+                    std::cout << "Command failed: " << error << std::endl;
+                    return false;
+                }
+
+                latencies.push_back(latency);
+
+                if(clients[i]->sent() < perClient)
+                {
+                    clients[i]->send();
+                }
+                else
+                {
+                    fds[i].fd = -1;
+                    --active;
+                }
+            }
+        }
+
+        const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << std::setw(5) << connections << " connection(s): "
+            << std::setw(10) << latencies.size() / seconds << " cmd/s, latency us p50 "
+            << std::setw(8) << percentile(latencies, 50) << ", p99 "
+            << std::setw(8) << percentile(latencies, 99) << ", p99.9 "
+            << std::setw(8) << percentile(latencies, 99.9) << std::endl;
+
+        return true;
+    }
+
+    int run(const std::string& path, const std::vector<size_t>& connections, size_t commands)
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if(path.size() >= sizeof(addr.sun_path))
+        {
+            std::cout << "Socket path is too long" << std::endl;
+            return 1;
+        }
+        std::strcpy(addr.sun_path, path.c_str());
+
+        // Each connection needs a descriptor
+        rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        // Directories of connections go into the one of the run
+        const auto runDir = runDirectory();
+        Client setup(runDir);
+        if(!setup.connect(addr) || !setup.send())
+        {
+            std::cout << "Unable to connect: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        double latency = 0;
+        std::string error;
+        while(!setup.receive(latency, error)) {}
+
+        if(!error.empty())
+        {
+            std::cout << "Command failed: " << error << std::endl;
+            return 1;
+        }
+
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "Commands per run: " << commands << ", directory " << runDir << std::endl;
+
+        for(const auto count : connections)
+        {
+            if(count == 0 || !measure(addr, runDir, count, commands)) return 1;
+        }
+
+        return 0;
+    }
+
+#else // Not Linux
+
+    int run(const std::string&, const std::vector<size_t>&, size_t)
+    {
+        std::cout << "Load generator is supported on Linux only" << std::endl;
+        return 1;
+    }
+
+#endif // __linux__
+
+}
@@ -0,0 +1,337 @@
+#include "LeakDetect.h"
+
+#include <iostream>
+#include <string>
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Utils.h"
+#include "FileSystemManager.h"
+
+#endif // __linux__
+
+// Line based protocol over Unix domain socket. Every request line gets a response:
+//  - command line: "OK" or error message "Error at line N: ...",
+//  - "OUTPUT": the whole tree followed by "OK".
+// Each connection is a session with its own current directory. Connection sending a line
+// longer than MaxLineSize gets an error and is closed.
+namespace Server
+{
+
+#ifdef __linux__
+
+    static volatile std::sig_atomic_t stopRequested = 0;
+
+    static void onStopSignal(int)
+    {
+        stopRequested = 1;
+    }
+
+    // Allow as many connections as system lets
+    void raiseFileLimit()
+    {
+        rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    bool makeAddress(const std::string& path, sockaddr_un& addr)
+    {
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if(path.size() >= sizeof(addr.sun_path)) return false;
+
+        std::strcpy(addr.sun_path, path.c_str());
+        return true;
+    }
+
+    class EventLoop
+    {
+        struct Connection
+        {
+            int fd;
+            FileSystem::Manager::Session session;
+            std::string in;
+            std::string out;
+            std::ostringstream printed;     // Output of commands, e.g. TREE
+            size_t line;
+            bool closing;
+        };
+
+        typedef std::unordered_map<int, std::unique_ptr<Connection>> Connections;
+
+        // Lines are buffered until complete, so a client can't make the buffer grow without bound
+        static const size_t MaxLineSize = 4 * 1024 * 1024;
+
+        FileSystem::Manager& manager_;
+        int listener_;
+        int epoll_;
+        Connections connections_;
+
+    public:
+        EventLoop(FileSystem::Manager& manager): manager_(manager), listener_(-1), epoll_(-1) {}
+
+        ~EventLoop()
+        {
+            for(const auto& c : connections_) close(c.first);
+            if(epoll_ >= 0) close(epoll_);
+            if(listener_ >= 0) close(listener_);
+        }
+
+        bool listen(const std::string& path)
+        {
+            sockaddr_un addr;
+            if(!makeAddress(path, addr)) return false;
+
+            listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(listener_ < 0) return false;
+
+            unlink(path.c_str());
+            if(bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+            if(::listen(listener_, SOMAXCONN) != 0) return false;
+
+            epoll_ = epoll_create1(EPOLL_CLOEXEC);
+            if(epoll_ < 0) return false;
+
+            return watch(listener_, EPOLL_CTL_ADD, EPOLLIN);
+        }
+
+        void run()
+        {
+            const int maxEvents = 256;
+            epoll_event events[maxEvents];
+
+            std::vector<Connection*> ready;
+
+            while(!stopRequested)
+            {
+                const int count = epoll_wait(epoll_, events, maxEvents, -1);
+                if(count < 0)
+                {
+                    if(errno == EINTR) continue;
+                    break;
+                }
+
+                ready.clear();
+                for(int i = 0; i < count; ++i)
+                {
+                    const int fd = events[i].data.fd;
+                    if(fd == listener_)
+                    {
+                        accept();
+                        continue;
+                    }
+
+                    const auto found = connections_.find(fd);
+                    if(found == connections_.cend()) continue;
+
+                    auto& conn = *found->second;
+                    if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive(conn);
+                    ready.push_back(&conn);
+                }
+
+                // Whole batch of received lines goes to the engine at once, then replies are sent
+                for(const auto conn : ready) execute(*conn);
+                for(const auto conn : ready) send(*conn);
+            }
+        }
+
+    private:
+        bool watch(int fd, int op, unsigned events)
+        {
+            epoll_event ev;
+            std::memset(&ev, 0, sizeof(ev));
+            ev.events = events;
+            ev.data.fd = fd;
+            return epoll_ctl(epoll_, op, fd, &ev) == 0;
+        }
+
+        void accept()
+        {
+            while(true)
+            {
+                const int fd = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if(fd < 0) return;
+
+                std::unique_ptr<Connection> conn(new Connection());
+                conn->fd = fd;
+                conn->session = manager_.createSession();
+                conn->session.out = &conn->printed;
+                conn->line = 1;
+                conn->closing = false;
+
+                if(!watch(fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP))
+                {
+                    close(fd);
+                    continue;
+                }
+
+                connections_[fd] = std::move(conn);
+            }
+        }
+
+        void receive(Connection& conn)
+        {
+            char buffer[64 * 1024];
+
+            // The rest is read once buffered lines are executed, socket stays readable
+            while(!conn.closing && conn.in.size() < MaxLineSize)
+            {
+                const auto size = read(conn.fd, buffer, sizeof(buffer));
+                if(size > 0)
+                {
+                    conn.in.append(buffer, size);
+                    continue;
+                }
+
+                if(size < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+                // Peer closed connection or failed
+                conn.closing = true;
+                return;
+            }
+        }
+
+        void execute(Connection& conn)
+        {
+            size_t begin = 0;
+            size_t end = 0;
+
+            while((end = conn.in.find('\n', begin)) != std::string::npos)
+            {
+                auto cmd = conn.in.substr(begin, end - begin);
+                begin = end + 1;
+
+                if(!cmd.empty() && cmd.back() == '\r') cmd.pop_back();
+                if(cmd.empty()) continue;
+
+                if(Utils::equalNoCase(cmd, "output"))
+                {
+                    std::ostringstream tree;
+                    manager_.output(tree);
+                    conn.out += tree.str();
+                    conn.out += "OK\n";
+                    continue;
+                }
+
+                const auto status = manager_.execute(conn.session, cmd);
+                const auto line = conn.line++;
+
+                if(conn.printed.tellp() > 0)
+                {
+                    conn.out += conn.printed.str();
+                    conn.printed.str("");
+                }
+
+                if(status.ok())
+                {
+                    conn.out += "OK\n";
+                    continue;
+                }
+
+                conn.out += "Error at line " + std::to_string(line) + ": " + status.message() + '\n';
+            }
+
+            conn.in.erase(0, begin);
+
+            // What's left is an incomplete line
+            if(conn.in.size() >= MaxLineSize)
+            {
+                conn.out += "Error at line " + std::to_string(conn.line) + ": Line is too long\n";
+                conn.in.clear();
+                conn.closing = true;
+            }
+        }
+
+        void send(Connection& conn)
+        {
+            size_t sent = 0;
+            while(sent < conn.out.size())
+            {
+                const auto size = write(conn.fd, conn.out.data() + sent, conn.out.size() - sent);
+                if(size > 0)
+                {
+                    sent += size;
+                    continue;
+                }
+
+                if(size < 0 && errno == EINTR) continue;
+                if(size < 0 && errno == EAGAIN) break;
+
+                conn.closing = true;
+                conn.out.clear();
+                sent = 0;
+                break;
+            }
+
+            conn.out.erase(0, sent);
+
+            if(conn.closing && conn.out.empty())
+            {
+                // Session goes away, so does its current directory
+                close(conn.fd);
+                connections_.erase(conn.fd);
+                return;
+            }
+
+            // Wait for socket to become writable if reply doesn't fit, closing one isn't read anymore
+            const unsigned events = (conn.closing ? 0u : static_cast<unsigned>(EPOLLIN | EPOLLRDHUP)) |
+                (conn.out.empty() ? 0u : static_cast<unsigned>(EPOLLOUT));
+            watch(conn.fd, EPOLL_CTL_MOD, events);
+        }
+    };
+
+    int run(const std::string& path)
+    {
+        raiseFileLimit();
+
+        std::signal(SIGINT, &onStopSignal);
+        std::signal(SIGTERM, &onStopSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        FileSystem::Manager manager;
+        EventLoop loop(manager);
+
+        if(!loop.listen(path))
+        {
+            std::cout << "Unable to listen on " << path << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        std::cout << "Listening on " << path << std::endl;
+        loop.run();
+
+        unlink(path.c_str());
+        manager.output(std::cout);
+        return 0;
+    }
+
+#else // Not Linux
+
+    int run(const std::string&)
+    {
+        std::cout << "Server mode is supported on Linux only" << std::endl;
+        return 1;
+    }
+
+#endif // __linux__
+
+}
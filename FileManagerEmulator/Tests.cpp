@@ -1,8 +1,25 @@
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "Utils.h"
 #include "FileSystem.h"
+#include "FileSystemManager.h"
+#include "FrozenTree.h"
+#include "Exporter.h"
+#include "Importer.h"
+
+#ifdef __linux__
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace Tests
 {
@@ -18,6 +35,141 @@ namespace Tests
         }
     }
 
+    std::string runScript(const std::string& script)
+    {
+        std::istringstream in(script);
+        std::ostringstream out;
+
+        FileSystem::Manager manager;
+        manager.process(in);
+        manager.output(out);
+
+        return out.str();
+    }
+
+    std::string runScriptParallel(const std::vector<std::string>& scripts, bool concurrent = false)
+    {
+        std::vector<std::unique_ptr<std::istringstream>> streams;
+        std::vector<std::istream*> inputs;
+
+        for(const auto& script : scripts)
+        {
+            streams.emplace_back(new std::istringstream(script));
+            inputs.push_back(streams.back().get());
+        }
+
+        std::ostringstream out;
+
+        FileSystem::Manager manager;
+        if(concurrent) manager.processConcurrent(inputs);
+        else manager.processParallel(inputs);
+
+        manager.output(out);
+
+        return out.str();
+    }
+
+    std::string runScriptDependent(const std::string& script, size_t window = 16)
+    {
+        std::istringstream in(script);
+        std::ostringstream out;
+
+        FileSystem::Manager manager;
+        manager.processDependent(in, window, 4);
+        manager.output(out);
+
+        return out.str();
+    }
+
+    // Differences of trees built by scripts, empty if equal
+    std::string compareScripts(const std::string& lhs, const std::string& rhs)
+    {
+        FileSystem::Manager managers[2];
+        std::istringstream lhsIn(lhs);
+        std::istringstream rhsIn(rhs);
+        managers[0].process(lhsIn);
+        managers[1].process(rhsIn);
+
+        std::ostringstream diff;
+        const bool equal = managers[0].compare(managers[1], diff);
+        if(equal != (managers[0].hash() == managers[1].hash())) return "Hash mismatch";
+
+        return equal ? std::string() : diff.str();
+    }
+
+    std::string errorOf(const std::function<std::string()>& run)
+    {
+        try { run(); } catch(std::exception& e) { return e.what(); }
+        return std::string();
+    }
+
+    // Error of the script followed by the tree left by it
+    std::string resultOf(const std::string& script, bool dependent)
+    {
+        std::istringstream in(script);
+        std::ostringstream out;
+
+        FileSystem::Manager manager;
+        out << errorOf([&]{
+            if(dependent) manager.processDependent(in, 16, 4);
+            else manager.process(in);
+            return std::string(); }) << "\n";
+        manager.output(out);
+
+        return out.str();
+    }
+
+    std::string deepTreeScript(size_t depth)
+    {
+        std::string script = "MD A\nCD A\n";
+        for(size_t i = 0; i < depth; ++i) script += "MD D\nCD D\n";
+        script += "MF f.txt\nCD C:\n";
+        return script;
+    }
+
+#ifdef __linux__
+    // Host directory removed with everything in it
+    class HostDirectory
+    {
+    public:
+        HostDirectory()
+        {
+            char pattern[] = "/tmp/fmeXXXXXX";
+            if(mkdtemp(pattern)) root_ = pattern;
+        }
+
+        ~HostDirectory()
+        {
+            const auto remove = [](const char* path, const struct stat*, int, struct FTW*)
+            {
+                return ::remove(path);
+            };
+
+            if(!root_.empty()) nftw(root_.c_str(), remove, 16, FTW_DEPTH | FTW_PHYS);
+        }
+
+        const std::string& root() const { return root_; }
+
+        void dir(const std::string& path)
+        {
+            mkdir((root_ + '/' + path).c_str(), 0700);
+        }
+
+        void file(const std::string& path)
+        {
+            std::ofstream((root_ + '/' + path).c_str());
+        }
+
+        void link(const std::string& path, const std::string& target)
+        {
+            symlink(target.c_str(), (root_ + '/' + path).c_str());
+        }
+
+    private:
+        std::string root_;
+    };
+#endif
+
     int run()
     {
         failedCount = 0;
@@ -130,6 +282,674 @@ namespace Tests
                 cmd.size() == 4 && cmd[0] == "MD" && cmd[1] == "bla" && cmd[2] == "bal" && cmd[3] == "BLAH");
         }
 
+        caseId = 110;
+        {
+            // Deep trees shall not overflow the stack
+            const size_t depth = 100000;
+            const auto script = deepTreeScript(depth);
+
+            check(1, runScript(script + "DELTREE C:\\A\n") == "C:\n");
+            check(2, runScript(script + "MD B\nCOPY C:\\A C:\\B\nDELTREE C:\\A\nDELTREE C:\\B\n") == "C:\n");
+            check(3, runScript(script + "MD B\nMOVE C:\\A C:\\B\nDELTREE C:\\B\n") == "C:\n");
+
+            const auto tree = runScript(deepTreeScript(2) + "MD B\nCOPY C:\\A C:\\B\n");
+            check(4, tree ==
+                "C:\n"
+                "|_A\n"
+                "|   |_D\n"
+                "|      |_D\n"
+                "|         |_f.txt\n"
+                "|\n"
+                "|_B\n"
+                "|   |_A\n"
+                "|   |   |_D\n"
+                "|   |   |   |_D\n"
+                "|   |   |   |   |_f.txt\n");
+        }
+
+        caseId = 130;
+        {
+            Utils::Substrings items;
+
+            check(1, !Utils::expandRanges("F{1..}", items, 100));
+            check(2, !Utils::expandRanges("F{..2}", items, 100));
+            check(3, !Utils::expandRanges("F{2..1}", items, 100));
+            check(4, !Utils::expandRanges("F{1..2", items, 100));
+            check(5, !Utils::expandRanges("F{a..b}", items, 100));
+            check(6, !Utils::expandRanges("F{1..101}", items, 100));
+            check(7, Utils::expandRanges("F", items, 100) && items.size() == 1 && items[0] == "F");
+            check(8, Utils::expandRanges("F{9..11}.TXT", items, 100) && items.size() == 3 &&
+                items[0] == "F9.TXT" && items[1] == "F10.TXT" && items[2] == "F11.TXT");
+            check(9, Utils::expandRanges("U{1..2}\\V{3..4}", items, 100) && items.size() == 4 &&
+                items[0] == "U1\\V3" && items[1] == "U1\\V4" && items[2] == "U2\\V3" && items[3] == "U2\\V4");
+        }
+
+        caseId = 140;
+        {
+            check(1, runScript("MD DATA\nMF C:\\DATA\\F{1..3}.TXT\nMD U{1..2}\nMD U{1..2}\\V{1..2}\n") ==
+                "C:\n"
+                "|_DATA\n"
+                "|   |_f1.txt\n"
+                "|   |_f2.txt\n"
+                "|   |_f3.txt\n"
+                "|\n"
+                "|_U1\n"
+                "|   |_V1\n"
+                "|   |\n"
+                "|   |_V2\n"
+                "|\n"
+                "|_U2\n"
+                "|   |_V1\n"
+                "|   |\n"
+                "|   |_V2\n");
+
+            const auto fails = [](const std::string& script)
+            {
+                try { runScript(script); } catch(std::exception&) { return true; }
+                return false;
+            };
+
+            check(2, fails("MD U{1..2}\\V\n"));
+            check(3, fails("MD U1\nMD U{1..2}\n"));
+            check(4, fails("MD U{1..2\n"));
+            check(5, fails("MD U{1..1}{1..11}\nMD U{1..11}{1..1}\n"));
+            check(6, !fails("MF F1.TXT\nMF F{1..2}.TXT\n"));
+
+            // Items of the same directory are not together, directories are looked up again
+            typedef FileSystem::Manager::BuildItem BuildItem;
+            FileSystem::Manager manager;
+            manager.build({
+                BuildItem{ "C:\\B", FileSystem::ItemType::eDirectory },
+                BuildItem{ "C:\\A", FileSystem::ItemType::eDirectory },
+                BuildItem{ "C:\\B\\F.TXT", FileSystem::ItemType::eFile },
+                BuildItem{ "C:\\A\\F.TXT", FileSystem::ItemType::eFile },
+                BuildItem{ "C:\\B\\F.TXT", FileSystem::ItemType::eFile } });
+
+            std::ostringstream out;
+            manager.output(out);
+            check(7, out.str() == "C:\n|_A\n|   |_f.txt\n|\n|_B\n|   |_f.txt\n");
+
+            // Failed range creates nothing
+            check(8, resultOf("MD U2\nMD C:\\U{1..3}\n", false) ==
+                "Error at line 2: Directory or file already exists: C:\\U2\nC:\n|_U2\n");
+            check(9, resultOf("MD A\nMF A\\V2\nMD A\\V{1..3}\n", false) ==
+                "Error at line 3: Directory or file already exists: C:\\A\\V2\nC:\n|_A\n|   |_v2\n");
+
+            FileSystem::Manager failed;
+            const auto error = errorOf([&]{
+                failed.build({
+                    BuildItem{ "C:\\N", FileSystem::ItemType::eDirectory },
+                    BuildItem{ "C:\\N\\F.TXT", FileSystem::ItemType::eFile },
+                    BuildItem{ "C:\\F.TXT", FileSystem::ItemType::eFile },
+                    BuildItem{ "C:\\M\\X", FileSystem::ItemType::eDirectory } });
+                return std::string(); });
+
+            std::ostringstream empty;
+            failed.output(empty);
+            check(10, !error.empty() && empty.str() == "C:\n");
+        }
+
+        caseId = 150;
+        {
+            // Drives A: to Z:, only default one and not empty ones are printed
+            check(1, runScript("MD D:\\X\nCD D:\\X\nMF F.TXT\nMD A:\\Y\nCD C:\nMD Z\n") ==
+                "A:\n|_Y\nC:\n|_Z\nD:\n|_X\n|   |_f.txt\n");
+
+            check(2, runScript("MD D:\\X\nMD E:\\Y\nMHL D:\\X E:\\Y\nMF D:\\X\\F.TXT\nMOVE D:\\X\\F.TXT E:\n") ==
+                "C:\nD:\n|_X\nE:\n|_Y\n|   |_hlink[D:\\X]\n|\n|_f.txt\n");
+
+            // Parallel execution over drives gives the same result as sequential one
+            std::string script;
+            for(size_t i = 0; i < 200; ++i)
+            {
+                const auto n = std::to_string(i);
+                const auto drive = std::string(1, static_cast<char>('C' + i % 4)) + ":";
+                script += "MD " + drive + "\\D" + n + "\n";
+                script += "MF " + drive + "\\D" + n + "\\F.TXT\n";
+                if(i % 50 == 49) script += "CD " + drive + "\\D" + n + "\nMF G.TXT\n";
+                if(i % 20 == 19) script += "COPY " + drive + "\\D" + n + " C:\n";
+                if(i % 30 == 29) script += "MDL " + drive + "\\D" + n + "\\F.TXT F:\n";
+                if(i % 10 == 9) script += "DELTREE " + std::string(1, static_cast<char>('C' + (i - 5) % 4)) +
+                    ":\\D" + std::to_string(i - 5) + "\n";
+            }
+
+            check(3, runScriptParallel({ script }) == runScript(script));
+
+            // Error is reported for the first failed line
+            const auto failing = script + "MD C:\\D0\\F.TXT\\X\nMD C:\\D0\n" + script;
+            const auto error = errorOf([&]{ return runScript(failing); });
+            check(4, !error.empty() && errorOf([&]{ return runScriptParallel({ failing }); }) == error);
+
+            // Inputs have own current directories
+            check(5, runScriptParallel({ "MD D:\\A\nCD D:\\A\nMF F.TXT\n", "MD E:\\B\nCD E:\\B\nMF F.TXT\n" }) ==
+                "C:\nD:\n|_A\n|   |_f.txt\nE:\n|_B\n|   |_f.txt\n");
+
+            // Backlog of another drive doesn't keep former current directory from removal
+            std::string backlog = "MD C:\\X\nCD C:\\X\n";
+            for(size_t i = 0; i < 3000; ++i) backlog += "MD D:\\A" + std::to_string(i) + "\n";
+            for(size_t i = 0; i < 3000; ++i) backlog += "DELTREE D:\\A" + std::to_string(i) + "\n";
+            backlog += "CD C:\nRD C:\\X\n";
+
+            std::string result;
+            check(6, errorOf([&]{ return result = runScriptParallel({ backlog }); }).empty() && result == "C:\n");
+        }
+
+        caseId = 160;
+        {
+            const std::string script = "MD A\nMD A\nRD B\nMF A\\F.TXT\nFOO\nRD A\nRD C:\\X\nMD B\n";
+
+            // Default mode stops at the first error
+            check(1, errorOf([&]{ return runScript(script); }) == "Error at line 2: Directory or file already exists");
+            check(2, errorOf([&]{ return runScript("foo bar\n"); }) == "Error at line 1: Unknown command: foo");
+
+            // Continue-on-error mode skips failed commands
+            std::istringstream in(script);
+            FileSystem::Manager manager;
+            FileSystem::Manager::ErrorReport errors;
+            manager.process(in, errors);
+
+            std::ostringstream out;
+            manager.output(out);
+            check(3, out.str() == "C:\n|_A\n|   |_f.txt\n|\n|_B\n");
+
+            check(4, errors.size() == 5);
+            check(5, errors.size() == 5 && errors[2].line == 5 &&
+                errors[2].status.code == FileSystem::ErrorCode::eUnknownCommand &&
+                errors[2].status.message() == "Unknown command: foo");
+
+            std::ostringstream report;
+            FileSystem::Manager::outputErrors(report, errors);
+            check(6, report.str() ==
+                "Errors: 5\n"
+                "Unknown command: 1 (line 5)\n"
+                "Invalid path: 2 (lines 3, 7)\n"
+                "Directory or file already exists: 1 (line 2)\n"
+                "Unable to remove non-empty directory: 1 (line 6)\n");
+
+            // Session execution doesn't throw either
+            auto session = manager.createSession();
+            check(7, manager.execute(session, "CD A").ok() && !manager.execute(session, "RD C:\\A").ok());
+            check(8, manager.execute(session, "MF G.TXT").ok() && manager.execute(session, "DEL C:\\A\\G.TXT").ok());
+        }
+
+        caseId = 170;
+        {
+            // Relative segments are resolved against the tree
+            check(1, runScript(
+                "MD A\nMD A\\B\nCD A\\B\nMD ..\\C\nMF .\\F.TXT\nMF ..\\..\\G.TXT\nCD ..\\.\\C\\..\n"
+                "MD C:\\A\\B\\..\\..\\D\nCOPY .\\B\\F.TXT ..\\D\nMOVE ..\\G.TXT C\nCD C:\\..\n"
+                "DEL D\\F.TXT\nRD A\\B\\..\\..\\D\\..\\D\n") ==
+                "C:\n"
+                "|_A\n"
+                "|   |_B\n"
+                "|   |   |_f.txt\n"
+                "|   |\n"
+                "|   |_C\n"
+                "|   |   |_g.txt\n");
+
+            check(2, runScript("MD A\nCD A\nMD ..\\..\\..\\B\nCD .\nCD ..\nCD ..\nMD .\\C\n") ==
+                "C:\n|_A\n|\n|_B\n|\n|_C\n");
+
+            // ".." can't go through a file, "." and ".." are not names
+            check(3, errorOf([&]{ return runScript("MF F\nMD F\\..\\A\n"); }) == "Error at line 2: Invalid path");
+            check(4, errorOf([&]{ return runScript("MD A\\..\n"); }) == "Error at line 1: Bad path format");
+            check(5, errorOf([&]{ return runScript("MF .\n"); }) == "Error at line 1: Bad path format");
+            check(6, errorOf([&]{ return runScript("CD ...\n"); }) == "Error at line 1: Bad path format");
+
+            // Format errors take precedence over missing directories
+            check(7, errorOf([&]{ return runScript("CD X\\..\\Y;\n"); }) == "Error at line 1: Bad path format");
+            check(8, errorOf([&]{ return runScript("MD A\nMF A\\F\nMF A\\F\\G.TXT\n"); }) ==
+                "Error at line 3: Invalid path");
+        }
+
+        caseId = 180;
+        {
+            // Independent scripts on the same drive give the same tree as sequential run
+            std::vector<std::string> scripts;
+            std::string sequential;
+            for(size_t i = 0; i < 4; ++i)
+            {
+                const auto dir = "W" + std::to_string(i);
+                std::string script = "MD " + dir + "\nCD " + dir + "\nMD A\nMD B\nMD A\\C\nMF A\\C\\F.TXT\n";
+                for(size_t j = 0; j < 50; ++j) script += "MF C:\\F" + std::to_string(i * 100 + j) + ".TXT\n";
+                script += "COPY A B\nCOPY A .\\A\\C\nMOVE B\\A\\C\\F.TXT B\nDELTREE A\\C\nMD A\\C\nRD A\\C\n";
+                script += "MOVE B A\nCD C:\\" + dir + "\\A\nDELTREE C:\\" + dir + "\\A\nMF G.TXT\nCD C:\n";
+
+                scripts.push_back(script);
+                sequential += script;
+            }
+
+            const auto expected = runScript(sequential);
+            check(1, runScriptParallel(scripts, true) == expected);
+            check(2, runScriptParallel({ sequential }, true) == expected);
+
+            // Links, ".." and MOVE between drives run alone
+            check(3, runScriptParallel({ "MD A\nMD L\nMHL A L\nMD D:\\B\nMOVE D:\\B A\n", "MD E:\\X\nMD E:\\X\\..\\Y\n" }, true) ==
+                runScript("MD A\nMD L\nMHL A L\nMD D:\\B\nMOVE D:\\B A\nMD E:\\X\nMD E:\\X\\..\\Y\n"));
+
+            // Moving into itself destroys source, its locks are released
+            check(4, errorOf([&]{ return runScriptParallel({ "MD A\nMD A\\B\nMOVE A A\\B\n", "MD C\n" }, true); }) ==
+                "Input 1: Error at line 3: Invalid target path, cannot move into itself");
+
+            // The first failed input is reported, the first input sets current directory
+            check(5, errorOf([&]{ return runScriptParallel({ "MD A\n", "MD B\nRD X\n", "RD Y\n" }, true); }) ==
+                "Input 2: Error at line 2: Invalid path");
+
+            FileSystem::Manager manager;
+            std::istringstream first("MD A\nCD A\n");
+            std::istringstream second("MD C:\\B\nCD C:\\B\n");
+            manager.processConcurrent({ &first, &second });
+
+            std::istringstream relative("MD D\n");
+            manager.process(relative);
+
+            std::ostringstream out;
+            manager.output(out);
+            check(6, out.str() == "C:\n|_A\n|   |_D\n|\n|_B\n");
+        }
+
+        caseId = 190;
+        {
+            // Commands on disjoint subtrees run out of order, tree is the same
+            std::string script;
+            for(size_t i = 0; i < 20; ++i)
+            {
+                const auto dir = "C:\\U" + std::to_string(i);
+                script += "MD " + dir + "\nMD " + dir + "\\A\nMF " + dir + "\\A\\F.TXT\nMD " + dir + "\\B\n";
+                script += "COPY " + dir + "\\A " + dir + "\\B\nMOVE " + dir + "\\A\\F.TXT " + dir + "\n";
+                if(i % 3 == 0) script += "DELTREE " + dir + "\\B\nRD " + dir + "\\A\n";
+                if(i % 4 == 0) script += "CD " + dir + "\nMD X\nMF .\\X\\Y.TXT\nMD Z\nCOPY X Z\nCD C:\n";
+            }
+
+            const auto expected = runScript(script);
+            check(1, runScriptDependent(script) == expected);
+            check(2, runScriptDependent(script, 1) == expected);
+
+            // Links, ranges and ".." are barriers
+            const std::string barriers = "MD A\nMD B\nMF A\\F.TXT\nMHL A\\F.TXT B\nMF A\\G.TXT\nMD C{1..3}\nMD C1\\..\\D\n";
+            check(3, runScriptDependent(barriers) == runScript(barriers));
+
+            // The first failed line is reported even if later commands have failed before
+            std::string failing;
+            for(size_t i = 0; i < 50; ++i) failing += "MD D" + std::to_string(i) + "\n";
+            failing += "RD D10\\X\n";
+            for(size_t i = 0; i < 50; ++i) failing += "RD E" + std::to_string(i) + "\n";
+
+            check(4, errorOf([&]{ return runScriptDependent(failing); }) == "Error at line 51: Invalid path");
+            check(5, errorOf([&]{ return runScriptDependent("MD A\nMD A\\B\nXX A\nMD C\n"); }) ==
+                "Error at line 3: Unknown command: xx");
+            check(6, errorOf([&]{ return runScriptDependent("MD A\nMD A\\B\nRD A\nMD C\n"); }) ==
+                "Error at line 3: Unable to remove non-empty directory");
+
+            // Commands following the failed one are undone, even if they have finished before it
+            std::string undone = "MD BIG\nMD BIG\\D{1..100}\nMF BIG\\D{1..100}\\F{1..50}.TXT\nMD T\n";
+            for(size_t i = 0; i < 20; ++i) undone += "MD K" + std::to_string(i) + "\nMF K" + std::to_string(i) + "\\F.TXT\n";
+            undone += "CD C:\nCOPY BIG T\nRD T\\BIG\n";
+            for(size_t i = 0; i < 20; ++i)
+            {
+                const auto n = std::to_string(i);
+                undone += "MD E" + n + "\nDEL K" + n + "\\F.TXT\nMOVE K" + n + " E" + n + "\nCOPY E" + n + " BIG\\D1\n";
+            }
+
+            const auto sequential = resultOf(undone, false);
+            check(7, sequential.find("Error at line 47: Unable to remove non-empty directory\n") == 0);
+            for(size_t i = 0; i < 5; ++i) check(8, resultOf(undone, true) == sequential);
+        }
+
+        caseId = 200;
+        {
+            // Hash doesn't depend on order of commands and history of changes
+            check(1, compareScripts("MD A\nMD B\nMF A\\F.TXT\nMD A\\C\n", "MD B\nMD A\nMD A\\C\nMF A\\F.TXT\n").empty());
+            check(2, compareScripts("MD A\nMD B\nMF A\\F.TXT\nMOVE A\\F.TXT B\nCOPY B A\nDELTREE B\nMD B\n",
+                "MD A\nMD B\nMD A\\B\nMF A\\B\\F.TXT\n").empty());
+            check(3, compareScripts("MD A\nMD A\\B\nCD A\\B\nDELTREE C:\\A\nCD C:\nMD D:\\X\nRD D:\\X\n", "MD A\nMD A\\B\n").empty());
+
+            // Only different subtrees are reported
+            check(4, compareScripts("MD A\nMD A\\B\nMF A\\B\\F.TXT\nMD C\nMF G.TXT\n", "MD A\nMD A\\B\nMF A\\B\\H.TXT\nMD C\nMD D:\\E\n") ==
+                "- C:\\A\\B\\f.txt\n+ C:\\A\\B\\h.txt\n- C:\\g.txt\n+ D:\\E\n");
+            check(5, compareScripts("MD A\nMD A\\B\n", "MD A\nMF A\\B\n") == "- C:\\A\\B\n+ C:\\A\\b\n");
+
+            // Link name shows linked item path, which changes when it's moved
+            check(6, compareScripts("MD A\nMD B\nMD C\nMF A\\F.TXT\nMDL A\\F.TXT B\nMOVE A\\F.TXT C\n",
+                "MD A\nMD B\nMD C\nMF C\\F.TXT\nMDL C\\F.TXT B\n").empty());
+            check(7, compareScripts("MD A\nMD B\nMD C\nMF A\\F.TXT\nMDL A\\F.TXT B\nMOVE A C\n",
+                "MD A\nMD B\nMD C\nMF A\\F.TXT\nMDL A\\F.TXT B\n") ==
+                "+ C:\\A\n+ C:\\B\\dlink[C:\\A\\f.txt]\n- C:\\B\\dlink[C:\\C\\A\\f.txt]\n- C:\\C\\A\n");
+
+            // Removed linked item takes dynamic links with it
+            check(8, compareScripts("MD A\nMD B\nMF A\\F.TXT\nMDL A\\F.TXT B\nMHL A B\nDEL A\\F.TXT\n",
+                "MD A\nMD B\nMHL A B\n").empty());
+        }
+
+        caseId = 210;
+        {
+            using namespace FileSystem;
+
+            // Subtree without links, linked items and current directories is detached at once
+            const auto root = Item::create(ItemType::eDrive);
+            root->setName("C:");
+
+            const auto dir = Item::create(ItemType::eDirectory);
+            dir->setName("A");
+            root->asComposite()->addChild(dir);
+
+            ItemWeakPtr subdir;
+            ItemWeakPtr file;
+            {
+                const auto item = Item::create(ItemType::eDirectory);
+                item->setName("B");
+                dir->asComposite()->addChild(item);
+                subdir = item;
+
+                const auto itemFile = Item::create(ItemType::eFile);
+                itemFile->setName("F.TXT");
+                item->asComposite()->addChild(itemFile);
+                file = itemFile;
+            }
+
+            check(1, dir->asComposite()->childrenDetachable());
+            {
+                const auto link = Item::create(ItemType::eDynamicLink);
+                link->asLink()->linkTo(file.lock());
+                check(2, !dir->asComposite()->childrenDetachable());
+
+                root->asComposite()->addChild(link);
+                check(3, !root->asComposite()->childrenDetachable());
+                root->asComposite()->removeChild(*link);
+            }
+
+            check(4, dir->asComposite()->childrenDetachable() && root->asComposite()->childrenDetachable());
+            {
+                const auto current = subdir.lock()->asComposite()->pinAsCurrent();
+                const auto copy = current;
+                check(5, !dir->asComposite()->childrenDetachable() && subdir.lock()->asComposite()->childrenDetachable());
+            }
+
+            check(6, dir->asComposite()->childrenDetachable());
+            dir->asComposite()->detachChildren();
+            check(7, dir->asComposite()->empty() && dir->asComposite()->childrenHash() == 0);
+
+            waitForReclaim();
+            check(8, subdir.expired() && file.expired());
+
+            // Links to removed items are removed right away, hard linked and current directories stay
+            check(9, runScript("MD A\nMD A\\B\nMF A\\B\\F.TXT\nMD L\nMDL A\\B\\F.TXT L\nDELTREE A\n") == "C:\n|_L\n");
+            check(10, runScript("MD A\nMD A\\B\nMD L\nMHL A\\B L\nDELTREE A\n") ==
+                "C:\n|_A\n|   |_B\n|\n|_L\n|   |_hlink[C:\\A\\B]\n");
+            check(11, runScript("MD A\nMD A\\B\nMF F.TXT\nMDL F.TXT A\\B\nMD C\nCOPY A C\nDELTREE C\nDEL F.TXT\nDELTREE A\n") ==
+                "C:\n");
+
+            Manager manager;
+            auto first = manager.createSession();
+            auto second = manager.createSession();
+            check(12, manager.execute(first, "MD A").ok() && manager.execute(first, "MD A\\B").ok() &&
+                manager.execute(first, "MD A\\B\\C").ok() && manager.execute(first, "CD A\\B").ok());
+            check(13, manager.execute(second, "DELTREE C:\\A").ok());
+
+            std::ostringstream out;
+            manager.output(out);
+            check(14, out.str() == "C:\n|_A\n|   |_B\n");
+
+            check(15, manager.execute(first, "CD C:").ok() && manager.execute(second, "DELTREE C:\\A").ok());
+            out.str("");
+            manager.output(out);
+            check(16, out.str() == "C:\n");
+        }
+
+        caseId = 220;
+        {
+            using namespace FileSystem;
+
+            const std::string script = "MD A\nMD A\\B\nMF A\\F.TXT\nMF A\\B\\G.TXT\nMD C\nMHL A\\B C\nMDL A\\F.TXT C\n"
+                "MD D:\\X\nMF D:\\X\\H.TXT\nMD E:\\Y\nRD E:\\Y\n";
+
+            std::istringstream in(script);
+            Manager manager;
+            manager.process(in);
+
+            std::ostringstream expected;
+            manager.output(expected);
+
+            const auto frozen = manager.freeze();
+            std::ostringstream out;
+            frozen.output(out);
+            check(1, out.str() == expected.str());
+            check(2, frozen.size() == 26 + 7 + 2);
+
+            const auto a = frozen.find("C:\\A");
+            const auto f = frozen.find("c:\\a\\f.txt");
+            check(3, a != FrozenTree::None && frozen.type(a) == ItemType::eDirectory && frozen.fullPath(a) == "C:\\A");
+            check(4, f != FrozenTree::None && frozen.type(f) == ItemType::eFile && frozen.name(f) == "f.txt" &&
+                frozen.parent(f) == a);
+            check(5, frozen.find("C:\\A\\X") == FrozenTree::None && frozen.find("C:\\A\\F.TXT\\X") == FrozenTree::None &&
+                frozen.find("Q:") != FrozenTree::None && frozen.find("") == FrozenTree::None);
+
+            // Children are in name order, links point to their items
+            const auto c = frozen.find("C:\\C");
+            const auto first = frozen.firstChild(c);
+            check(6, frozen.childCount(c) == 2 && frozen.type(first) == ItemType::eDynamicLink &&
+                frozen.type(first + 1) == ItemType::eHardLink);
+            check(7, frozen.linked(first) == f && frozen.linked(first + 1) == frozen.find("C:\\A\\B") &&
+                frozen.linked(a) == FrozenTree::None);
+            check(8, frozen.childCount(frozen.find("E:")) == 0 && frozen.childCount(f) == 0);
+
+            // Copy is the same tree, links included
+            Manager copy;
+            copy.unfreeze(frozen);
+            std::ostringstream diff;
+            check(9, copy.compare(manager, diff) && copy.hash() == manager.hash());
+
+            std::istringstream moreIn("MOVE C:\\A\\F.TXT C:\nCD C:\\A\\B\nMF I.TXT\n");
+            std::istringstream sameIn("MOVE C:\\A\\F.TXT C:\nCD C:\\A\\B\nMF I.TXT\n");
+            copy.process(moreIn);
+            manager.process(sameIn);
+            check(10, copy.compare(manager, diff));
+
+            // Empty and deep trees
+            const FrozenTree empty;
+            check(11, empty.size() == 0 && empty.find("C:") == FrozenTree::None && empty.unfreeze().empty());
+            check(12, errorOf([&]{ copy.unfreeze(empty); return std::string(); }) == "Frozen tree shall have all drives");
+
+            std::istringstream deepIn(deepTreeScript(10000));
+            Manager deep;
+            deep.process(deepIn);
+            std::ostringstream deepExpected;
+            deep.output(deepExpected);
+
+            const auto deepFrozen = deep.freeze();
+            out.str("");
+            deepFrozen.output(out);
+            check(13, out.str() == deepExpected.str() && deepFrozen.memoryUsage() < 16 * deepFrozen.size() + 1024);
+
+            Manager deepCopy;
+            deepCopy.unfreeze(deepFrozen);
+            check(14, deepCopy.compare(deep, diff));
+        }
+
+        caseId = 230;
+        {
+            using namespace FileSystem;
+
+            std::istringstream in("MD A\nMD A\\B\nMD A\\C\nMF A\\F1.TXT\nMF A\\F2.TXT\nMD A\\B\\D\nMF A\\B\\D\\G.TXT\nMD E\n");
+            Manager manager;
+            manager.process(in);
+
+            std::ostringstream expected;
+            manager.output(expected);
+
+            std::ostringstream out;
+            check(1, manager.tree(out, "C:").ok() && out.str() == expected.str());
+
+            out.str("");
+            check(2, manager.tree(out, "A", 1).ok() && out.str() == "C:\\A\n|_B\n|\n|_C\n|\n|_f1.txt\n|_f2.txt\n");
+
+            out.str("");
+            check(3, manager.tree(out, "C:\\A", 2, 2).ok() &&
+                out.str() == "C:\\A\n|_B\n|   |_D\n|\n|_C\n|\n|_... (2 more)\n");
+
+            out.str("");
+            check(4, manager.tree(out, "A\\B", Manager::NoLimit, 0).ok() && out.str() == "C:\\A\\B\n|_... (1 more)\n");
+
+            out.str("");
+            check(5, manager.tree(out, "A", 0).ok() && manager.tree(out, "A\\F1.TXT", 5).ok() &&
+                out.str() == "C:\\A\nC:\\A\\f1.txt\n");
+
+            out.str("");
+            check(6, manager.tree(out, "X").code == ErrorCode::eInvalidPath && manager.tree(out, "A\\").code ==
+                ErrorCode::eBadPathFormat && out.str().empty());
+
+            // Command prints to session output, nothing is printed without it
+            auto session = manager.createSession();
+            check(7, manager.execute(session, "TREE A 1 1").ok() && manager.execute(session, "TREE A\\B\\D").ok());
+
+            session.out = &out;
+            check(8, manager.execute(session, "TREE A 1 1").ok() && out.str() == "C:\\A\n|_B\n|\n|_... (3 more)\n");
+            check(9, manager.execute(session, "TREE A x").code == ErrorCode::eInvalidCommandFormat &&
+                manager.execute(session, "TREE A 1 1 1").code == ErrorCode::eIncorrectArgumentsNumber);
+
+            out.str("");
+            std::istringstream script("MD D:\\X\nMF D:\\X\\F{1..1000}.TXT\nCD D:\\X\nTREE . 1 3\nCD C:\\A\nTREE\n");
+            manager.setCommandOutput(&out);
+            manager.process(script);
+            check(10, out.str() == "D:\\X\n|_f1.txt\n|_f10.txt\n|_f100.txt\n|_... (997 more)\n"
+                "C:\\A\n|_B\n|   |_D\n|      |_g.txt\n|\n|_C\n|\n|_f1.txt\n|_f2.txt\n");
+        }
+
+        caseId = 240;
+        {
+            using namespace FileSystem;
+
+            check(1, mapHostName("ReadMe.Markdown", false) == "readme.mar" &&
+                mapHostName("a_very_long_name.txt", false) == "averylon.txt" &&
+                mapHostName("archive.tar.gz", false) == "archivet.gz");
+            check(2, mapHostName(".bashrc", false) == "bashrc" && mapHostName("___", true) == "noname" &&
+                mapHostName("my.dir.name", true) == "mydirnam" && mapHostName("x.", false) == "x");
+            check(3, numberedName("averylon.txt", 12, false) == "averyl12.txt" && numberedName("a", 3, true) == "a3" &&
+                numberedName("a.b", 3, true) == "a.b3" && numberedName("x", 12345678, true).empty());
+
+#ifdef __linux__
+            HostDirectory host;
+            host.dir("src");
+            host.dir("src/sub.d");
+            host.dir("Docs");
+            host.file("src/main.cpp");
+            host.file("src/Main.cpp");
+            host.file("src/sub.d/a_very_long_name.txt");
+            host.file("Docs/readme");
+            host.link("link", "src");
+
+            Manager manager;
+            std::istringstream in("MD IMP\nMD D:\\SRC\n");
+            manager.process(in);
+
+            const auto stats = manager.import(host.root(), "IMP");
+            check(4, stats.directories == 3 && stats.files == 4 && stats.renamed == 1 && stats.skipped == 1);
+
+            std::ostringstream out;
+            check(5, manager.tree(out, "C:\\IMP").ok() && out.str() ==
+                "C:\\IMP\n|_DOCS\n|   |_readme\n|\n|_SRC\n|   |_SUBD\n|   |   |_averylon.txt\n|   |\n|   |_main.cpp\n|   |_main1.cpp\n");
+
+            // Collisions with existing items too, failed import adds nothing
+            Manager::ImportOptions options;
+            options.collisions = Manager::CollisionPolicy::eSkip;
+            const auto skipped = manager.import(host.root(), "D:", options);
+            check(6, skipped.directories == 1 && skipped.files == 1 && skipped.skipped == 2);
+
+            const auto hash = manager.hash();
+            options.collisions = Manager::CollisionPolicy::eFail;
+            check(7, errorOf([&]{ manager.import(host.root(), "E:", options); return std::string(); }).find("Name collision") == 0 &&
+                manager.hash() == hash);
+            check(8, errorOf([&]{ manager.import(host.root() + "/none", "E:"); return std::string(); }).find("Unable to open") == 0 &&
+                errorOf([&]{ manager.import(host.root(), "C:\\NONE"); return std::string(); }) == "Invalid path: C:\\NONE");
+
+            // Parallel crawl builds the same tree
+            for(size_t i = 0; i < 20; ++i)
+            {
+                const auto dir = "d" + std::to_string(i);
+                host.dir(dir);
+                for(size_t j = 0; j < 5; ++j)
+                {
+                    host.dir(dir + "/s" + std::to_string(j));
+                    for(size_t k = 0; k < 10; ++k) host.file(dir + "/s" + std::to_string(j) + "/file_" + std::to_string(k) + ".txt");
+                }
+            }
+
+            Manager managers[2];
+            for(size_t i = 0; i < 2; ++i)
+            {
+                options.collisions = Manager::CollisionPolicy::eRename;
+                options.threads = i ? 4 : 1;
+                managers[i].import(host.root(), "C:", options);
+            }
+
+            std::ostringstream diff;
+            check(9, managers[0].compare(managers[1], diff) && managers[0].import(host.root(), "D:").files == 1004);
+#endif
+        }
+
+#ifdef __linux__
+        caseId = 250;
+        {
+            using namespace FileSystem;
+
+            std::istringstream in("MD A\nMD A\\B\nMF A\\B\\F.TXT\nMF G.TXT\nMD L\nMHL A\\B\\F.TXT L\nMHL A L\nMDL G.TXT L\n"
+                "MD D:\\X\nMDL D:\\X L\n");
+            Manager manager;
+            manager.process(in);
+
+            HostDirectory host;
+            for(const bool ioUring : { true, false })
+            {
+                const auto dir = host.root() + (ioUring ? "/ring" : "/pool");
+
+                Manager::ExportOptions options;
+                options.ioUring = ioUring;
+                options.threads = 4;
+
+                const auto stats = manager.exportTree("C:", dir, options);
+                check(1, stats.directories == 3 && stats.files == 2 && stats.links == 3 && stats.skipped == 1 &&
+                    (ioUring || !stats.ioUring));
+
+                struct stat file;
+                struct stat link;
+                check(2, stat((dir + "/A/B/f.txt").c_str(), &file) == 0 && S_ISREG(file.st_mode) && file.st_nlink == 2);
+                check(3, lstat((dir + "/L/hlink[C:\\A\\B\\f.txt]").c_str(), &link) == 0 && link.st_ino == file.st_ino);
+
+                char target[256] = {};
+                check(4, readlink((dir + "/L/dlink[C:\\g.txt]").c_str(), target, sizeof(target) - 1) > 0 &&
+                    std::string(target) == "../g.txt" && stat((dir + "/L/dlink[C:\\g.txt]").c_str(), &file) == 0);
+                check(5, lstat((dir + "/L/hlink[C:\\A]").c_str(), &link) == 0 && S_ISLNK(link.st_mode));
+
+                // Existing items are not overwritten, subtree of the exported path only
+                check(6, errorOf([&]{ manager.exportTree("C:", dir, options); return std::string(); }) ==
+                    "Unable to create " + dir + "/A: File exists");
+                check(7, manager.exportTree("C:\\A\\B", dir + "/b", options).files == 1 &&
+                    stat((dir + "/b/f.txt").c_str(), &file) == 0);
+            }
+
+            // Round trip through host directory
+            const auto dir = host.root() + "/ring";
+            Manager imported;
+            imported.import(dir + "/A", "C:");
+            std::ostringstream out;
+            check(8, imported.tree(out, "C:\\B").ok() && out.str() == "C:\\B\n|_f.txt\n");
+
+            // Symbolic links resolve when host dir is relative to current directory
+            char cwd[4096] = {};
+            if(getcwd(cwd, sizeof(cwd)) && chdir(host.root().c_str()) == 0)
+            {
+                manager.exportTree("C:", "relative", Manager::ExportOptions());
+
+                struct stat linked;
+                check(9, stat("relative/L/dlink[C:\\g.txt]", &linked) == 0 && S_ISREG(linked.st_mode) &&
+                    stat("relative/L/hlink[C:\\A]", &linked) == 0 && S_ISDIR(linked.st_mode));
+
+                check(10, chdir(cwd) == 0);
+            }
+            else check(9, false);
+        }
+#endif
+
         if(failedCount == 0) std::cout << "All tests passed OK" << std::endl;
         else std::cout << failedCount << " test(s) failed" << std::endl;
 
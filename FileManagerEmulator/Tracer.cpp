@@ -0,0 +1,185 @@
+#include "Tracer.h"
+
+#ifdef TRACE_ENABLED
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+namespace Tracer
+{
+    namespace
+    {
+        typedef std::chrono::steady_clock Clock;
+
+        const size_t ChunkSize = 4096;
+
+        struct Event
+        {
+            const char* name;
+            char detail[16];
+            std::uint64_t begin;    // Nanoseconds since start
+            std::uint64_t end;
+        };
+
+        // Written by its thread only, count is published for the writer at exit
+        struct Chunk
+        {
+            Chunk(): count(0), next(nullptr) {}
+
+            Event events[ChunkSize];
+            std::atomic<size_t> count;
+            std::atomic<Chunk*> next;
+        };
+
+        // Buffers outlive their threads, so spans of finished threads are written too.
+        // They are never freed, threads may still be running at exit.
+        struct Buffer
+        {
+            explicit Buffer(unsigned tid): tid(tid), first(new Chunk), last(first), next(nullptr) {}
+
+            unsigned tid;
+            Chunk* first;
+            Chunk* last;
+            Buffer* next;
+        };
+
+        const Clock::time_point start = Clock::now();
+
+        std::atomic<Buffer*> buffers(nullptr);
+        std::atomic<unsigned> threadCount(0);
+
+        thread_local Buffer* threadBuffer = nullptr;
+
+        std::uint64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        }
+
+        void writeAtExit()
+        {
+            const auto fileName = std::getenv("FME_TRACE");
+            write(fileName && *fileName ? fileName : "trace.json");
+        }
+
+        Buffer& registerThread()
+        {
+            static std::once_flag writerRegistered;
+            std::call_once(writerRegistered, []{ std::atexit(&writeAtExit); });
+
+            const auto buffer = new Buffer(threadCount.fetch_add(1) + 1);
+
+            // Lock-free push, buffers are only added
+            buffer->next = buffers.load(std::memory_order_relaxed);
+            while(!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release,
+                std::memory_order_relaxed))
+            {
+            }
+
+            threadBuffer = buffer;
+            return *buffer;
+        }
+
+        void record(const char* name, const char* detail, std::uint64_t begin, std::uint64_t end)
+        {
+            auto& buffer = threadBuffer ? *threadBuffer : registerThread();
+
+            auto chunk = buffer.last;
+            auto count = chunk->count.load(std::memory_order_relaxed);
+            if(count == ChunkSize)
+            {
+                const auto next = new Chunk;
+                chunk->next.store(next, std::memory_order_release);
+                buffer.last = chunk = next;
+                count = 0;
+            }
+
+            auto& event = chunk->events[count];
+            event.name = name;
+            std::memcpy(event.detail, detail, sizeof(event.detail));
+            event.begin = begin;
+            event.end = end;
+
+            chunk->count.store(count + 1, std::memory_order_release);
+        }
+
+        // Details come from commands, so quotes and control characters are dropped
+        void writeString(std::FILE* out, const char* str, size_t size)
+        {
+            std::fputc('"', out);
+            for(size_t i = 0; i < size && str[i]; ++i)
+            {
+                const auto c = static_cast<unsigned char>(str[i]);
+                if(c >= 0x20 && c != '"' && c != '\\') std::fputc(c, out);
+            }
+            std::fputc('"', out);
+        }
+    }
+
+    Span::Span(const char* name): name_(name), begin_(now())
+    {
+        detail_[0] = '\0';
+    }
+
+    Span::Span(const char* name, const char* detail): name_(name)
+    {
+        std::strncpy(detail_, detail, MaxDetailSize - 1);
+        detail_[MaxDetailSize - 1] = '\0';
+        begin_ = now();
+    }
+
+    Span::Span(const char* name, const std::string& detail): Span(name, detail.c_str())
+    {
+    }
+
+    Span::~Span()
+    {
+        record(name_, detail_, begin_, now());
+    }
+
+    bool write(const std::string& fileName)
+    {
+        const auto out = std::fopen(fileName.c_str(), "w");
+        if(!out) return false;
+
+        std::fprintf(out, "{\"traceEvents\":[\n");
+
+        bool first = true;
+        for(auto buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+        {
+            std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"Thread %u\"}}", first ? "" : ",\n", buffer->tid, buffer->tid);
+            first = false;
+
+            for(auto chunk = buffer->first; chunk; chunk = chunk->next.load(std::memory_order_acquire))
+            {
+                const auto count = chunk->count.load(std::memory_order_acquire);
+                for(size_t i = 0; i < count; ++i)
+                {
+                    const auto& event = chunk->events[i];
+
+                    // Complete events, microseconds
+                    std::fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                        event.name, buffer->tid, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+
+                    if(event.detail[0])
+                    {
+                        std::fprintf(out, ",\"args\":{\"command\":");
+                        writeString(out, event.detail, sizeof(event.detail));
+                        std::fputc('}', out);
+                    }
+
+                    std::fputc('}', out);
+                }
+            }
+        }
+
+        std::fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        return std::fclose(out) == 0;
+    }
+}
+
+#endif // TRACE_ENABLED
@@ -0,0 +1,56 @@
+#pragma once
+
+// Opt-in timeline tracing, build with -DTRACE_EVENTS to enable. Spans of command phases (parse,
+// resolve, execute, render) are recorded into per-thread buffers without locks and written at
+// exit as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) to the file named by FME_TRACE
+// environment variable, "trace.json" by default. Span costs two clock reads.
+
+#if defined(TRACE_EVENTS)
+
+#define TRACE_ENABLED
+
+#include <cstdint>
+#include <string>
+
+namespace Tracer
+{
+    class Span
+    {
+    public:
+        // Name shall be a literal, detail (e.g. command name) is copied, long one is truncated
+        explicit Span(const char* name);
+        Span(const char* name, const char* detail);
+        Span(const char* name, const std::string& detail);
+        ~Span();
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        static const size_t MaxDetailSize = 16;
+
+        const char* name_;
+        char detail_[MaxDetailSize];
+        std::uint64_t begin_;
+    };
+
+    // Writes spans recorded so far, returns false if file can't be written
+    bool write(const std::string& fileName);
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#define TRACE_SPAN(name) \
+    Tracer::Span TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#define TRACE_SPAN_DETAIL(name, detail) \
+    Tracer::Span TRACE_CONCAT(traceSpan, __LINE__)(name, detail)
+
+#else // Tracing disabled
+
+// Arguments are not evaluated, but count as used
+#define TRACE_SPAN(name) static_cast<void>(sizeof(name))
+#define TRACE_SPAN_DETAIL(name, detail) static_cast<void>(sizeof(name) + sizeof(detail))
+
+#endif // TRACE_EVENTS
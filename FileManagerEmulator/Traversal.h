@@ -0,0 +1,117 @@
+#pragma once
+
+#include "LeakDetect.h"
+
+#include <vector>
+
+#include "FileSystem.h"
+
+namespace FileSystem
+{
+    enum class TraverseOrder
+    {
+        ePreOrder,
+        ePostOrder
+    };
+
+    struct TraverseInfo
+    {
+        size_t level;   // 1 for children of traversal root
+        size_t index;   // Index among siblings in traversal order
+        size_t size;    // Number of siblings
+    };
+
+    namespace Details
+    {
+        template <class ItemPointer>
+        struct TraverseFrame
+        {
+            ItemSpan<ItemPointer> children;
+            ItemOrder order;    // Empty if not sorted
+            size_t next;
+
+            ItemPointer& at(size_t index) const
+            {
+                return order.empty() ? children[index] : children[order[index]];
+            }
+        };
+
+        template <class ItemPointer, class CompositeType>
+        void collectChildren(CompositeType& composite, TraverseFrame<ItemPointer>& frame, bool sorted)
+        {
+            frame.next = 0;
+            frame.children = composite.children();
+
+            if(sorted) sortByName(frame.children, frame.order);
+            else frame.order.clear();
+        }
+
+        // Explicit stack traversal: no recursion, memory is bounded by
+        // tree depth plus number of siblings along current path.
+        // Frames are reused between levels to avoid repeated allocations.
+        template <class ItemPointer, class CompositeType, class Visitor>
+        bool traverse(CompositeType& root, const Visitor& visitor, TraverseOrder order, bool sorted)
+        {
+            const bool preOrder = order == TraverseOrder::ePreOrder;
+
+            std::vector<TraverseFrame<ItemPointer>> stack(1);
+            collectChildren(root, stack.front(), sorted);
+
+            size_t depth = 1;
+            while(depth > 0)
+            {
+                auto& frame = stack[depth - 1];
+                const size_t size = frame.children.size();
+
+                if(frame.next == size)
+                {
+                    if(--depth == 0) break;
+                    if(preOrder) continue;
+
+                    // All children visited, now it's parent's turn
+                    auto& parentFrame = stack[depth - 1];
+                    const size_t index = parentFrame.next - 1;
+                    const TraverseInfo info = { depth, index, parentFrame.children.size() };
+                    if(!visitor(parentFrame.at(index), info)) return false;
+                    continue;
+                }
+
+                const size_t index = frame.next++;
+                auto& item = frame.at(index);
+                const TraverseInfo info = { depth, index, size };
+
+                // Pre-order visitor may replace item, so check it afterwards
+                if(preOrder && !visitor(item, info)) return false;
+
+                if(item->asComposite())
+                {
+                    if(stack.size() == depth) stack.emplace_back();
+                    collectChildren(*item->asComposite(), stack[depth++], sorted);
+                }
+                else if(!preOrder && !visitor(item, info))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    // Traverses all descendants of root (root itself is not visited).
+    // Visitor: bool (ItemPtr& item, const TraverseInfo& info)
+    // Returning false from visitor stops traversal, traverse() returns false then.
+    // Pre-order visitor may replace visited item, new item children are traversed.
+    template <class Visitor>
+    bool traverse(Composite& root, const Visitor& visitor, TraverseOrder order, bool sorted)
+    {
+        return Details::traverse<ItemPtr>(root, visitor, order, sorted);
+    }
+
+    // Visitor: bool (const ItemPtr& item, const TraverseInfo& info)
+    template <class Visitor>
+    bool traverse(const Composite& root, const Visitor& visitor, TraverseOrder order, bool sorted)
+    {
+        return Details::traverse<const ItemPtr>(root, visitor, order, sorted);
+    }
+}
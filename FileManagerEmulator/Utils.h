@@ -6,6 +6,7 @@
 #include <string>
 #include <cctype>
 #include <regex>
+#include <vector>
 
 namespace Utils
 {
@@ -13,6 +14,13 @@ namespace Utils
     static const char DirectoryDelimiter = '\\';
     static const char ExtensionDelimiter = '.';
 
+    static const size_t DriveCount = 'Z' - 'A' + 1;
+
+    inline char toLower(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
     inline void toLowerCase(std::string& str)
     {
         std::transform(begin(str), end(str), begin(str), &tolower);
@@ -38,22 +46,76 @@ namespace Utils
         return std::regex(exp, std::regex::icase | std::regex::optimize);
     }
 
+    // Same as regex "[a-z]:" (case insensitive)
+    inline bool validDriveName(const char* drive, size_t size)
+    {
+        if(size != 2 || drive[1] != DriveDelimiter) return false;
+        return (drive[0] >= 'a' && drive[0] <= 'z') || (drive[0] >= 'A' && drive[0] <= 'Z');
+    }
+
     inline bool validDriveName(const std::string& drive)
     {
-        static const auto rule = make_regex("[a-z]:");
-        return std::regex_match(drive, rule);
+        return validDriveName(drive.data(), drive.size());
+    }
+
+    // Index of drive letter, 0 for A
+    inline size_t driveIndex(char letter)
+    {
+        return toupper(static_cast<unsigned char>(letter)) - 'A';
+    }
+
+    // Index of valid drive name, 0 for A:
+    inline size_t driveIndex(const std::string& drive)
+    {
+        return driveIndex(drive.front());
+    }
+
+    // "." path segment
+    inline bool isCurrentDirectory(const char* name, size_t size)
+    {
+        return size == 1 && name[0] == '.';
+    }
+
+    // ".." path segment
+    inline bool isParentDirectory(const char* name, size_t size)
+    {
+        return size == 2 && name[0] == '.' && name[1] == '.';
+    }
+
+    inline bool isNameChar(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+    }
+
+    // Same as regex "[a-z0-9]{1,8}" (case insensitive), names are checked on hot paths
+    inline bool validDirectoryName(const char* dir, size_t size)
+    {
+        if(size < 1 || size > 8) return false;
+        return std::all_of(dir, dir + size, &isNameChar);
     }
 
     inline bool validDirectoryName(const std::string& dir)
     {
-        static const auto rule = make_regex("[a-z0-9]{1,8}");
-        return std::regex_match(dir, rule);
+        return validDirectoryName(dir.data(), dir.size());
+    }
+
+    // Same as regex "[a-z0-9]{1,8}\.{0,1}[a-z0-9]{0,3}" (case insensitive)
+    inline bool validFileName(const char* file, size_t size)
+    {
+        const auto end = file + size;
+        const auto dot = std::find_if_not(file, end, &isNameChar);
+        const size_t nameSize = dot - file;
+
+        // No dot, extension directly follows the name
+        if(dot == end) return nameSize >= 1 && nameSize <= 8 + 3;
+
+        if(nameSize < 1 || nameSize > 8 || *dot != ExtensionDelimiter) return false;
+        return end - dot - 1 <= 3 && std::all_of(dot + 1, end, &isNameChar);
     }
 
     inline bool validFileName(const std::string& file)
     {
-        static const auto rule = make_regex("[a-z0-9]{1,8}\\.{0,1}[a-z0-9]{0,3}");
-        return std::regex_match(file, rule);
+        return validFileName(file.data(), file.size());
     }
 
     inline bool validCommandName(const std::string& cmd)
@@ -75,6 +137,101 @@ namespace Utils
 
     typedef std::vector<std::string> Substrings;
 
+    inline void splitString(const std::string& str, char delimiter, Substrings& splitted)
+    {
+        splitted.clear();
+
+        size_t begin = 0;
+        size_t end = 0;
+        while((end = str.find(delimiter, begin)) != std::string::npos)
+        {
+            splitted.push_back(str.substr(begin, end - begin));
+            begin = end + 1;
+        }
+
+        splitted.push_back(str.substr(begin));
+    }
+
+    inline bool hasRanges(const std::string& str)
+    {
+        return str.find('{') != std::string::npos;
+    }
+
+    // Expands numeric ranges "{first..last}", e.g. "F{1..3}.TXT" -> "F1.TXT", "F2.TXT", "F3.TXT".
+    // Several ranges produce all combinations, the rightmost range changes fastest.
+    inline bool expandRanges(const std::string& str, Substrings& expanded, size_t maxCount)
+    {
+        struct Range
+        {
+            size_t begin;   // Position of '{'
+            size_t end;     // Position after '}'
+            unsigned long first;
+            unsigned long last;
+        };
+
+        std::vector<Range> ranges;
+        size_t count = 1;
+
+        size_t pos = 0;
+        while((pos = str.find('{', pos)) != std::string::npos)
+        {
+            const auto close = str.find('}', pos);
+            if(close == std::string::npos) return false;
+
+            const auto body = str.substr(pos + 1, close - pos - 1);
+            const auto dots = body.find("..");
+
+            const auto numeric = [](const std::string& s)
+            {
+                return !s.empty() && s.size() <= 9 &&
+                    std::all_of(s.cbegin(), s.cend(), [](char c){ return c >= '0' && c <= '9'; });
+            };
+
+            if(dots == std::string::npos) return false;
+            const auto first = body.substr(0, dots);
+            const auto last = body.substr(dots + 2);
+            if(!numeric(first) || !numeric(last)) return false;
+
+            const Range range = { pos, close + 1, std::stoul(first), std::stoul(last) };
+            if(range.first > range.last) return false;
+
+            count *= range.last - range.first + 1;
+            if(count > maxCount) return false;
+
+            ranges.push_back(range);
+            pos = close + 1;
+        }
+
+        expanded.clear();
+        expanded.reserve(count);
+
+        // Odometer over all ranges
+        std::vector<unsigned long> current;
+        for(const auto& r : ranges) current.push_back(r.first);
+
+        for(size_t n = 0; n < count; ++n)
+        {
+            std::string item;
+            size_t prev = 0;
+            for(size_t i = 0; i < ranges.size(); ++i)
+            {
+                item.append(str, prev, ranges[i].begin - prev);
+                item += std::to_string(current[i]);
+                prev = ranges[i].end;
+            }
+            item.append(str, prev, std::string::npos);
+            expanded.push_back(std::move(item));
+
+            for(size_t i = ranges.size(); i-- > 0; )
+            {
+                if(current[i]++ < ranges[i].last) break;
+                current[i] = ranges[i].first;
+            }
+        }
+
+        return true;
+    }
+
     inline bool parseCommand(const std::string& command, Substrings& splittedCmd)
     {
         static const auto separator = make_regex(" ");
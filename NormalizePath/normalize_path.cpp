@@ -1,12 +1,533 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
+#include <fstream>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NORMALIZE_MMAP
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define NORMALIZE_X86
+#endif
+
+/// Segment scanners: delimiter and dot bitmasks are built for 64 bytes at a time
+/// (bit i of a mask word is set if byte i matches), segments are classified from
+/// the masks.
+enum class scanner
+{
+    scalar,
+    sse2,
+    avx2
+};
+
+/// Normalization rules, normalize() is specialized for each policy at compile time.
+struct default_policy
+{
+    static constexpr char delimiter = '/';
+    static constexpr char rel_point = '.';
+
+    /// Path not starting with delimiter, "." or ".." has domain-like first subfolder,
+    /// which is the root for "..".
+    static constexpr bool domain_root = true;
+
+    /// Trailing delimiter is kept as in input.
+    static constexpr bool keep_trailing = true;
+};
+
+/// Backslash delimited paths, "C:\bar\..\foo" -> "C:\foo".
+struct backslash_policy: default_policy
+{
+    static constexpr char delimiter = '\\';
+};
+
+/// Strict POSIX paths, no domain detection: "bar/../foo" -> "/foo".
+struct posix_policy: default_policy
+{
+    static constexpr bool domain_root = false;
+};
+
+namespace detail
+{
+    constexpr size_t block_size = 64;                       // Bytes per mask word.
+    constexpr size_t chunk_blocks = 16;                     // Mask words built per pass.
+    constexpr size_t chunk_size = block_size * chunk_blocks;
+
+    /// Builds masks for size bytes (no more than chunk_size) of data.
+    /// The last incomplete word is zero padded.
+    using mask_builder = void (*)(const char* data, size_t size, uint64_t* delimiters, uint64_t* dots);
+
+    /// Bit per byte of word, set if byte equals to c. Bytes are compared 8 at a time
+    /// within a general purpose register.
+    inline uint64_t match_bytes(uint64_t word, char c)
+    {
+        constexpr uint64_t low_bits = 0x7f7f7f7f7f7f7f7full;
+        constexpr uint64_t high_bits = 0x8080808080808080ull;
+        constexpr uint64_t gather = 0x0102040810204080ull;
+
+        // High bit of each byte is set for zero bytes of y, no false matches.
+        const uint64_t y = word ^ (uint64_t(uint8_t(c)) * 0x0101010101010101ull);
+        const uint64_t zeros = ~(((y & low_bits) + low_bits) | y) & high_bits;
+
+        // High bits gathered into the top byte, the first byte goes to the lowest bit.
+        return ((zeros >> 7) * gather) >> 56;
+    }
+
+    template <class Policy>
+    inline void scalar_block(const char* data, uint64_t& delimiters, uint64_t& dots)
+    {
+        delimiters = 0;
+        dots = 0;
+
+        for (size_t i = 0; i < block_size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+
+            // Bytes shall go from the lowest, swap them on big endian targets.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+            delimiters |= match_bytes(word, Policy::delimiter) << i;
+            dots |= match_bytes(word, Policy::rel_point) << i;
+        }
+    }
+
+    /// Builds masks block by block, the tail goes through zero padded copy,
+    /// so nothing is read past the end.
+    template <void (*build_block)(const char*, uint64_t&, uint64_t&)>
+    inline void build_blocks(const char* data, size_t size, uint64_t* delimiters, uint64_t* dots)
+    {
+        size_t block = 0;
+        for (; (block + 1) * block_size <= size; ++block)
+        {
+            build_block(data + block * block_size, delimiters[block], dots[block]);
+        }
+
+        if (const size_t rest = size - block * block_size)
+        {
+            char tail[block_size] = {};
+            std::memcpy(tail, data + block * block_size, rest);
+            build_block(tail, delimiters[block], dots[block]);
+        }
+    }
+
+    template <class Policy>
+    void build_masks_scalar(const char* data, size_t size, uint64_t* delimiters, uint64_t* dots)
+    {
+        build_blocks<scalar_block<Policy>>(data, size, delimiters, dots);
+    }
+
+#ifdef NORMALIZE_X86
+
+#ifdef __SSE2__
+    template <class Policy>
+    inline void sse2_block(const char* data, uint64_t& delimiters, uint64_t& dots)
+    {
+        const __m128i d = _mm_set1_epi8(Policy::delimiter);
+        const __m128i t = _mm_set1_epi8(Policy::rel_point);
+
+        delimiters = 0;
+        dots = 0;
+
+        for (size_t i = 0; i < block_size; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            delimiters |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, d)))) << i;
+            dots |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, t)))) << i;
+        }
+    }
+
+    template <class Policy>
+    void build_masks_sse2(const char* data, size_t size, uint64_t* delimiters, uint64_t* dots)
+    {
+        build_blocks<sse2_block<Policy>>(data, size, delimiters, dots);
+    }
+#endif // __SSE2__
+
+    template <class Policy>
+    __attribute__((target("avx2")))
+    inline void avx2_block(const char* data, uint64_t& delimiters, uint64_t& dots)
+    {
+        const __m256i d = _mm256_set1_epi8(Policy::delimiter);
+        const __m256i t = _mm256_set1_epi8(Policy::rel_point);
+
+        const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+
+        delimiters = uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, d)))) |
+            uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, d)))) << 32;
+        dots = uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, t)))) |
+            uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, t)))) << 32;
+    }
+
+    template <class Policy>
+    __attribute__((target("avx2")))
+    void build_masks_avx2(const char* data, size_t size, uint64_t* delimiters, uint64_t* dots)
+    {
+        // Same as build_blocks(), the loop itself shall be compiled for AVX2 to inline blocks.
+        size_t block = 0;
+        for (; (block + 1) * block_size <= size; ++block)
+        {
+            avx2_block<Policy>(data + block * block_size, delimiters[block], dots[block]);
+        }
+
+        if (const size_t rest = size - block * block_size)
+        {
+            char tail[block_size] = {};
+            std::memcpy(tail, data + block * block_size, rest);
+            avx2_block<Policy>(tail, delimiters[block], dots[block]);
+        }
+    }
+
+#endif // NORMALIZE_X86
+
+    template <class Policy>
+    mask_builder find_mask_builder(scanner s)
+    {
+        switch (s)
+        {
+        case scanner::scalar:
+            return &build_masks_scalar<Policy>;
+#ifdef NORMALIZE_X86
+#ifdef __SSE2__
+        case scanner::sse2:
+            return &build_masks_sse2<Policy>;
+#endif
+        case scanner::avx2:
+            return __builtin_cpu_supports("avx2") ? &build_masks_avx2<Policy> : nullptr;
+#endif
+        default:
+            return nullptr;
+        }
+    }
+
+    /// True if the first subfolder of first_size bytes is domain-like root.
+    template <class Policy>
+    constexpr bool is_domain(const char* path, size_t first_size)
+    {
+        return first_size > 2 ||
+            (first_size == 1 && path[0] != Policy::rel_point) ||
+            (first_size == 2 && (path[0] != Policy::rel_point || path[1] != Policy::rel_point));
+    }
+
+    /// Same as normalize(), byte by byte for constant evaluation. ".." looks for
+    /// the previous subfolder in output rather than keeping a stack. Output may be
+    /// path itself.
+    template <class Policy>
+    constexpr size_t normalize_constant(const char* path, size_t size, char* out)
+    {
+        constexpr char delimiter = Policy::delimiter;
+        constexpr char rel_point = Policy::rel_point;
+
+        size_t first_size = 0;
+        while (first_size < size && path[first_size] != delimiter) ++first_size;
+
+        size_t root_idx = 0;
+        if constexpr (Policy::domain_root) root_idx = is_domain<Policy>(path, first_size);
+
+        size_t out_size = 0;
+        size_t count = 0;
+        size_t begin = 0;       // Subfolder with its leading delimiter.
+        size_t name = 0;        // Subfolder without it.
+
+        for (size_t pos = 0; pos <= size; ++pos)
+        {
+            if (pos < size && path[pos] != delimiter) continue;
+
+            const size_t length = pos - name;
+            const bool dot = length >= 1 && path[name] == rel_point;
+            const bool skip = length == 0 || (length == 1 && dot);
+            const bool up = length == 2 && dot && path[name + 1] == rel_point;
+
+            if (up)
+            {
+                if (count > root_idx)
+                {
+                    // Kept subfolders start with delimiter, except the one at output beginning.
+                    while (out_size > 0 && out[--out_size] != delimiter) {}
+                    --count;
+                }
+            }
+            else if (!skip)
+            {
+                for (size_t i = begin; i < pos; ++i) out[out_size++] = path[i];
+                ++count;
+            }
+
+            begin = pos;
+            name = pos + 1;
+        }
+
+        if (Policy::keep_trailing && size > 0 && path[size - 1] == delimiter) out[out_size++] = delimiter;
+
+        return out_size;
+    }
+
+    /// Piece of a path normalized on its own, see parallel_normalizer. Piece starts
+    /// from delimiter or path beginning and is followed by delimiter or path end.
+    struct chunk_summary
+    {
+        size_t root_idx = 0;        // Subfolders ".." can't remove, for the first piece.
+        std::vector<size_t> stack;  // Output starts of surviving subfolders from index 2.
+
+        size_t pops = 0;            // Unmatched "..", they remove preceding subfolders.
+        size_t count = 0;           // Surviving subfolders.
+        size_t size = 0;            // Output size.
+
+        /// Output size of the first keep surviving subfolders.
+        size_t kept_size(size_t keep) const
+        {
+            return keep < count ? stack[keep + 2] : size;
+        }
+    };
+
+    constexpr size_t copy_size = 32;    // Subfolders are copied by fixed size blocks.
+    constexpr size_t path_max = 4096;   // Longer paths keep subfolders off stack.
+
+    /// Normalizes size bytes of path into out, which has room for size bytes and may be
+    /// path itself if in_place. Returns output size. Piece of a path is normalized if
+    /// chunk: root comes from summary, trailing delimiter is left to caller, subfolders
+    /// and unmatched ".." go to summary.
+    template <class Policy, bool in_place, bool chunk = false>
+    size_t normalize(const char* const cpath, const size_t size, char* const out, mask_builder build_masks,
+        chunk_summary* const summary = nullptr)
+    {
+        constexpr char delimiter = Policy::delimiter;
+
+        // Subfolders are copied to output as they come, ".." goes back to output size
+        // before the previous one. Output never passes path position, so fixed size
+        // blocks stay within output, but could overwrite path ahead if in place.
+        size_t out_size = 0;
+
+        // Output is the same as path until the first removed subfolder. Nothing is
+        // copied till then, so normalized path isn't copied at all in place.
+        bool diverged = false;
+
+        const bool trailing = !chunk && Policy::keep_trailing && size > 0 && cpath[size - 1] == delimiter;
+
+        // Output sizes before kept subfolders, the last one is kept in top. Number of
+        // subfolders is no more than path length / 2 + 1, one more slot is written
+        // ahead and two are read behind. Long paths go to per thread buffer that
+        // only grows, so there are no allocations in steady state.
+        size_t local_stack[chunk ? 1 : path_max / 2 + 4];
+        size_t* stack = local_stack;
+        if (chunk)
+        {
+            if (summary->stack.size() < size / 2 + 4) summary->stack.resize(size / 2 + 4);
+            stack = summary->stack.data();
+        }
+        else if (size > path_max)
+        {
+            thread_local std::vector<size_t> long_stack;
+            if (long_stack.size() < size / 2 + 4) long_stack.resize(size / 2 + 4);
+            stack = long_stack.data();
+        }
+
+        size_t* const starts = stack + 2;
+        starts[-2] = starts[-1] = 0;
+        size_t count = 0;
+        size_t top = 0;
+
+        // Subfolder starts from string beginning but doesn't start with "/".
+        // Hmmm, guess it's domain name and new root. Don't harass it by upcoming "..".
+        size_t root_idx = 0;
+        size_t pops = 0;
+        if constexpr (chunk)
+        {
+            root_idx = summary->root_idx;
+        }
+        else if constexpr (Policy::domain_root)
+        {
+            const auto first = size > 0 ? static_cast<const char*>(std::memchr(cpath, delimiter, size)) : nullptr;
+            root_idx = is_domain<Policy>(cpath, first ? first - cpath : size);
+        }
+
+        uint64_t delimiters[chunk_blocks];
+        uint64_t dots[chunk_blocks];
+
+        // Masks of the previous word. String is preceded by virtual delimiter,
+        // so the first subfolder is classified the same way as others.
+        uint64_t prev_d = uint64_t(1) << 63;
+        uint64_t prev_t = 0;
+
+        // Subfolder starts from its leading delimiter, the first one from string beginning.
+        size_t begin = 0;
+
+        // Virtual delimiter at the string end closes the last subfolder, so
+        // loop goes one chunk further if size is multiple of chunk size.
+        for (size_t offset = 0; offset <= size; offset += chunk_size)
+        {
+            const size_t len = std::min(chunk_size, size - offset);
+            const bool last_chunk = len < chunk_size;
+            const size_t words = last_chunk ? len / block_size + 1 : chunk_blocks;
+
+            build_masks(cpath + offset, len, delimiters, dots);
+
+            if (last_chunk)
+            {
+                if (len % block_size == 0)
+                {
+                    delimiters[words - 1] = 0;
+                    dots[words - 1] = 0;
+                }
+
+                delimiters[words - 1] |= uint64_t(1) << (len % block_size);
+            }
+
+            for (size_t w = 0; w < words; ++w)
+            {
+                const uint64_t d = delimiters[w];
+                const uint64_t t = dots[w];
+
+                // Bit i of dN/tN tells whether byte N positions before byte i
+                // is delimiter/dot.
+                const uint64_t d1 = (d << 1) | (prev_d >> 63);
+                const uint64_t d2 = (d << 2) | (prev_d >> 62);
+                const uint64_t d3 = (d << 3) | (prev_d >> 61);
+                const uint64_t t1 = (t << 1) | (prev_t >> 63);
+                const uint64_t t2 = (t << 2) | (prev_t >> 62);
+
+                prev_d = d;
+                prev_t = t;
+
+                // Subfolders ending at delimiters: "", ".", "/." are skipped,
+                // ".." and "/.." remove the previous one till reaching the root.
+                const uint64_t skip = d1 | (t1 & d2);
+                const uint64_t up = t1 & t2 & d3;
+
+                const size_t base = offset + w * block_size;
+
+                // No branches on subfolder kind, it's hardly predictable.
+                for (uint64_t bits = d; bits; bits &= bits - 1)
+                {
+                    const size_t bit = __builtin_ctzll(bits);
+                    const size_t pos = base + bit;
+                    const size_t length = pos - begin;
+
+                    const size_t is_up = (up >> bit) & 1;
+                    const size_t is_norm = ((skip | up) >> bit & 1) ^ 1;
+
+                    // Written for any kind, kept for norm subfolder only.
+                    if (out_size != begin)
+                    {
+                        if (!in_place && !diverged) std::memcpy(out, cpath, out_size);
+                        diverged = true;
+
+                        if (in_place)
+                        {
+                            std::memmove(out + out_size, cpath + begin, length);
+                        }
+                        else if (begin + copy_size <= size)
+                        {
+                            std::memcpy(out + out_size, cpath + begin, copy_size);
+                            if (length > copy_size)
+                            {
+                                std::memcpy(out + out_size + copy_size, cpath + begin + copy_size, length - copy_size);
+                            }
+                        }
+                        else
+                        {
+                            std::memcpy(out + out_size, cpath + begin, length);
+                        }
+                    }
+
+                    // Masks rather than conditions, compilers tend to branch on them.
+                    // Output size doesn't wait for the stack memory, top is at hand.
+                    const size_t pop = is_up & (count > root_idx);
+                    const size_t norm_mask = 0 - is_norm;
+                    const size_t pop_mask = 0 - pop;
+
+                    starts[count] = out_size;
+                    const size_t below = starts[count - 2];
+
+                    const size_t grown = out_size + (length & norm_mask);
+                    const size_t pushed = top ^ ((top ^ out_size) & norm_mask);
+
+                    out_size = grown ^ ((grown ^ top) & pop_mask);
+                    top = pushed ^ ((pushed ^ below) & pop_mask);
+                    count = count + is_norm - pop;
+                    if constexpr (chunk) pops += is_up - pop;
+
+                    begin = pos;
+                }
+            }
+        }
+
+        if (!in_place && !diverged && out_size > 0) std::memcpy(out, cpath, out_size);
+
+        if constexpr (chunk)
+        {
+            summary->pops = pops;
+            summary->count = count;
+            summary->size = out_size;
+        }
+
+        // Trailing delimiter is kept.
+        if (trailing) out[out_size++] = delimiter;
+
+        return out_size;
+    }
+}
+
+/// True if scanner can run on this CPU.
+bool is_supported(scanner s)
+{
+    return detail::find_mask_builder<default_policy>(s) != nullptr;
+}
+
+/// The fastest scanner supported by this CPU.
+scanner best_scanner()
+{
+    for (const auto s : { scanner::avx2, scanner::sse2 })
+    {
+        if (is_supported(s)) return s;
+    }
+
+    return scanner::scalar;
+}
+
+/// The fastest scanner, detected once.
+scanner default_scanner()
+{
+    static const scanner s = best_scanner();
+    return s;
+}
+
+const char* scanner_name(scanner s)
+{
+    switch (s)
+    {
+    case scanner::sse2: return "SSE2";
+    case scanner::avx2: return "AVX2";
+    default: return "scalar";
+    }
+}
+
 /// Normalizes path removing relative subpaths such as "." and "..".
 /// Path delimiter is slash "/".
 ///
@@ -24,185 +545,1970 @@
 /// "/", "./" or "../" then first subfolder is domain-like and it's considered
 /// virtual root.
 /// Example: "bar/../foo" -> "bar/foo", "/bar/../foo" -> "/foo"
-std::string normalize(const std::string& path)
+///
+/// Delimiter, dots, domain root and trailing delimiter come from Policy, see
+/// default_policy, backslash_policy and posix_policy.
+///
+/// Writes result to out, which shall have room for size bytes. Returns result size.
+/// Scanner shall be supported by CPU, see is_supported().
+template <class Policy = default_policy>
+size_t normalize(const char* path, size_t size, char* out, scanner s)
+{
+    return detail::normalize<Policy, false>(path, size, out, detail::find_mask_builder<Policy>(s));
+}
+
+/// The same with the default scanner. Constant expression for constant arguments,
+/// the check is resolved at compile time.
+template <class Policy = default_policy>
+constexpr size_t normalize(const char* path, size_t size, char* out)
+{
+    // GCC and Clang 9+, MSVC 19.25+ have it in C++17 too.
+    if (__builtin_is_constant_evaluated()) return detail::normalize_constant<Policy>(path, size, out);
+    return normalize<Policy>(path, size, out, default_scanner());
+}
+
+/// Normalizes path in its own buffer, already normalized one is not changed.
+/// Returns result size.
+template <class Policy = default_policy>
+size_t normalize_in_place(char* path, size_t size, scanner s)
+{
+    return detail::normalize<Policy, true>(path, size, path, detail::find_mask_builder<Policy>(s));
+}
+
+template <class Policy = default_policy>
+constexpr size_t normalize_in_place(char* path, size_t size)
+{
+    if (__builtin_is_constant_evaluated()) return detail::normalize_constant<Policy>(path, size, path);
+    return normalize_in_place<Policy>(path, size, default_scanner());
+}
+
+template <class Policy = default_policy>
+void normalize_in_place(std::string& path, scanner s = default_scanner())
+{
+    path.resize(normalize_in_place<Policy>(&path[0], path.size(), s));
+}
+
+/// Normalizes path into out, its memory is reused.
+template <class Policy = default_policy>
+void normalize(const std::string& path, std::string& out, scanner s = default_scanner())
+{
+    if (&path == &out)
+    {
+        normalize_in_place<Policy>(out, s);
+        return;
+    }
+
+    out.resize(path.size());
+    out.resize(normalize<Policy>(path.data(), path.size(), &out[0], s));
+}
+
+template <class Policy = default_policy>
+std::string normalize(const std::string& path, scanner s = default_scanner())
+{
+    std::string result;
+    normalize<Policy>(path, result, s);
+    return result;
+}
+
+/// Temporary path is normalized in place and moved to result.
+template <class Policy = default_policy>
+std::string normalize(std::string&& path, scanner s = default_scanner())
+{
+    normalize_in_place<Policy>(path, s);
+    return std::move(path);
+}
+
+/// Path normalized at compile time, see normalize_literal().
+template <size_t N>
+struct static_path
+{
+    char data[N] = {};
+    size_t size = 0;
+
+    constexpr std::string_view view() const
+    {
+        return std::string_view(data, size);
+    }
+};
+
+/// Normalizes string literal, in constant expression if needed:
+/// static_assert(normalize_literal("/foo/../bar").view() == "/bar").
+template <class Policy = default_policy, size_t N>
+constexpr static_path<N> normalize_literal(const char (&path)[N])
+{
+    static_path<N> result;
+    result.size = normalize<Policy>(path, N - 1, result.data);
+    return result;
+}
+
+/// Hash of raw path bytes, 8 bytes at a time.
+inline uint64_t hash_path(std::string_view path)
+{
+    constexpr uint64_t k = 0x9e3779b97f4a7c15ull;
+
+    uint64_t h = path.size() * k;
+    size_t i = 0;
+    for (; i + 8 <= path.size(); i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, path.data() + i, 8);
+        h = (h ^ word) * k;
+        h ^= h >> 32;
+    }
+
+    if (i < path.size())
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, path.data() + i, path.size() - i);
+        h = (h ^ word) * k;
+    }
+
+    // Final mix of MurmurHash3, every bit of input affects low bits used for slots.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+/// Bounded cache of normalized paths for workloads repeating the same paths.
+/// Paths are found by hash in open addressing table, the oldest entries are
+/// evicted by CLOCK: hit marks entry referenced, eviction hand gives referenced
+/// entries second chance. Entries keep their strings, so there are no allocations
+/// once they have grown. Not thread safe, see sharded_normalize_cache.
+template <class Policy = default_policy>
+class normalize_cache
+{
+public:
+    explicit normalize_cache(size_t capacity = 4096, scanner s = default_scanner()):
+        entries_(std::max<size_t>(capacity, 1)), scanner_(s)
+    {
+        // Table is at most half full, probe sequences stay short.
+        size_t slots = 2;
+        while (slots < entries_.size() * 2) slots *= 2;
+        slots_.assign(slots, 0);
+        mask_ = slots - 1;
+    }
+
+    /// Normalized path, valid till the next call. Path shall not point into cache.
+    std::string_view normalize(std::string_view path)
+    {
+        return normalize(path, hash_path(path));
+    }
+
+    /// The same with hash_path(path) computed by caller.
+    std::string_view normalize(std::string_view path, uint64_t hash)
+    {
+        for (size_t slot = hash & mask_; slots_[slot]; slot = (slot + 1) & mask_)
+        {
+            entry& e = entries_[slots_[slot] - 1];
+            if (e.hash == hash && e.path == path)
+            {
+                e.referenced = true;
+                ++hits_;
+                return e.result;
+            }
+        }
+
+        ++misses_;
+
+        const size_t index = size_ < entries_.size() ? size_++ : evict();
+
+        entry& e = entries_[index];
+        e.hash = hash;
+        e.path.assign(path.data(), path.size());
+        e.result.resize(path.size());
+        e.result.resize(::normalize<Policy>(path.data(), path.size(), &e.result[0], scanner_));
+        e.referenced = false;
+
+        size_t slot = hash & mask_;
+        while (slots_[slot]) slot = (slot + 1) & mask_;
+        slots_[slot] = uint32_t(index + 1);
+
+        return e.result;
+    }
+
+    size_t hits() const
+    {
+        return hits_;
+    }
+
+    size_t misses() const
+    {
+        return misses_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t capacity() const
+    {
+        return entries_.size();
+    }
+
+    /// Drops entries and counters, memory is kept.
+    void clear()
+    {
+        std::fill(slots_.begin(), slots_.end(), 0);
+        size_ = 0;
+        hand_ = 0;
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+private:
+    struct entry
+    {
+        uint64_t hash = 0;
+        std::string path;
+        std::string result;
+        bool referenced = false;
+    };
+
+    /// Frees entry under the hand, skipping referenced ones. Returns its index.
+    size_t evict()
+    {
+        while (entries_[hand_].referenced)
+        {
+            entries_[hand_].referenced = false;
+            hand_ = (hand_ + 1) % entries_.size();
+        }
+
+        const size_t index = hand_;
+        hand_ = (hand_ + 1) % entries_.size();
+
+        size_t hole = entries_[index].hash & mask_;
+        while (slots_[hole] != index + 1) hole = (hole + 1) & mask_;
+
+        // Backward shift: following entries move into the hole unless it's before
+        // their home slot, so probe sequences have no gaps and no tombstones.
+        for (size_t next = (hole + 1) & mask_; slots_[next]; next = (next + 1) & mask_)
+        {
+            const size_t home = entries_[slots_[next] - 1].hash & mask_;
+            if (((next - home) & mask_) >= ((next - hole) & mask_))
+            {
+                slots_[hole] = slots_[next];
+                hole = next;
+            }
+        }
+
+        slots_[hole] = 0;
+        return index;
+    }
+
+    std::vector<entry> entries_;
+    std::vector<uint32_t> slots_;       // Entry index + 1, 0 for empty slot.
+    size_t mask_ = 0;
+    size_t size_ = 0;
+    size_t hand_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    scanner scanner_;
+};
+
+/// Thread safe normalize_cache: paths go to shards by hash, each shard has its
+/// own lock, so threads rarely wait for each other.
+template <class Policy = default_policy>
+class sharded_normalize_cache
+{
+public:
+    explicit sharded_normalize_cache(size_t capacity = 65536, size_t shards = 16, scanner s = default_scanner())
+    {
+        shards = std::max<size_t>(shards, 1);
+        for (size_t i = 0; i < shards; ++i)
+        {
+            shards_.emplace_back(new shard((capacity + shards - 1) / shards, s));
+        }
+    }
+
+    /// Copies normalized path to out, its memory is reused.
+    void normalize(std::string_view path, std::string& out)
+    {
+        // Shard is chosen by high bits, low ones pick slots within shard.
+        const uint64_t hash = hash_path(path);
+        shard& sh = *shards_[(hash >> 32) % shards_.size()];
+
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        const auto result = sh.cache.normalize(path, hash);
+        out.assign(result.data(), result.size());
+    }
+
+    std::string normalize(std::string_view path)
+    {
+        std::string result;
+        normalize(path, result);
+        return result;
+    }
+
+    size_t hits() const
+    {
+        return sum(&normalize_cache<Policy>::hits);
+    }
+
+    size_t misses() const
+    {
+        return sum(&normalize_cache<Policy>::misses);
+    }
+
+    size_t size() const
+    {
+        return sum(&normalize_cache<Policy>::size);
+    }
+
+private:
+    // Shards don't share cache lines.
+    struct alignas(64) shard
+    {
+        shard(size_t capacity, scanner s): cache(capacity, s)
+        {
+        }
+
+        std::mutex mutex;
+        normalize_cache<Policy> cache;
+    };
+
+    size_t sum(size_t (normalize_cache<Policy>::*counter)() const) const
+    {
+        size_t total = 0;
+        for (const auto& sh : shards_)
+        {
+            std::lock_guard<std::mutex> lock(sh->mutex);
+            total += (sh->cache.*counter)();
+        }
+
+        return total;
+    }
+
+    std::vector<std::unique_ptr<shard>> shards_;
+};
+
+/// Paths stored back to back in one buffer: path i takes bytes [offsets[i], offsets[i + 1]).
+struct path_arena
+{
+    std::string bytes;
+    std::vector<size_t> offsets = { 0 };
+
+    size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    std::string_view operator[](size_t i) const
+    {
+        return std::string_view(bytes.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    void add(std::string_view path)
+    {
+        bytes.append(path.data(), path.size());
+        offsets.push_back(bytes.size());
+    }
+
+    void clear()
+    {
+        bytes.clear();
+        offsets.assign(1, 0);
+    }
+};
+
+/// Threads waiting for parallel loops. Loop is split into tasks, which are taken
+/// one by one by pool threads and the calling one.
+class thread_pool
+{
+public:
+    /// Number of hardware threads by default, the calling thread is counted.
+    explicit thread_pool(size_t threads = 0)
+    {
+        if (threads == 0) threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+        for (size_t i = 1; i < threads; ++i) threads_.emplace_back([this] { wait(); });
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        wake_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    size_t size() const
+    {
+        return threads_.size() + 1;
+    }
+
+    /// Calls func(task) for tasks [0, count), returns when all are done.
+    template <class Func>
+    void run(size_t count, const Func& func)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            func_ = &func;
+            invoke_ = [](const void* f, size_t task) { (*static_cast<const Func*>(f))(task); };
+            count_ = count;
+            next_ = 0;
+            busy_ = threads_.size();
+            ++generation_;
+        }
+
+        wake_.notify_all();
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return busy_ == 0; });
+    }
+
+private:
+    void wait()
+    {
+        size_t generation = 0;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != generation; });
+                if (stop_) return;
+
+                generation = generation_;
+            }
+
+            work();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_ == 0) done_.notify_one();
+        }
+    }
+
+    void work()
+    {
+        for (size_t task; (task = next_.fetch_add(1)) < count_; )
+        {
+            invoke_(func_, task);
+        }
+    }
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    // Current loop, set under mutex before threads are woken.
+    const void* func_ = nullptr;
+    void (*invoke_)(const void*, size_t) = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_{ 0 };
+
+    size_t busy_ = 0;           // Pool threads still in the loop.
+    size_t generation_ = 0;     // Loops started.
+    bool stop_ = false;
+};
+
+/// Normalizes arenas of paths on thread pool. Buffers are kept between batches,
+/// so there are no allocations in steady state.
+class batch_normalizer
+{
+public:
+    /// Paths are split into chunks of about chunk_size bytes, so a chunk with its
+    /// results stays in core cache.
+    explicit batch_normalizer(size_t threads = 0, size_t chunk_size = 64 * 1024, scanner s = default_scanner()):
+        pool_(threads), chunk_size_(std::max<size_t>(chunk_size, 1)), scanner_(s)
+    {
+    }
+
+    size_t threads() const
+    {
+        return pool_.size();
+    }
+
+    /// Path i of out is normalized path i of in, arenas shall be different.
+    void normalize(const path_arena& in, path_arena& out)
+    {
+        const size_t count = in.size();
+        const char* const bytes = in.bytes.data();
+
+        // Chunk k starts from the first path at byte k * chunk_size or further.
+        chunks_.clear();
+        for (size_t first = 0; first < count; )
+        {
+            const size_t end_byte = in.offsets[first] + chunk_size_;
+            const auto next = std::lower_bound(in.offsets.begin() + first + 1, in.offsets.end() - 1, end_byte);
+            const size_t end = next - in.offsets.begin();
+
+            chunks_.push_back(chunk{ first, end, 0, 0 });
+            first = end;
+        }
+
+        // Results of a chunk are packed in place of its paths (none is longer than
+        // its path), sizes go to offsets for now.
+        scratch_.resize(in.bytes.size());
+        out.offsets.resize(count + 1);
+        out.offsets[0] = 0;
+
+        pool_.run(chunks_.size(), [&](size_t k)
+        {
+            auto& c = chunks_[k];
+            char* const packed = &scratch_[0] + in.offsets[c.first];
+
+            for (size_t i = c.first; i < c.end; ++i)
+            {
+                const size_t size = ::normalize(bytes + in.offsets[i], in.offsets[i + 1] - in.offsets[i],
+                    packed + c.size, scanner_);
+
+                out.offsets[i + 1] = size;
+                c.size += size;
+            }
+        });
+
+        size_t total = 0;
+        for (auto& c : chunks_)
+        {
+            c.out_begin = total;
+            total += c.size;
+        }
+
+        // Packed chunks are moved to their places, sizes become offsets.
+        out.bytes.resize(total);
+
+        pool_.run(chunks_.size(), [&](size_t k)
+        {
+            const auto& c = chunks_[k];
+            if (c.size > 0) std::memcpy(&out.bytes[c.out_begin], scratch_.data() + in.offsets[c.first], c.size);
+
+            size_t offset = c.out_begin;
+            for (size_t i = c.first; i < c.end; ++i)
+            {
+                offset += out.offsets[i + 1];
+                out.offsets[i + 1] = offset;
+            }
+        });
+    }
+
+private:
+    struct chunk
+    {
+        size_t first;       // Paths [first, end).
+        size_t end;
+        size_t size;        // Result bytes.
+        size_t out_begin;
+    };
+
+    thread_pool pool_;
+    size_t chunk_size_;
+    scanner scanner_;
+
+    std::vector<chunk> chunks_;
+    std::string scratch_;
+};
+
+/// Normalizes single huge path on thread pool, result is the same as of normalize().
+/// Path is split at delimiters into pieces normalized independently, each one
+/// leaves its surviving subfolders and ".." it couldn't match. Going through the
+/// summaries in order tells how many subfolders of each piece survive ".." of the
+/// following ones, then pieces are copied to their output places concurrently.
+template <class Policy = default_policy>
+class parallel_normalizer
+{
+public:
+    /// Paths shorter than 2 * min_chunk_size are normalized by calling thread.
+    explicit parallel_normalizer(size_t threads = 0, size_t min_chunk_size = 1 << 20, scanner s = default_scanner()):
+        pool_(threads), min_chunk_size_(std::max<size_t>(min_chunk_size, 1)), scanner_(s)
+    {
+    }
+
+    size_t threads() const
+    {
+        return pool_.size();
+    }
+
+    /// Writes result to out, which shall have room for size bytes and shall not
+    /// overlap path. Returns result size.
+    size_t normalize(const char* path, size_t size, char* out)
+    {
+        constexpr char delimiter = Policy::delimiter;
+
+        const size_t pieces = std::min(pool_.size(), size / min_chunk_size_);
+        if (pieces < 2) return ::normalize<Policy>(path, size, out, scanner_);
+
+        if (chunks_.size() < pieces) chunks_.resize(pieces);
+
+        // Piece k starts from the first delimiter at byte k * size / pieces or further.
+        size_t used = 0;
+        for (size_t begin = 0; begin < size; )
+        {
+            size_t end = size;
+            const size_t from = std::max((used + 1) * size / pieces, begin + 1);
+            if (used + 1 < pieces && from < size)
+            {
+                const auto next = static_cast<const char*>(std::memchr(path + from, delimiter, size - from));
+                if (next) end = next - path;
+            }
+
+            chunks_[used].begin = begin;
+            chunks_[used].end = end;
+            chunks_[used].summary.root_idx = 0;
+            ++used;
+
+            begin = end;
+        }
+
+        // Domain root is in the first piece.
+        size_t root_idx = 0;
+        if constexpr (Policy::domain_root)
+        {
+            const auto first = static_cast<const char*>(std::memchr(path, delimiter, size));
+            root_idx = detail::is_domain<Policy>(path, first ? first - path : size);
+        }
+
+        chunks_[0].summary.root_idx = root_idx;
+
+        scratch_.resize(size);
+        const auto build_masks = detail::find_mask_builder<Policy>(scanner_);
+
+        pool_.run(used, [&](size_t k)
+        {
+            auto& c = chunks_[k];
+            detail::normalize<Policy, false, true>(path + c.begin, c.end - c.begin, &scratch_[c.begin], build_masks,
+                &c.summary);
+        });
+
+        // Runs of surviving subfolders by piece. Unmatched ".." remove subfolders
+        // from the last runs, but never the root.
+        runs_.clear();
+        size_t count = 0;
+
+        for (size_t k = 0; k < used; ++k)
+        {
+            auto& c = chunks_[k];
+            c.keep = c.summary.count;
+
+            size_t pops = k > 0 ? std::min(c.summary.pops, count - std::min(count, root_idx)) : 0;
+            count -= pops;
+
+            while (pops > 0)
+            {
+                auto& last = chunks_[runs_.back()];
+                const size_t removed = std::min(pops, last.keep);
+                last.keep -= removed;
+                pops -= removed;
+                if (last.keep == 0) runs_.pop_back();
+            }
+
+            count += c.keep;
+            if (c.keep > 0) runs_.push_back(k);
+        }
+
+        size_t total = 0;
+        for (size_t k = 0; k < used; ++k)
+        {
+            auto& c = chunks_[k];
+            c.out_begin = total;
+            total += c.summary.kept_size(c.keep);
+        }
+
+        pool_.run(used, [&](size_t k)
+        {
+            const auto& c = chunks_[k];
+            const size_t kept = c.summary.kept_size(c.keep);
+            if (kept > 0) std::memcpy(out + c.out_begin, scratch_.data() + c.begin, kept);
+        });
+
+        // Trailing delimiter is kept.
+        if (Policy::keep_trailing && path[size - 1] == delimiter) out[total++] = delimiter;
+
+        return total;
+    }
+
+    std::string normalize(const std::string& path)
+    {
+        std::string result(path.size(), '\0');
+        result.resize(normalize(path.data(), path.size(), &result[0]));
+        return result;
+    }
+
+private:
+    struct chunk
+    {
+        size_t begin = 0;           // Path bytes [begin, end).
+        size_t end = 0;
+        size_t keep = 0;            // Surviving subfolders kept by following pieces.
+        size_t out_begin = 0;
+        detail::chunk_summary summary;
+    };
+
+    thread_pool pool_;
+    size_t min_chunk_size_;
+    scanner scanner_;
+
+    std::vector<chunk> chunks_;
+    std::vector<size_t> runs_;
+    std::string scratch_;
+};
+
+/// Output written by large blocks. Lines are normalized right into its buffer.
+class buffered_writer
+{
+public:
+    explicit buffered_writer(std::FILE* file, size_t capacity = 4 << 20): file_(file), buffer_(capacity)
+    {
+    }
+
+    ~buffered_writer()
+    {
+        flush();
+    }
+
+    buffered_writer(const buffered_writer&) = delete;
+    buffered_writer& operator=(const buffered_writer&) = delete;
+
+    /// Buffer end with room for size bytes, written part is added by commit().
+    char* reserve(size_t size)
+    {
+        if (used_ + size > buffer_.size())
+        {
+            flush();
+            if (size > buffer_.size()) buffer_.resize(size);
+        }
+
+        return buffer_.data() + used_;
+    }
+
+    void commit(size_t size)
+    {
+        used_ += size;
+    }
+
+    void write(const char* data, size_t size)
+    {
+        if (used_ + size > buffer_.size()) flush();
+
+        // Block as big as buffer goes as it is.
+        if (size >= buffer_.size())
+        {
+            if (std::fwrite(data, 1, size, file_) != size) failed_ = true;
+            return;
+        }
+
+        std::memcpy(buffer_.data() + used_, data, size);
+        used_ += size;
+    }
+
+    void flush()
+    {
+        if (used_ > 0 && std::fwrite(buffer_.data(), 1, used_, file_) != used_) failed_ = true;
+        used_ = 0;
+
+        if (std::fflush(file_) != 0) failed_ = true;
+    }
+
+    bool failed() const
+    {
+        return failed_;
+    }
+
+private:
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+    bool failed_ = false;
+};
+
+/// Lines of a chunk normalized on a pool thread, kept till their turn to be written.
+struct line_buffer
+{
+    std::vector<char> bytes;
+    size_t used = 0;
+
+    char* reserve(size_t size)
+    {
+        if (used + size > bytes.size()) bytes.resize(std::max(used + size, bytes.size() * 2));
+        return bytes.data() + used;
+    }
+
+    void commit(size_t size)
+    {
+        used += size;
+    }
+};
+
+/// Normalizes newline separated paths, each result line ends with newline.
+/// CRLF line ends are taken too. Output is either buffered_writer or line_buffer.
+template <class Output>
+void normalize_lines(std::string_view lines, Output& out, scanner s = default_scanner())
+{
+    const char* const end = lines.data() + lines.size();
+
+    for (const char* line = lines.data(); line < end; )
+    {
+        const auto newline = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        const char* const line_end = newline ? newline : end;
+        const size_t size = line_end - line - (line_end > line && line_end[-1] == '\r');
+
+        char* const result = out.reserve(size + 1);
+        const size_t result_size = normalize(line, size, result, s);
+        result[result_size] = '\n';
+        out.commit(result_size + 1);
+
+        line = line_end + 1;
+    }
+}
+
+/// Input cut into blocks of complete lines: file mapped to memory is one block,
+/// stream is read by large blocks.
+class line_reader
+{
+public:
+    /// Standard input if path is empty or "-".
+    explicit line_reader(const std::string& path)
+    {
+        const bool standard = path.empty() || path == "-";
+
+#ifdef NORMALIZE_MMAP
+        // Regular files are mapped, standard input too if it's redirected from one.
+        const int fd = standard ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+        if (map(fd))
+        {
+            if (!standard) ::close(fd);
+            return;
+        }
+
+        if (!standard && fd >= 0) ::close(fd);
+#endif
+
+        file_ = standard ? stdin : std::fopen(path.c_str(), "rb");
+        owned_ = !standard && file_ != nullptr;
+    }
+
+    /// Stream read as is, it stays open.
+    line_reader(std::FILE* file, size_t block_size): file_(file), block_size_(block_size) {}
+
+    ~line_reader()
+    {
+#ifdef NORMALIZE_MMAP
+        if (map_) ::munmap(const_cast<char*>(map_), map_size_);
+#endif
+        if (owned_) std::fclose(file_);
+    }
+
+    line_reader(const line_reader&) = delete;
+    line_reader& operator=(const line_reader&) = delete;
+
+    bool ok() const
+    {
+        return mapped_ || file_ != nullptr;
+    }
+
+    bool failed() const
+    {
+        return file_ != nullptr && std::ferror(file_);
+    }
+
+    /// Next block, the last line of input may lack newline. Empty at the end.
+    std::string_view next()
+    {
+        if (mapped_)
+        {
+            mapped_ = false;
+            return std::string_view(map_, map_size_);
+        }
+
+        if (!file_) return std::string_view();
+
+        // Mapped input doesn't need buffer.
+        if (buffer_.empty()) buffer_.resize(block_size_);
+
+        // Incomplete line of the previous block goes first.
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+
+        while (true)
+        {
+            if (end_ == buffer_.size()) buffer_.resize(buffer_.size() * 2);
+
+            const size_t read = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, file_);
+            end_ += read;
+
+            if (read == 0)
+            {
+                begin_ = end_;
+                return std::string_view(buffer_.data(), end_);
+            }
+
+            // Line longer than buffer makes it grow.
+            const auto last = std::string_view(buffer_.data(), end_).rfind('\n');
+            if (last != std::string_view::npos && end_ == buffer_.size())
+            {
+                begin_ = last + 1;
+                return std::string_view(buffer_.data(), begin_);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t default_block_size = 16 << 20;
+
+#ifdef NORMALIZE_MMAP
+    bool map(int fd)
+    {
+        struct stat info;
+        if (fd < 0 || ::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) return false;
+
+        map_size_ = info.st_size;
+        if (map_size_ == 0)
+        {
+            mapped_ = true;
+            return true;
+        }
+
+        void* const map = ::mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) return false;
+
+        ::madvise(map, map_size_, MADV_SEQUENTIAL);
+        map_ = static_cast<const char*>(map);
+        mapped_ = true;
+        return true;
+    }
+#endif
+
+    std::FILE* file_ = nullptr;
+    bool owned_ = false;
+
+    size_t block_size_ = default_block_size;
+    std::vector<char> buffer_;
+    size_t begin_ = 0;      // Incomplete line left in buffer is [begin_, end_).
+    size_t end_ = 0;
+
+    bool mapped_ = false;   // Mapped block is not taken yet.
+    const char* map_ = nullptr;
+    size_t map_size_ = 0;
+};
+
+/// Normalizes newline separated paths from file (standard input if empty or "-")
+/// to standard output. With several threads input is split into chunks of lines
+/// normalized in parallel, output keeps input order. Returns exit code.
+int stream_normalize(const std::string& path, size_t threads)
+{
+    constexpr size_t chunk_size = 1 << 20;
+    constexpr size_t chunks_per_thread = 4;
+
+    line_reader reader(path);
+    if (!reader.ok())
+    {
+        std::cerr << "Unable to open " << path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    buffered_writer writer(stdout);
+
+    // Pool and chunk buffers are created only if needed.
+    std::unique_ptr<thread_pool> pool;
+    if (threads > 1) pool.reset(new thread_pool(threads));
+
+    std::vector<std::string_view> chunks;
+    std::vector<line_buffer> results;
+
+    for (auto block = reader.next(); !block.empty(); block = reader.next())
+    {
+        if (!pool)
+        {
+            normalize_lines(block, writer);
+            continue;
+        }
+
+        // Chunks end with line ends, windows of them are normalized in parallel
+        // and written in order.
+        while (!block.empty())
+        {
+            chunks.clear();
+            while (!block.empty() && chunks.size() < pool->size() * chunks_per_thread)
+            {
+                size_t size = block.size();
+                if (size > chunk_size)
+                {
+                    const auto newline = block.find('\n', chunk_size);
+                    if (newline != std::string_view::npos) size = newline + 1;
+                }
+
+                chunks.push_back(block.substr(0, size));
+                block.remove_prefix(size);
+            }
+
+            if (results.size() < chunks.size()) results.resize(chunks.size());
+
+            pool->run(chunks.size(), [&](size_t k)
+            {
+                results[k].used = 0;
+                normalize_lines(chunks[k], results[k]);
+            });
+
+            for (size_t k = 0; k < chunks.size(); ++k) writer.write(results[k].bytes.data(), results[k].used);
+        }
+    }
+
+    writer.flush();
+
+    if (reader.failed() || writer.failed())
+    {
+        std::cerr << (reader.failed() ? "Read" : "Write") << " failed: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int tests_failed = 0;
+
+/// Number of heap allocations made by program.
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+/// Frees memory of replaced operator new. Kept out of line, inlined free() of a
+/// new-expression result is reported by GCC as mismatched deallocation.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void release(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p) noexcept
+{
+    release(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    release(p);
+}
+
+/// Test cases, normalized once more as a batch.
+static path_arena test_inputs;
+static std::vector<std::string> test_expected;
+
+/// Simple unit testing function.
+void test(const std::string& input, const std::string& expected)
+{
+    test_inputs.add(input);
+    test_expected.push_back(expected);
+
+    const auto quote = [](const auto& str)
+    {
+        return "\'" + str + "\'";
+    };
+
+    const auto output = normalize(input);
+    bool ok = output == expected;
+
+    // Backslash delimited copy shall give backslash delimited result.
+    const auto backslashed = [](std::string str)
+    {
+        std::replace(str.begin(), str.end(), '/', '\\');
+        return str;
+    };
+
+    // Every scanner and every overload shall give the same.
+    std::string failed;
+    for (const auto s : { scanner::scalar, scanner::sse2, scanner::avx2 })
+    {
+        if (!is_supported(s)) continue;
+
+        std::string reused = "previous output";
+        normalize(input, reused, s);
+
+        std::string in_place = input;
+        normalize_in_place(in_place, s);
+
+        // Exact size buffer, nothing is written past it.
+        std::unique_ptr<char[]> buffer(new char[input.size() + 1]);
+        buffer[input.size()] = '#';
+        const size_t size = normalize(input.data(), input.size(), buffer.get(), s);
+
+        if (normalize(input, s) != expected || reused != expected || in_place != expected ||
+            std::string(buffer.get(), size) != expected || buffer[input.size()] != '#' ||
+            normalize(std::string(input), s) != expected ||
+            normalize<backslash_policy>(backslashed(input), s) != backslashed(expected))
+        {
+            failed += std::string(" ") + scanner_name(s);
+            ok = false;
+        }
+    }
+
+    // Constant evaluation code run at runtime.
+    std::string constant = input;
+    constant.resize(detail::normalize_constant<default_policy>(input.data(), input.size(), &constant[0]));
+    if (constant != expected)
+    {
+        failed += " constexpr";
+        ok = false;
+    }
+
+    if (!ok) ++tests_failed;
+
+    std::cout
+        << (ok ? "OK" : "FAIL (expected " + quote(expected) + ", scanners:" + failed + ")")
+        << " - "
+        << quote(input) << " -> " << quote(output)
+        << std::endl;
+}
+
+/// Policy variants, compile time results are checked by compiler.
+void test_policies()
+{
+    static_assert(normalize_literal("/foo/bar/../baz").view() == "/foo/baz");
+    static_assert(normalize_literal("domain.com/./../foo/").view() == "domain.com/foo/");
+    static_assert(normalize_literal<backslash_policy>("C:\\foo\\..\\..\\bar").view() == "C:\\bar");
+    static_assert(normalize_literal<posix_policy>("domain.com/../foo").view() == "/foo");
+    static_assert(normalize_literal<posix_policy>("bar/./baz/").view() == "bar/baz/");
+
+    const std::pair<std::string, std::string> posix_cases[] =
+    {
+        { "domain.com/../foo", "/foo" },
+        { "bar/baz/..", "bar" },
+        { "bar/baz/../../../qux/", "/qux/" },
+        { "./bar", "/bar" },
+        { "/foo/./bar//", "/foo/bar/" },
+    };
+
+    bool ok = true;
+    for (const auto& c : posix_cases)
+    {
+        for (const auto s : { scanner::scalar, scanner::sse2, scanner::avx2 })
+        {
+            if (is_supported(s)) ok = ok && normalize<posix_policy>(c.first, s) == c.second;
+        }
+
+        std::string constant = c.first;
+        constant.resize(detail::normalize_constant<posix_policy>(c.first.data(), c.first.size(), &constant[0]));
+        ok = ok && constant == c.second;
+    }
+
+    if (!ok) ++tests_failed;
+
+    std::cout << (ok ? "OK" : "FAIL") << " - POSIX policy, " << std::size(posix_cases) << " paths" << std::endl;
+}
+
+/// Test cases through caches small enough to evict, shared cache by a few threads.
+void test_cache()
+{
+    constexpr size_t passes = 50;
+
+    normalize_cache<> cache(8);
+    bool ok = true;
+
+    for (size_t pass = 0; pass < 3; ++pass)
+    {
+        for (size_t i = 0; i < test_inputs.size(); ++i) ok = ok && cache.normalize(test_inputs[i]) == test_expected[i];
+    }
+
+    // Repeated path is a hit.
+    cache.normalize(test_inputs[0]);
+    const size_t hits = cache.hits();
+    ok = ok && cache.normalize(test_inputs[0]) == test_expected[0] && cache.hits() == hits + 1;
+    ok = ok && cache.size() == cache.capacity() && cache.hits() + cache.misses() == test_inputs.size() * 3 + 2;
+
+    // Everything fits, only the first pass misses.
+    normalize_cache<> large(64);
+    for (size_t pass = 0; pass < 3; ++pass)
+    {
+        for (size_t i = 0; i < test_inputs.size(); ++i) ok = ok && large.normalize(test_inputs[i]) == test_expected[i];
+    }
+
+    ok = ok && large.misses() <= test_inputs.size() && large.hits() >= test_inputs.size() * 2;
+
+    sharded_normalize_cache<> sharded(16, 4);
+    std::atomic<bool> sharded_ok(true);
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < 3; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            std::string out;
+            for (size_t pass = 0; pass < passes; ++pass)
+            {
+                for (size_t i = 0; i < test_inputs.size(); ++i)
+                {
+                    sharded.normalize(test_inputs[i], out);
+                    if (out != test_expected[i]) sharded_ok = false;
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads) thread.join();
+
+    ok = ok && sharded_ok && sharded.hits() + sharded.misses() == 3 * passes * test_inputs.size();
+
+    if (!ok) ++tests_failed;
+
+    std::cout << (ok ? "OK" : "FAIL") << " - cache, hits " << cache.hits() << ", misses " << cache.misses()
+        << ", sharded hits " << sharded.hits() << ", misses " << sharded.misses() << std::endl;
+}
+
+/// Test cases normalized by batches split into chunks of a few paths.
+void test_batch()
+{
+    for (const size_t threads : { 1, 3 })
+    {
+        batch_normalizer batch(threads, 16);
+
+        // Output arena is reused.
+        path_arena out;
+        out.add("previous output");
+
+        bool ok = true;
+        for (size_t pass = 0; pass < 2; ++pass)
+        {
+            batch.normalize(test_inputs, out);
+
+            ok = ok && out.size() == test_expected.size();
+            for (size_t i = 0; ok && i < out.size(); ++i) ok = out[i] == test_expected[i];
+        }
+
+        batch.normalize(path_arena(), out);
+        ok = ok && out.size() == 0 && out.bytes.empty();
+
+        if (!ok) ++tests_failed;
+
+        std::cout << (ok ? "OK" : "FAIL") << " - batch of " << test_inputs.size() << " paths, "
+            << threads << " thread(s)" << std::endl;
+    }
+}
+
+/// Lines read by tiny blocks, so lines cross block ends and outgrow blocks.
+void test_lines()
+{
+    const std::pair<std::string, std::string> cases[] =
+    {
+        { "/foo/../bar\n./baz/\n", "/bar\n/baz/\n" },
+        { "/foo/../bar\r\n./baz/\r\n\r\n", "/bar\n/baz/\n\n" },
+        { "/foo/./bar\n/last/../line", "/foo/bar\n/line\n" },
+        { "/no/newline\r", "/no/newline\n" },
+        { "/a\n/block/./crossing/../line\r\n/b/../c\n", "/a\n/block/line\n/c\n" },
+        { "/" + std::string(20, 'x') + "/../" + std::string(30, 'y') + "\n", "/" + std::string(30, 'y') + "\n" },
+    };
+
+    bool ok = true;
+    for (const auto& c : cases)
+    {
+        for (const size_t block_size : { 4, 8, 1024 })
+        {
+            std::FILE* const file = std::tmpfile();
+            if (!file || std::fwrite(c.first.data(), 1, c.first.size(), file) != c.first.size())
+            {
+                ok = false;
+                break;
+            }
+            std::rewind(file);
+
+            line_buffer out;
+            line_reader reader(file, block_size);
+            for (auto block = reader.next(); !block.empty(); block = reader.next()) normalize_lines(block, out);
+
+            ok = ok && !reader.failed() && std::string(out.bytes.data(), out.used) == c.second;
+            std::fclose(file);
+        }
+
+        line_buffer whole;
+        normalize_lines(c.first, whole);
+        ok = ok && std::string(whole.bytes.data(), whole.used) == c.second;
+    }
+
+    if (!ok) ++tests_failed;
+
+    std::cout << (ok ? "OK" : "FAIL") << " - lines read by blocks, " << std::size(cases) << " inputs" << std::endl;
+}
+
+std::string generate_path(size_t seed, size_t max_len)
+{
+    std::string s;
+
+    while (s.size() < max_len)
+    {
+        if (seed % 2 == 0) s += "/";
+        if (seed % 3 == 0) s += "bar";
+        if (seed % 4 == 0) s += "foo";
+        if (seed % 5 == 0) s += "baz";
+        if (seed % 6 == 0) s += "/../";
+        if (seed % 7 == 0) s += "/./";
+        if (seed % 8 == 0) s += "/./../";
+        if (seed % 9 == 0) s += "/.././";
+        ++seed;
+    }
+
+    return s;
+}
+
+/// Random paths of "/", "." and names split into small pieces, compared to normalize().
+template <class Policy>
+bool test_parallel_policy(const char* name, size_t threads)
 {
-    constexpr char delimiter = '/';
-    constexpr char rel_point = '.';
+    parallel_normalizer<Policy> parallel(threads, 16);
+    std::mt19937_64 r(20170219);
+
+    std::string chars = "/.a";
+    chars[0] = Policy::delimiter;
 
-    struct folder
+    size_t mismatches = 0;
+    for (size_t i = 0; i < 2000; ++i)
     {
-        folder(size_t b, size_t s): begin(b), size(s) {}
+        std::string path(r() % (i % 100 ? 300 : 20000), 'a');
+        for (auto& c : path) c = chars[r() % 3];
 
-        size_t begin;
-        size_t size;
-    };
+        // Domain-like start now and then.
+        if (i % 3 == 0) path.replace(0, std::min<size_t>(path.size(), 4), "site");
+
+        if (parallel.normalize(path) != normalize<Policy>(path)) ++mismatches;
+    }
+
+    if (mismatches)
+    {
+        std::cout << "FAIL - " << name << ", " << mismatches << " paths normalized differently" << std::endl;
+    }
+
+    return mismatches == 0;
+}
+
+/// Test cases and random paths split into pieces.
+void test_parallel()
+{
+    constexpr size_t threads = 3;
+
+    parallel_normalizer<> parallel(threads, 1);
+    bool ok = true;
+
+    for (size_t i = 0; i < test_inputs.size(); ++i)
+    {
+        ok = ok && parallel.normalize(std::string(test_inputs[i])) == test_expected[i];
+    }
+
+    ok = test_parallel_policy<default_policy>("default policy", threads) && ok;
+    ok = test_parallel_policy<backslash_policy>("backslash policy", threads) && ok;
+    ok = test_parallel_policy<posix_policy>("POSIX policy", threads) && ok;
+
+    if (!ok) ++tests_failed;
+
+    std::cout << (ok ? "OK" : "FAIL") << " - parallel normalization, " << threads << " threads" << std::endl;
+}
 
-    // Possible optimization: assume that path length cannot be > PATH_MAX
-    // (typically 4096 on most Linux systems). So vector can be replaced with
-    // local array of 2049 elements, avoiding memory allocation/deallocation
-    // and making data context more local and cache-friendly.
-    std::vector<folder> folders;
+void performance_test()
+{
+    constexpr size_t max_count = 100000;
+    constexpr size_t max_path_size = 4096;
 
-    // Number of subfolders is no more than path length / 2 + 1.
-    folders.reserve(path.size() / 2 + 1);
+    std::cout << "Starting performance test, please wait..." << std::endl;
+    std::cout << "Loop count - " << max_count << std::endl;
+    std::cout << "Path size - " << max_path_size << std::endl;
 
-    size_t root_idx = 0;
+    std::vector<std::string> test;
+    test.reserve(max_count);
 
-    const char* const cpath = path.c_str();
-    const size_t size = path.size();
-    const char* const cend = cpath + size;
+    // Fixed seed, so runs are comparable.
+    std::srand(20170219);
 
-    const char* cur_pos = cpath;
-    const char* prev_pos = cpath;
+    for (size_t i = 0; i < max_count; ++i)
+    {
+        test.push_back(generate_path(std::rand(), max_path_size));
+    }
 
-    const auto add_folder =
-    [cpath, cend, size, &folders, &root_idx, &cur_pos, &prev_pos](const char* pos)
+    // Scanners shall give the same as scalar one.
+    std::vector<scanner> scanners;
+    for (const auto s : { scanner::scalar, scanner::sse2, scanner::avx2 })
     {
-        const size_t len = pos - prev_pos;
+        if (is_supported(s)) scanners.push_back(s);
+    }
 
-        if (len == 0 ||
-            (len == 1 && *(pos - 1) == rel_point) ||
-            (len == 2 && *(pos - 1) == rel_point && *(pos - 2) == delimiter))
+    size_t mismatches = 0;
+    for (const auto s : scanners)
+    {
+        for (size_t i = 0; i < max_count; i += 97)
         {
-            // Skip "", ".", "/." as empty subfolders
+            if (normalize(test[i], s) != normalize(test[i], scanner::scalar)) ++mismatches;
         }
-        else if ((len == 2 && *(pos - 1) == rel_point && *(pos - 2) == rel_point) ||
-            (len == 3 && *(pos - 1) == rel_point && *(pos - 2) == rel_point &&
-                *(pos - 3) == delimiter))
+    }
+
+    if (mismatches)
+    {
+        std::cout << "FAIL - " << mismatches << " paths normalized differently by scanners" << std::endl;
+        ++tests_failed;
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    const auto measure = [&](const std::string& name, const auto& normalize_all)
+    {
+        // Warm-up pass.
+        normalize_all();
+
+        // Paths may be changed by the warm-up pass.
+        double measured_size = 0;
+        for (const auto& path : test) measured_size += path.size();
+
+        // Measure pass.
+        using namespace std::chrono;
+        const size_t allocations_before = allocations;
+        const auto start = high_resolution_clock::now();
+
+        normalize_all();
+
+        const auto end = high_resolution_clock::now();
+        const duration<double, std::micro> total_time_us(end - start);
+        const double allocations_per_call = double(allocations - allocations_before) / max_count;
+
+        std::cout << name << std::endl;
+        std::cout << "Total duration " << total_time_us.count() << " us" << std::endl;
+        std::cout << "Average single call duration " << (total_time_us.count() / max_count) << " us" << std::endl;
+        std::cout << "Allocations per call " << allocations_per_call << std::endl;
+
+        const auto duration_sec = total_time_us.count() / 1E6;
+        const auto total_size_mb = measured_size / 1E6;
+
+        std::cout << "Average throughput " << (total_size_mb / duration_sec) << " MB/s" << std::endl;
+    };
+
+    // Output buffer is reused, it grows during warm-up pass only.
+    std::string out;
+
+    for (const auto s : scanners)
+    {
+        measure(std::string("Scanner ") + scanner_name(s) + (s == default_scanner() ? " (default)" : "") +
+            ", reused output", [&]
         {
-            // Remove previous subfolder for ".." and "/.." till reaching the root.
-            if (folders.size() > root_idx) folders.pop_back();
-        }
-        else
+            for (volatile size_t i = 0; i < max_count; ++i)
+            {
+                normalize(test[i], out, s);
+            }
+        });
+    }
+
+    measure("Returned output", [&]
+    {
+        for (volatile size_t i = 0; i < max_count; ++i)
         {
-            // Norm subfolder, add it.
-            folders.emplace_back(prev_pos - cpath, pos - prev_pos);
+            volatile auto r = normalize(test[i]);
+        }
+    });
 
-            // Subfolder starts from string beginning but doesn't start with "/".
-            // Hmmm, guess it's domain name and new root. Don't harass it by upcoming "..".
-            if (prev_pos == cpath && *cpath != delimiter) root_idx = 1;
+    // Paths are normalized by warm-up pass, measure pass only detects it.
+    measure("In place, already normalized", [&]
+    {
+        for (volatile size_t i = 0; i < max_count; ++i)
+        {
+            normalize_in_place(test[i]);
         }
+    });
+}
+
+/// Single path of path_size bytes normalized by 1, 2, 4... max_threads threads.
+void parallel_performance_test(size_t max_threads)
+{
+    constexpr size_t path_size = 64 << 20;
 
-        cur_pos = pos + 1;
+    std::cout << "Starting parallel performance test, please wait..." << std::endl;
+    std::cout << "Path size - " << path_size << std::endl;
 
-        // Skip adjacent path delimiters ('////' -> '/')
-        while (cur_pos < cend && *cur_pos == delimiter) ++cur_pos;
+    const std::string path = generate_path(20170219, path_size);
+    std::string out(path.size(), '\0');
 
-        prev_pos = cur_pos - 1;
-    };
+    if (max_threads == 0) max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    const std::string expected = normalize(path);
+    double single_thread_us = 0;
 
-    while (auto pos = std::strchr(cur_pos, delimiter))
+    for (const size_t threads : thread_counts)
     {
-        add_folder(pos);
+        parallel_normalizer<> parallel(threads);
+
+        // Warm-up pass.
+        size_t size = parallel.normalize(path.data(), path.size(), &out[0]);
+
+        // Measure pass.
+        using namespace std::chrono;
+        const size_t allocations_before = allocations;
+        const auto start = high_resolution_clock::now();
+
+        size = parallel.normalize(path.data(), path.size(), &out[0]);
+
+        const auto end = high_resolution_clock::now();
+        const duration<double, std::micro> total_time_us(end - start);
+        const size_t path_allocations = allocations - allocations_before;
+
+        if (threads == 1) single_thread_us = total_time_us.count();
+
+        std::cout << "Threads " << threads << ": "
+            << (path.size() / total_time_us.count()) << " MB/s, "
+            << "speedup " << (single_thread_us / total_time_us.count()) << ", "
+            << "allocations " << path_allocations << std::endl;
+
+        // Result shall be the same as of single thread normalization.
+        if (out.compare(0, size, expected) != 0 || size != expected.size())
+        {
+            std::cout << "FAIL - path normalized differently by " << threads << " threads" << std::endl;
+            ++tests_failed;
+        }
     }
+}
 
-    // Process last subfolder separately.
-    add_folder(cend);
+/// Batch of short paths as in logs, normalized by pools of 1, 2, 4... threads
+/// up to max_threads (hardware threads by default).
+void batch_performance_test(size_t max_threads)
+{
+    constexpr size_t path_count = 1000000;
+    constexpr size_t min_path_size = 16;
+    constexpr size_t max_path_size = 256;
 
-    std::string result;
-    result.reserve(size);
+    std::cout << "Starting batch performance test, please wait..." << std::endl;
+    std::cout << "Path count - " << path_count << std::endl;
+    std::cout << "Path size - " << min_path_size << " to " << max_path_size << std::endl;
 
-    for (const auto& f : folders)
+    path_arena in;
+    std::srand(20170219);
+
+    for (size_t i = 0; i < path_count; ++i)
     {
-        result.append(cpath + f.begin, f.size);
+        in.add(generate_path(std::rand(), min_path_size + std::rand() % (max_path_size - min_path_size)));
     }
 
-    return result;
-}
+    if (max_threads == 0) max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
 
-static int tests_failed = 0;
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
 
-/// Simple unit testing function.
-void test(const std::string& input, const std::string& expected)
-{
-    const auto quote = [](const auto& str)
+    std::cout << std::fixed << std::setprecision(2);
+
+    path_arena out;
+    double single_thread_us = 0;
+
+    for (const size_t threads : thread_counts)
     {
-        return "\'" + str + "\'";
-    };
+        batch_normalizer batch(threads);
 
-    const auto output = normalize(input);
-    const bool ok = output == expected;
+        // Warm-up pass.
+        batch.normalize(in, out);
 
-    if (!ok) ++tests_failed;
+        // Measure pass.
+        using namespace std::chrono;
+        const size_t allocations_before = allocations;
+        const auto start = high_resolution_clock::now();
 
-    std::cout
-        << (ok ? "OK" : "FAIL (expected " + quote(expected) + ")")
-        << " - "
-        << quote(input) << " -> " << quote(output)
-        << std::endl;
-}
+        batch.normalize(in, out);
 
-std::string generate_path(size_t seed, size_t max_len)
-{
-    std::string s;
+        const auto end = high_resolution_clock::now();
+        const duration<double, std::micro> total_time_us(end - start);
+        const size_t batch_allocations = allocations - allocations_before;
 
-    while (s.size() < max_len)
+        if (threads == 1) single_thread_us = total_time_us.count();
+
+        const auto duration_sec = total_time_us.count() / 1E6;
+
+        std::cout << "Threads " << threads << ": "
+            << (in.bytes.size() / 1E6 / duration_sec) << " MB/s, "
+            << (path_count / 1E6 / duration_sec) << " M paths/s, "
+            << "speedup " << (single_thread_us / total_time_us.count()) << ", "
+            << "allocations " << batch_allocations << std::endl;
+    }
+
+    // Results shall be the same as of single path normalization.
+    size_t mismatches = 0;
+    for (size_t i = 0; i < path_count; i += 101)
     {
-        if (seed % 2 == 0) s += "/";
-        if (seed % 3 == 0) s += "bar";
-        if (seed % 4 == 0) s += "foo";
-        if (seed % 5 == 0) s += "baz";
-        if (seed % 6 == 0) s += "/../";
-        if (seed % 7 == 0) s += "/./";
-        if (seed % 8 == 0) s += "/./../";
-        if (seed % 9 == 0) s += "/.././";
-        ++seed;
+        if (out[i] != normalize(std::string(in[i]))) ++mismatches;
     }
 
-    return s;
+    if (mismatches)
+    {
+        std::cout << "FAIL - " << mismatches << " paths normalized differently by batch" << std::endl;
+        ++tests_failed;
+    }
 }
 
-void performance_test()
+namespace bench
 {
-    constexpr size_t max_count = 100000;
-    constexpr size_t max_path_size = 4096;
+    constexpr uint64_t seed = 20170219;                 // Fixed, so runs are comparable.
+    constexpr size_t profile_bytes = 8 << 20;           // Input bytes per profile.
+    constexpr size_t max_paths = 200000;
+    constexpr size_t throughput_passes = 5;
 
-    std::cout << "Starting performance test, please wait..." << std::endl;
-    std::cout << "Loop count - " << max_count << std::endl;
-    std::cout << "Path size - " << max_path_size << std::endl;
+    constexpr size_t zipf_distinct = 50000;             // Distinct paths of skewed workload.
+    constexpr size_t zipf_calls = 200000;
+    constexpr double zipf_exponent = 1.0;
+    constexpr size_t cache_capacity = 4096;
 
-    std::vector<std::string> test;
-    test.reserve(max_count);
+    using rng = std::mt19937_64;
 
-    std::srand(std::time(nullptr));
+    /// Engine output only, distributions differ between standard libraries.
+    size_t pick(rng& r, size_t n)
+    {
+        return r() % n;
+    }
 
-    double total_size = 0;
-    for (size_t i = 0; i < max_count; ++i)
+    std::string name(rng& r, size_t min_size, size_t max_size)
     {
-        test.push_back(generate_path(std::rand(), max_path_size));
-        total_size += test.back().size();
+        std::string s(min_size + pick(r, max_size - min_size + 1), 'a');
+        for (auto& c : s) c = "abcdefghijklmnopqrstuvwxyz0123456789_-"[pick(r, 38)];
+        return s;
+    }
+
+    /// Host with a few folders and a file, some "." and "..".
+    std::string short_url(rng& r)
+    {
+        std::string s = name(r, 3, 12) + ".com";
+        for (size_t i = 1 + pick(r, 5); i > 0; --i)
+        {
+            const size_t kind = pick(r, 20);
+            s += kind == 0 ? "/.." : kind == 1 ? "/." : "/" + name(r, 3, 10);
+        }
+
+        if (pick(r, 5) == 0) return s + "/";
+        return s + "/" + name(r, 3, 10) + ".html";
+    }
+
+    /// Hundreds of short folders.
+    std::string deep(rng& r)
+    {
+        std::string s;
+        for (size_t i = 64 + pick(r, 193); i > 0; --i) s += pick(r, 20) == 0 ? "/.." : "/" + name(r, 1, 4);
+        return s;
+    }
+
+    std::string dot_heavy(rng& r)
+    {
+        std::string s;
+        while (s.size() < 256)
+        {
+            const size_t kind = pick(r, 10);
+            s += kind < 4 ? "/.." : kind < 7 ? "/." : "/" + name(r, 1, 8);
+        }
+
+        return s;
     }
 
-    // Warm-up pass.
-    for (volatile size_t i = 0; i < max_count; ++i)
+    std::string slash_heavy(rng& r)
     {
-        volatile auto s = normalize(test[i]);
+        std::string s;
+        while (s.size() < 256) s += std::string(1 + pick(r, 8), '/') + name(r, 1, 8);
+        return s;
     }
 
-    // Measure pass.
-    using namespace std::chrono;
-    const auto start = high_resolution_clock::now();
+    std::string normalized(rng& r)
+    {
+        std::string s;
+        for (size_t size = 64 + pick(r, 449); s.size() < size; ) s += "/" + name(r, 2, 16);
+        return s;
+    }
 
-    for (volatile size_t i = 0; i < max_count; ++i)
+    std::string path_max(rng& r)
     {
-        volatile auto s = normalize(test[i]);
+        return generate_path(r(), 4096);
     }
 
-    const auto end = high_resolution_clock::now();
-    const duration<double, std::micro> total_time_us(end - start);
+    struct profile
+    {
+        const char* name;
+        std::string (*generate)(rng&);
+    };
 
-    std::cout << std::fixed << std::setprecision(2);
-    std::cout << "Total duration " << total_time_us.count() << " us" << std::endl;
-    std::cout << "Average single call duration " << (total_time_us.count() / max_count) << " us" << std::endl;
+    const profile profiles[] =
+    {
+        { "short_url", &short_url },
+        { "deep", &deep },
+        { "dot_heavy", &dot_heavy },
+        { "slash_heavy", &slash_heavy },
+        { "normalized", &normalized },
+        { "path_max", &path_max },
+    };
+
+    struct result
+    {
+        std::string profile;
+        std::string variant;
+        size_t paths;
+        size_t bytes;
+        double p50_ns;
+        double p99_ns;
+        double mean_ns;
+        double throughput_mb_s;
+        double allocations_per_call;
+        size_t checksum;            // Sum of result sizes, changes if results do.
+        double hit_rate = -1;       // Caches only.
+    };
+
+    /// Calls picking rank k of distinct paths with probability ~ 1 / k^exponent,
+    /// the most popular paths are mixed with the rest.
+    std::vector<std::string> zipf(rng& r)
+    {
+        std::vector<std::string> distinct;
+        for (size_t i = 0; i < zipf_distinct; ++i) distinct.push_back(i % 2 ? short_url(r) : dot_heavy(r));
+
+        std::vector<double> cdf(zipf_distinct);
+        double total = 0;
+        for (size_t k = 0; k < zipf_distinct; ++k) cdf[k] = total += 1 / std::pow(double(k + 1), zipf_exponent);
+
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < zipf_calls; ++i)
+        {
+            const double u = double(r() >> 11) * 0x1p-53 * total;
+            const size_t k = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+            paths.push_back(distinct[std::min(k, zipf_distinct - 1)]);
+        }
+
+        return paths;
+    }
+
+    using clock = std::chrono::steady_clock;
+
+    /// Cost of reading clock, taken off single call times.
+    double clock_overhead_ns()
+    {
+        std::vector<double> samples(10000);
+        for (auto& sample : samples)
+        {
+            const auto start = clock::now();
+            sample = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        }
+
+        std::sort(samples.begin(), samples.end());
+        return samples[samples.size() / 2];
+    }
+
+    /// Runs call(path) returning result size over all paths: passes timed as a whole
+    /// for throughput, then every call timed for latency percentiles.
+    template <class Call>
+    result measure(const char* profile, const char* variant, const std::vector<std::string>& paths,
+        double overhead_ns, const Call& call)
+    {
+        result r = { profile, variant, paths.size(), 0, 0, 0, 0, 0, 0, 0 };
+        for (const auto& path : paths) r.bytes += path.size();
+
+        // Warm-up pass, results are summed so that calls can't be dropped.
+        for (const auto& path : paths) r.checksum += call(path);
+
+        std::vector<double> pass_ns;
+        size_t sink = 0;
+
+        for (size_t pass = 0; pass < throughput_passes; ++pass)
+        {
+            const size_t allocations_before = allocations;
+            const auto start = clock::now();
+
+            for (const auto& path : paths) sink += call(path);
+
+            pass_ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count());
+            r.allocations_per_call = double(allocations - allocations_before) / paths.size();
+        }
+
+        std::sort(pass_ns.begin(), pass_ns.end());
+        const double median_pass_ns = pass_ns[pass_ns.size() / 2];
+        r.throughput_mb_s = r.bytes / median_pass_ns * 1E3;
+        r.mean_ns = median_pass_ns / paths.size();
+
+        std::vector<double> call_ns(paths.size());
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            const auto start = clock::now();
+            sink += call(paths[i]);
+            const double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+            call_ns[i] = std::max(ns - overhead_ns, 0.0);
+        }
+
+        std::sort(call_ns.begin(), call_ns.end());
+        r.p50_ns = call_ns[call_ns.size() / 2];
+        r.p99_ns = call_ns[call_ns.size() * 99 / 100];
+
+        // Every pass gives the same results.
+        if (sink != r.checksum * (throughput_passes + 1)) r.checksum = 0;
+
+        return r;
+    }
+
+    void write_json(std::ostream& out, const std::vector<result>& results, double overhead_ns)
+    {
+        out << "{\n";
+        out << "  \"seed\": " << seed << ",\n";
+        out << "  \"scanner\": \"" << scanner_name(default_scanner()) << "\",\n";
+        out << "  \"clock_overhead_ns\": " << overhead_ns << ",\n";
+        out << "  \"results\": [\n";
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto& r = results[i];
+            out << "    { \"profile\": \"" << r.profile << "\", \"variant\": \"" << r.variant << "\""
+                << ", \"paths\": " << r.paths << ", \"bytes\": " << r.bytes
+                << ", \"p50_ns\": " << r.p50_ns << ", \"p99_ns\": " << r.p99_ns << ", \"mean_ns\": " << r.mean_ns
+                << ", \"throughput_mb_s\": " << r.throughput_mb_s
+                << ", \"allocations_per_call\": " << r.allocations_per_call
+                << ", \"checksum\": " << r.checksum;
+            if (r.hit_rate >= 0) out << ", \"hit_rate\": " << r.hit_rate;
+            out << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+
+        out << "  ]\n";
+        out << "}\n";
+    }
+}
+
+/// Workload profiles with fixed seeds, normalize() overloads against
+/// std::filesystem::path::lexically_normal(). Table goes to standard output,
+/// JSON to json_path. Returns exit code.
+int benchmark_suite(const std::string& json_path)
+{
+    using namespace bench;
+
+    std::cout << "Starting benchmark suite, seed " << seed << ", scanner " << scanner_name(default_scanner())
+        << ", please wait..." << std::endl;
+
+    const double overhead_ns = clock_overhead_ns();
+    std::vector<result> results;
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::left << std::setw(12) << "profile" << std::setw(18) << "variant" << std::right
+        << std::setw(10) << "paths" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns"
+        << std::setw(10) << "MB/s" << std::setw(13) << "allocs/call" << std::endl;
+
+    const auto print = [&](size_t first)
+    {
+        for (size_t i = first; i < results.size(); ++i)
+        {
+            const auto& res = results[i];
+            std::cout << std::left << std::setw(12) << res.profile << std::setw(18) << res.variant << std::right
+                << std::setw(10) << res.paths << std::setw(10) << res.p50_ns << std::setw(10) << res.p99_ns
+                << std::setw(10) << res.throughput_mb_s << std::setw(13) << res.allocations_per_call;
+            if (res.hit_rate >= 0) std::cout << "  hits " << res.hit_rate * 100 << "%";
+            std::cout << std::endl;
+        }
+    };
+
+    for (const auto& p : profiles)
+    {
+        rng r(seed);
+
+        std::vector<std::string> paths;
+        for (size_t bytes = 0; bytes < profile_bytes && paths.size() < max_paths; bytes += paths.back().size())
+        {
+            paths.push_back(p.generate(r));
+        }
+
+        std::string out;
+        std::string in_place;
+
+        const size_t first = results.size();
+
+        results.push_back(measure(p.name, "reused_output", paths, overhead_ns, [&](const std::string& path)
+        {
+            normalize(path, out);
+            return out.size();
+        }));
+
+        results.push_back(measure(p.name, "returned_string", paths, overhead_ns, [&](const std::string& path)
+        {
+            return normalize(path).size();
+        }));
+
+        // Copy into reused string is a part of the call.
+        results.push_back(measure(p.name, "in_place", paths, overhead_ns, [&](const std::string& path)
+        {
+            in_place.assign(path);
+            normalize_in_place(in_place);
+            return in_place.size();
+        }));
 
-    const auto duration_sec = total_time_us.count() / 1E6;
-    const auto total_size_mb = total_size / 1E6;
+        results.push_back(measure(p.name, "lexically_normal", paths, overhead_ns, [&](const std::string& path)
+        {
+            return std::filesystem::path(path).lexically_normal().native().size();
+        }));
+
+        print(first);
+    }
+
+    // Skewed workload, the same paths again and again.
+    {
+        rng r(seed);
+        const auto paths = zipf(r);
+
+        std::string out;
+        normalize_cache<> cache(cache_capacity);
+        sharded_normalize_cache<> sharded(cache_capacity);
+
+        const size_t first = results.size();
+
+        results.push_back(measure("zipf", "reused_output", paths, overhead_ns, [&](const std::string& path)
+        {
+            normalize(path, out);
+            return out.size();
+        }));
+
+        results.push_back(measure("zipf", "cache", paths, overhead_ns, [&](const std::string& path)
+        {
+            return cache.normalize(path).size();
+        }));
+        results.back().hit_rate = double(cache.hits()) / (cache.hits() + cache.misses());
+
+        results.push_back(measure("zipf", "sharded_cache", paths, overhead_ns, [&](const std::string& path)
+        {
+            sharded.normalize(path, out);
+            return out.size();
+        }));
+        results.back().hit_rate = double(sharded.hits()) / (sharded.hits() + sharded.misses());
+
+        print(first);
+    }
+
+    std::ofstream json(json_path);
+    write_json(json, results, overhead_ns);
+    json.close();
 
-    std::cout << "Average throughput " << (total_size_mb / duration_sec) << " MB/s" << std::endl;
+    if (!json)
+    {
+        std::cerr << "Unable to write " << json_path << std::endl;
+        return 1;
+    }
+
+    std::cout << "Results written to " << json_path << std::endl;
+    return 0;
 }
 
-int main()
+/// Runs tests and performance test, "--batch [max threads]" runs batch performance
+/// test instead, "--parallel [max threads]" single huge path one. "--stream [file
+/// [threads]]" normalizes lines of file or standard input to standard output.
+/// "--benchmark [json file]" runs benchmark suite.
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "--stream")
+    {
+        return stream_normalize(argc > 2 ? argv[2] : "", argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--benchmark")
+    {
+        return benchmark_suite(argc > 2 ? argv[2] : "benchmark.json");
+    }
+
     test("../bar", "/bar");
     test("/foo/bar", "/foo/bar");
     test("/foo/bar/../baz", "/foo/baz");
@@ -234,7 +2540,24 @@ int main()
     test("domain.com/.../foo", "domain.com/.../foo");          // Sorry, garbage in - garbage out
     test(".../domain.com/.../foo", ".../domain.com/.../foo");  // Sorry, garbage in - garbage out
 
-    performance_test();
+    test_policies();
+    test_cache();
+    test_batch();
+    test_lines();
+    test_parallel();
+
+    if (argc > 1 && std::string(argv[1]) == "--batch")
+    {
+        batch_performance_test(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0);
+    }
+    else if (argc > 1 && std::string(argv[1]) == "--parallel")
+    {
+        parallel_performance_test(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0);
+    }
+    else
+    {
+        performance_test();
+    }
 
     return tests_failed;
 }